@@ -6,23 +6,80 @@
 #include <stdio.h>
 #include <float.h>
 #include <math.h>
-#include "sann.h"
+#include "sann_priv.h"
 
 #define SANN_TRAIN_FUZZY .005
 
+static int64_t train_parse_size(const char *s) // with an optional K, M or G suffix
+{
+	char *p;
+	double x = strtod(s, &p);
+	if (*p == 'K' || *p == 'k') x *= 1024.;
+	else if (*p == 'M' || *p == 'm') x *= 1024. * 1024.;
+	else if (*p == 'G' || *p == 'g') x *= 1024. * 1024. * 1024.;
+	return (int64_t)(x + .499);
+}
+
+/*
+ * Choose the in-memory storage that keeps the estimated peak memory under
+ * $budget. Compact storage reads samples directly from the files, without
+ * holding them as floats first. Return the storage type or -1 if nothing fits.
+ */
+static int train_fit_budget(int64_t budget, int dtype, const sann_tconf_t *tc, const sann_t *m, int n_layers, const int32_t *n_hidden, const char *fn_x, const char *fn_y, int n_label)
+{
+	int N, n_in, n_out = 0, N_y, n_par, t;
+	int64_t name_size, tmp, est[3];
+	if (sann_data_scan(fn_x, &N, &n_in, &name_size) < 0 || (fn_y && sann_data_scan_nl(fn_y, n_label, &N_y, &n_out, &tmp) < 0)) {
+		fprintf(stderr, "[E::%s] failed to scan the samples; option -M needs them in files, not stdin\n", __func__);
+		return -1;
+	}
+	if (m) n_par = sann_n_par(m);
+	else if (fn_y == 0) n_par = sae_n_par(n_in, n_hidden[0]);
+	else {
+		int32_t *n_neurons;
+		n_neurons = (int32_t*)alloca((n_layers + 2) * 4);
+		n_neurons[0] = n_in, n_neurons[n_layers+1] = n_out;
+		memcpy(n_neurons + 1, n_hidden, n_layers * 4);
+		n_par = sfnn_n_par(n_layers + 2, n_neurons);
+	}
+	for (t = 0; t < 3; ++t) {
+		est[t] = sann_data_mem(N, n_in, t) + (fn_y? sann_data_mem(N, n_out, t) : 0) + name_size;
+		if (t == SANN_DT_F32) est[t] += (int64_t)N * sizeof(void*) * (fn_y? 2 : 1); // views created by sann_train()
+		est[t] += (int64_t)n_par * sizeof(float) + sann_mem_train(tc, n_par, N);
+	}
+	fprintf(stderr, "[M::%s] estimated peak memory: %.1f MB with float, %.1f MB with fp16, %.1f MB with uint8 storage\n",
+			__func__, est[SANN_DT_F32] / 1048576., est[SANN_DT_F16] / 1048576., est[SANN_DT_U8] / 1048576.);
+	if (dtype >= 0) { // storage set on the command line
+		if (est[dtype] <= budget) return dtype;
+	} else {
+		if (est[SANN_DT_F32] <= budget) return SANN_DT_F32;
+		if (est[SANN_DT_F16] <= budget) return SANN_DT_F16;
+		if (est[SANN_DT_U8] <= budget) return SANN_DT_U8;
+		dtype = SANN_DT_U8;
+	}
+	fprintf(stderr, "[E::%s] the estimated peak memory of %.1f MB exceeds the budget of %.1f MB\n", __func__, est[dtype] / 1048576., budget / 1048576.);
+	return -1;
+}
+
 int main_train(int argc, char *argv[])
 {
-	int c, i, N, n_in, n_out = 0, af = -1, scaled = SAE_SC_SQRT, malgo = 0, balgo = 0;
+	int c, i, N = 0, N_y = 0, n_in = 0, n_out = 0, af = -1, out_af = -1, scaled = SAE_SC_SQRT, malgo = 0, balgo = 0, dtype = -1, ret = -1, rank = 0, n_ranks = 1, n_label = 0;
+	int n_names_in = 0, n_names_out = 0; // number of column names, which may come from the model
 	int32_t n_layers = 3, *n_neurons, *o_h_neurons = 0, o_h_layers = 0, def_n_hidden = 50;
-	float **x, **y;
+	float **x = 0, **y = 0;
 	sann_t *m = 0;
 	sann_tconf_t tc, tc1;
-	char **row_names, **col_names_in = 0, **col_names_out = 0, *fnout = 0;
+	const char *fnin = 0;
+	char **row_names = 0, **col_names_in = 0, **col_names_out = 0, *fnout = 0, **addr = 0, *fn_trace = 0;
+	int prof = 0;
+	int64_t budget = 0;
+	double t0;
+	sann_data_t *dx = 0, *dy = 0;
 
 	sann_srand(11);
 	memset(&tc1, 0, sizeof(sann_tconf_t));
-	tc1.r_in = tc1.r_hidden = tc1.vfrac = -1.0f;
-	while ((c = getopt(argc, argv, "l:h:n:r:R:e:i:s:f:S:T:m:b:B:o:")) >= 0) {
+	tc1.r_in = tc1.r_hidden = tc1.vfrac = tc1.wd = -1.0f;
+	while ((c = getopt(argc, argv, "l:h:n:r:R:e:i:s:f:F:S:T:m:b:B:o:Q:t:c:C:uw:P:D:K:vV:HM:L:")) >= 0) {
 		if (c == 'n') tc1.n_epochs = atoi(optarg);
 		else if (c == 'r') tc1.r_in = atof(optarg);
 		else if (c == 'R') tc1.r_hidden = atof(optarg);
@@ -31,12 +88,41 @@ int main_train(int argc, char *argv[])
 		else if (c == 'l') tc1.max_inc = atoi(optarg);
 		else if (c == 'B') tc1.mini_batch = atoi(optarg);
 		else if (c == 'o') fnout = optarg;
-		else if (c == 'i') m = sann_restore(optarg, &col_names_in, &col_names_out);
+		else if (c == 'i') fnin = optarg;
 		else if (c == 's') sann_srand(atol(optarg));
 		else if (c == 'f') af = atoi(optarg);
+		else if (c == 'F') out_af = atoi(optarg);
 		else if (c == 'S') scaled = atoi(optarg);
 		else if (c == 'm') malgo = atoi(optarg);
 		else if (c == 'b') balgo = atoi(optarg);
+		else if (c == 'Q') dtype = atoi(optarg);
+		else if (c == 't') tc1.n_threads = atoi(optarg);
+		else if (c == 'c') tc1.fn_ckpt = optarg;
+		else if (c == 'C') tc1.ckpt_intv = atoi(optarg);
+		else if (c == 'u') tc1.resume = 1;
+		else if (c == 'w') tc1.wd = atof(optarg);
+		else if (c == 'D') rank = atoi(optarg);
+		else if (c == 'v') prof = prof? prof : 1;
+		else if (c == 'V') prof = prof? prof : 1, fn_trace = optarg;
+		else if (c == 'H') prof = 2;
+		else if (c == 'M') budget = train_parse_size(optarg);
+		else if (c == 'L') n_label = atoi(optarg);
+		else if (c == 'K') tc1.sync_intv = atoi(optarg);
+		else if (c == 'P') {
+			char *p, *q;
+			for (p = optarg, n_ranks = 1; *p; ++p)
+				if (*p == ',') ++n_ranks;
+			addr = (char**)alloca(n_ranks * sizeof(char*));
+			for (p = q = optarg, i = 0;; ++p) {
+				if (*p == ',' || *p == 0) {
+					addr[i] = (char*)alloca(p - q + 1);
+					strncpy(addr[i], q, p - q);
+					addr[i++][p - q] = 0;
+					if (*p == 0) break;
+					q = p + 1;
+				}
+			}
+		}
 		else if (c == 'h') {
 			char *p;
 			int i = 0, n_commas = 0;
@@ -63,45 +149,119 @@ int main_train(int argc, char *argv[])
 		fprintf(stderr, "    -i FILE       read model from FILE []\n");
 		fprintf(stderr, "    -h INT[,INT]  number of hidden neurons (use ',' to add a hidden layer) [%d]\n", def_n_hidden);
 		fprintf(stderr, "    -f INT        hidden activation (1:sigm; 2:tanh; 3:ReLU) [1 for AE; 3 for FNN]\n");
+		fprintf(stderr, "    -F INT        output activation for FNN (1:sigm; 4:softmax, for classes that are mutually exclusive) [1]\n");
+		fprintf(stderr, "    -L INT        one-hot columns for IDX labels [output size of -i; largest label plus one otherwise]\n");
 		fprintf(stderr, "    -s INT        random seed [11]\n");
 		fprintf(stderr, "    -o FILE       save trained model to FILE [stdout]\n");
 		fprintf(stderr, "    -S INT        weight scaling for autoencoders (0:none; 1:sqrt; 2:full) [%d]\n", scaled);
 		fprintf(stderr, "  Model training:\n");
-		fprintf(stderr, "    -m INT        minibatch optimization algorithm (1:SGD; 2:RMSprop) [%d]\n", SANN_MIN_MINI_RMSPROP);
-		fprintf(stderr, "    -b INT        batch optimization algorithm (1:fixed rate; 2:iRprop- adaptive) [%d]\n", SANN_MIN_BATCH_RPROP);
-		fprintf(stderr, "    -e FLOAT      learning rate [.01 for SGD; .001 for RMSprop]\n");
+		fprintf(stderr, "    -m INT        minibatch optimization algorithm (1:SGD; 2:RMSprop; 3:Adam) [%d]\n", SANN_MIN_MINI_RMSPROP);
+		fprintf(stderr, "    -b INT        batch optimization algorithm (1:fixed rate; 2:iRprop- adaptive; 3:full-batch L-BFGS) [%d]\n", SANN_MIN_BATCH_RPROP);
+		fprintf(stderr, "    -e FLOAT      learning rate [.01 for SGD; .001 for RMSprop and Adam]\n");
+		fprintf(stderr, "    -w FLOAT      decoupled weight decay for Adam [.01]\n");
 		fprintf(stderr, "    -r FLOAT      dropout rate at the input layer [%g]\n", tc.r_in);
 		fprintf(stderr, "    -R FLOAT      dropout rate at the hidden layer(s) (FNN only) [%g]\n", tc.r_hidden);
 		fprintf(stderr, "    -T FLOAT      fraction of data used for testing [%g]\n", tc.vfrac);
 		fprintf(stderr, "    -n INT        max number of epochs [%d]\n", tc.n_epochs);
 		fprintf(stderr, "    -l INT        stop if validation cost not reduced after INT epochs [%d]\n", tc.max_inc);
 		fprintf(stderr, "    -B INT        size of a minibatch [%d]\n", tc.mini_batch);
+		fprintf(stderr, "    -t INT        number of threads [%d]\n", tc.n_threads);
+		fprintf(stderr, "    -Q INT        in-memory sample storage (0:float; 1:uint8; 2:fp16) [1 for IDX input; 0 otherwise]\n");
+		fprintf(stderr, "    -M NUM[K|M|G] choose the storage to stay under this memory budget, or fail before loading []\n");
+		fprintf(stderr, "    -v            print time spent in each phase after each epoch\n");
+		fprintf(stderr, "    -V FILE       also write a Chrome trace of the phases to FILE (implies -v) []\n");
+		fprintf(stderr, "    -H            also count CPU cycles, instructions, LLC and dTLB misses (implies -v)\n");
+		fprintf(stderr, "  Checkpointing:\n");
+		fprintf(stderr, "    -c FILE       write checkpoints to FILE []\n");
+		fprintf(stderr, "    -C INT        write a checkpoint every INT epochs [%d]\n", tc.ckpt_intv);
+		fprintf(stderr, "    -u            resume from the checkpoint set by -c if present; other options must be unchanged\n");
+		fprintf(stderr, "  Data-parallel training (start one process per address with the same options):\n");
+		fprintf(stderr, "    -P STR        comma-separated host:port of all processes []\n");
+		fprintf(stderr, "    -D INT        index of this process in the list set by -P [%d]\n", rank);
+		fprintf(stderr, "    -K INT        average parameters across processes every INT minibatches [%d]\n", tc.sync_intv);
 		fprintf(stderr, "\n");
 		fprintf(stderr, "Notes: the most important parameters are -e and -h.\n");
 		return 1;
 	}
 
+	if (af == SANN_AF_SOFTMAX || (out_af > 0 && out_af != SANN_AF_SIGM && out_af != SANN_AF_SOFTMAX)) {
+		fprintf(stderr, "[E::%s] softmax is only available at the output layer, and the output can only be sigmoid or softmax\n", __func__);
+		return 1;
+	}
 	if (tc1.h > 0.0f) tc.h = tc1.h;
+	if (tc1.wd >= 0.0f) tc.wd = tc1.wd;
 	if (tc1.r_in >= 0.0f) tc.r_in = tc1.r_in; 
 	if (tc1.r_hidden >= 0.0f) tc.r_hidden = tc1.r_hidden; 
 	if (tc1.vfrac >= 0.0f) tc.vfrac = tc1.vfrac; 
 	if (tc1.n_epochs > 0) tc.n_epochs = tc1.n_epochs; 
 	if (tc1.max_inc > 0) tc.max_inc = tc1.max_inc;
 	if (tc1.mini_batch > 0) tc.mini_batch = tc1.mini_batch;
+	if (tc1.n_threads > 0) tc.n_threads = tc1.n_threads;
+	if (tc1.ckpt_intv > 0) tc.ckpt_intv = tc1.ckpt_intv;
+	if (tc1.sync_intv > 0) tc.sync_intv = tc1.sync_intv;
+	tc.fn_ckpt = tc1.fn_ckpt, tc.resume = tc1.resume;
+	if (addr) {
+		if (rank < 0 || rank >= n_ranks) {
+			fprintf(stderr, "[E::%s] option -D must be in [0,%d)\n", __func__, n_ranks);
+			return 1;
+		}
+		if (tc.fn_ckpt && sann_verbose >= 2)
+			fprintf(stderr, "[W::%s] checkpointing is not supported with -P; option -c is ignored\n", __func__);
+		if ((tc.dist = sann_dist_init(rank, n_ranks, addr)) == 0) return 1;
+		fprintf(stderr, "[M::%s] connected as process %d of %d\n", __func__, rank, n_ranks);
+	}
 
-	x = sann_data_read(argv[optind], &N, &n_in, &row_names, col_names_in? 0 : &col_names_in);
+	if (prof) tc.prof = sann_prof_init(fn_trace != 0);
+	if (prof == 2 && sann_prof_hw_open(tc.prof) != (1<<SANN_N_HW) - 1 && sann_verbose >= 2)
+		fprintf(stderr, "[W::%s] some hardware counters are unavailable; check /proc/sys/kernel/perf_event_paranoid\n", __func__);
+	t0 = sann_prof_time();
+	if (fnin && (m = sann_restore(fnin, &col_names_in, &col_names_out)) != 0) {
+		if (col_names_in) n_names_in = sann_n_in(m);
+		if (col_names_out) n_names_out = sann_n_out(m);
+		if (m->is_fnn) n_label = sann_n_out(m); // labels absent from this input still get their columns
+	}
+	if (budget > 0) {
+		if ((dtype = train_fit_budget(budget, dtype, &tc, m, o_h_layers, o_h_neurons, argv[optind], optind + 1 < argc? argv[optind+1] : 0, n_label)) < 0)
+			goto end_train;
+		fprintf(stderr, "[M::%s] using storage type %d for a memory budget of %.1f MB\n", __func__, dtype, budget / 1048576.);
+	}
+	if (dtype < 0 && sann_data_idx_dim(argv[optind]) > 0) { // pixels and one-hot labels are exact in uint8
+		dtype = SANN_DT_U8;
+		fprintf(stderr, "[M::%s] reading IDX input into uint8 storage\n", __func__);
+	}
+	if (dtype < 0) dtype = SANN_DT_F32;
+	if (dtype != SANN_DT_F32) { // read into compact storage; never hold samples as floats
+		if ((dx = sann_data_read_packed(argv[optind], dtype, &row_names, col_names_in? 0 : &col_names_in)) == 0)
+			goto end_train;
+		N = dx->n, n_in = dx->n_col;
+	} else x = sann_data_read(argv[optind], &N, &n_in, &row_names, col_names_in? 0 : &col_names_in);
+	if (n_names_in == 0) n_names_in = n_in;
 	fprintf(stderr, "[M::%s] read %d vectors, each of size %d\n", __func__, N, n_in);
+	if (N == 0) {
+		fprintf(stderr, "[E::%s] failed to read samples from '%s'\n", __func__, argv[optind]);
+		goto end_train;
+	}
 	if (optind + 1 < argc) {
-		y = sann_data_read(argv[optind+1], &N, &n_out, 0, col_names_out? 0 : &col_names_out);
-		fprintf(stderr, "[M::%s] read %d vectors, each of size %d\n", __func__, N, n_out);
-	} else y = 0;
+		if (dtype != SANN_DT_F32) {
+			if ((dy = sann_data_read_packed_nl(argv[optind+1], dtype, n_label, 0, col_names_out? 0 : &col_names_out)) == 0)
+				goto end_train;
+			N_y = dy->n, n_out = dy->n_col;
+		} else y = sann_data_read_nl(argv[optind+1], n_label, &N_y, &n_out, 0, col_names_out? 0 : &col_names_out);
+		if (n_names_out == 0) n_names_out = n_out;
+		fprintf(stderr, "[M::%s] read %d vectors, each of size %d\n", __func__, N_y, n_out);
+		if (N_y != N) {
+			fprintf(stderr, "[E::%s] different number of samples in the input and the output: %d != %d\n", __func__, N, N_y);
+			goto end_train;
+		}
+	}
+	sann_prof_add(tc.prof, SANN_PH_LOAD, 0, t0, sann_prof_time() - t0, 1);
 
 	if (m) {
 		if ((m->is_fnn && optind+1 == argc) || (!m->is_fnn && optind+1 < argc))
 			fprintf(stderr, "[M::%s] mismatch between the input model and the command line\n", __func__);
 		if (sann_n_in(m) != n_in) {
 			fprintf(stderr, "[E::%s] the model does not match the input: %d != %d\n", __func__, sann_n_in(m), n_in);
-			return 1; // FIXME: memory leak
+			goto end_train;
 		}
 	} else {
 		if (optind + 1 == argc) { // AE
@@ -115,20 +275,84 @@ int main_train(int argc, char *argv[])
 			m = sann_init_fnn(n_layers, n_neurons);
 			if (af > 0)
 				for (i = 0; i < m->n_layers - 2; ++i) m->af[i] = af;
+			if (out_af > 0) m->af[m->n_layers - 2] = out_af;
+			if (out_af == SANN_AF_SOFTMAX && n_out < 2 && sann_verbose >= 2)
+				fprintf(stderr, "[W::%s] softmax over a single output is constant\n", __func__);
 		}
 	}
 
-	sann_data_shuffle(N, x, y, row_names);
-	sann_train(m, &tc, N, x, y);
-	sann_dump(fnout, m, col_names_in, col_names_out);
+	if (dx) sann_data_shuffle(N, (float**)dx->row, dy? (float**)dy->row : 0, row_names); // rows of compact storage are shuffled as pointers
+	else sann_data_shuffle(N, x, y, row_names);
+	if (tc.dist) { // keep a share of the training samples; process 0 also keeps all validation samples
+		int n_test = (int)(N * tc.vfrac), n_train = N - n_test, n = 0;
+		for (i = 0; i < N; ++i) {
+			if (i < n_train? i % n_ranks == rank : rank == 0) {
+				if (dx) {
+					dx->row[n] = dx->row[i];
+					if (dy) dy->row[n] = dy->row[i];
+				} else {
+					x[n] = x[i];
+					if (y) y[n] = y[i];
+				}
+				row_names[n++] = row_names[i];
+			} else {
+				if (x) { // rows in compact storage are kept until the end
+					free(x[i]);
+					if (y) free(y[i]);
+					sann_mem_add(SANN_MEM_DATA, -(int64_t)(n_in * sizeof(float) + sizeof(float*)) - (y? n_out * sizeof(float) + sizeof(float*) : 0));
+				}
+				sann_mem_add(SANN_MEM_DATA, -(int64_t)(strlen(row_names[i]) + 1 + sizeof(char*)));
+				free(row_names[i]);
+			}
+		}
+		tc.vfrac = rank == 0 && n_test > 0? (n_test + .5f) / n : 0.0f;
+		N = n, N_y = y? n : 0;
+		fprintf(stderr, "[M::%s] process %d keeps %d samples\n", __func__, rank, N);
+	}
+	if (dx) {
+		int N0 = dx->n;
+		dx->n = N;
+		if (dy) dy->n = N;
+		ret = sann_train_data(m, &tc, dx, dy);
+		dx->n = N0; // for the memory accounting in sann_data_destroy()
+		if (dy) dy->n = N0;
+		sann_data_destroy(dx);
+		sann_data_destroy(dy);
+		dx = dy = 0;
+	} else ret = sann_train(m, &tc, N, x, y);
+	if (ret >= 0 && rank == 0) {
+		t0 = sann_prof_time();
+		sann_dump(fnout, m, col_names_in, col_names_out);
+		sann_prof_add(tc.prof, SANN_PH_DUMP, 0, t0, sann_prof_time() - t0, 1);
+	}
+	if (tc.prof) {
+		fprintf(stderr, "[M::%s] total time", __func__);
+		sann_prof_print(tc.prof, 0);
+		fputc('\n', stderr);
+		if (tc.prof->hwc) {
+			fprintf(stderr, "[M::%s] total hw", __func__);
+			sann_prof_hw_print(tc.prof, 0);
+			fputc('\n', stderr);
+		}
+		if (fn_trace && sann_prof_trace(fn_trace, tc.prof) != 0)
+			fprintf(stderr, "[W::%s] failed to write the trace to '%s'\n", __func__, fn_trace);
+	}
+	fprintf(stderr, "[M::%s] peak memory: %.1f MB;", __func__, sann_mem_usage(-1, 1) / 1048576.);
+	sann_mem_print(1);
+	fputc('\n', stderr);
 
-	sann_free_names(n_in, col_names_in);
-	sann_free_names(n_out, col_names_out);
+end_train:
+	sann_free_names(n_names_in, col_names_in);
+	sann_free_names(n_names_out, col_names_out);
 	sann_free_names(N, row_names);
 	sann_free_vectors(N, x);
-	sann_free_vectors(N, y);
+	sann_free_vectors(N_y, y);
+	sann_data_destroy(dx);
+	sann_data_destroy(dy);
 	sann_destroy(m);
-	return 0;
+	sann_dist_destroy(tc.dist);
+	sann_prof_destroy(tc.prof);
+	return ret < 0? 1 : 0;
 }
 
 int main_apply(int argc, char *argv[])
@@ -136,21 +360,32 @@ int main_apply(int argc, char *argv[])
 	int i, j, c, n_samples, n_in, show_hidden = 0;
 	sann_t *m;
 	float **x, *y, *z;
-	double cost;
+	double cost, t0, t1 = 0., t_fwd = 0., t_out = 0.;
 	char **row_names, **col_names_in = 0, **col_names_out = 0;
+	sann_prof_t *prof = 0;
+	int64_t h0[SANN_N_HW], h1[SANN_N_HW];
 
-	while ((c = getopt(argc, argv, "h")) >= 0) {
+	while ((c = getopt(argc, argv, "hvH")) >= 0) {
 		if (c == 'h') show_hidden = 1;
+		else if (c == 'v' || c == 'H') {
+			if (prof == 0) prof = sann_prof_init(0);
+			if (c == 'H' && sann_prof_hw_open(prof) != (1<<SANN_N_HW) - 1 && sann_verbose >= 2)
+				fprintf(stderr, "[W::%s] some hardware counters are unavailable; check /proc/sys/kernel/perf_event_paranoid\n", __func__);
+		}
 	}
 	if (argc - optind < 2) {
 		fprintf(stderr, "Usage: sann apply [options] <model> <data>\n");
 		fprintf(stderr, "Options:\n");
-		fprintf(stderr, "  -h        show the activation of hidden neurons\n");
+		fprintf(stderr, "  -h        show the activation of hidden neurons; for an AE, the decoder is skipped and no cost is reported\n");
+		fprintf(stderr, "  -v        print time spent in each phase\n");
+		fprintf(stderr, "  -H        also count CPU cycles, instructions, LLC and dTLB misses (implies -v)\n");
 		return 1;
 	}
 
+	t0 = sann_prof_time();
 	m = sann_restore(argv[optind], &col_names_in, &col_names_out);
 	x = sann_data_read(argv[optind+1], &n_samples, &n_in, &row_names, col_names_in? 0 : &col_names_in);
+	sann_prof_add(prof, SANN_PH_LOAD, 0, t0, sann_prof_time() - t0, 1);
 	if (sann_n_in(m) != n_in) {
 		fprintf(stderr, "[M::%s] mismatch between the input model and the input data\n", __func__);
 		return 1;
@@ -170,9 +405,15 @@ int main_apply(int argc, char *argv[])
 
 	y = (float*)malloc((sann_n_out(m) + sae_n_hidden(m)) * sizeof(float));
 	z = y + sann_n_out(m);
+	t0 = sann_prof_time();
 	for (i = 0, cost = 0.; i < n_samples; ++i) {
-		sann_apply(m, x[i], y, z);
-		if (!m->is_fnn) cost += sann_cost(sann_n_out(m), x[i], y);
+		if (prof) sann_prof_hw_read(prof, h0), t1 = sann_prof_time();
+		sann_apply(m, x[i], show_hidden && !m->is_fnn? 0 : y, z); // the decoder is skipped with -h
+		if (prof) {
+			t_fwd += sann_prof_time() - t1, t1 = sann_prof_time();
+			sann_prof_hw_read(prof, h1), sann_prof_hw_add(prof, SANN_PH_FORWARD, h0, h1);
+		}
+		if (!m->is_fnn && !show_hidden) cost += sann_cost(sann_n_out(m), x[i], y);
 		printf("%s", row_names[i]);
 		if (show_hidden && !m->is_fnn) {
 			for (j = 0; j < sae_n_hidden(m); ++j)
@@ -182,14 +423,28 @@ int main_apply(int argc, char *argv[])
 				printf("\t%g", y[j] + 1.0f - 1.0f);
 		}
 		putchar('\n');
+		if (prof) t_out += sann_prof_time() - t1;
 		free(x[i]);
 	}
 	free(x); free(y);
+	sann_prof_add(prof, SANN_PH_FORWARD, 0, t0, t_fwd, n_samples);
+	sann_prof_add(prof, SANN_PH_DUMP, 0, t0 + t_fwd, t_out, n_samples);
 	sann_free_names(n_samples, row_names);
 	sann_free_names(sann_n_in(m), col_names_in);
 	sann_free_names(sann_n_out(m), col_names_out);
 
-	if (!m->is_fnn) fprintf(stderr, "[M::%s] cost = %g\n", __func__, cost / n_samples);
+	if (!m->is_fnn && !show_hidden) fprintf(stderr, "[M::%s] cost = %g\n", __func__, cost / n_samples);
+	if (prof) {
+		fprintf(stderr, "[M::%s] total time", __func__);
+		sann_prof_print(prof, 0);
+		fputc('\n', stderr);
+		if (prof->hwc) {
+			fprintf(stderr, "[M::%s] total hw", __func__);
+			sann_prof_hw_print(prof, 0);
+			fputc('\n', stderr);
+		}
+		sann_prof_destroy(prof);
+	}
 
 	sann_destroy(m);
 	return 0;
@@ -200,6 +455,14 @@ int main_apply(int argc, char *argv[])
  *****************/
 
 int main_jacob(int argc, char *argv[]);
+int main_tune(int argc, char *argv[]);
+int main_bench(int argc, char *argv[]);
+int main_pretrain(int argc, char *argv[]);
+int main_prune(int argc, char *argv[]);
+int main_distill(int argc, char *argv[]);
+int main_factorize(int argc, char *argv[]);
+int main_eval(int argc, char *argv[]);
+int main_snd(int argc, char *argv[]);
 
 void liftrlimit()
 {
@@ -244,6 +507,14 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "  train      train the model\n");
 		fprintf(stderr, "  apply      apply the model\n");
 		fprintf(stderr, "  jacob      compute jacobian d{output}/d{input}\n");
+		fprintf(stderr, "  tune       search for training hyperparameters\n");
+		fprintf(stderr, "  bench      measure training and inference throughput\n");
+		fprintf(stderr, "  pretrain   train stacked autoencoders layer by layer to initialize an FNN\n");
+		fprintf(stderr, "  prune      zero the smallest weights of an FNN and store them as sparse\n");
+		fprintf(stderr, "  distill    train a small FNN on the outputs of a large one\n");
+		fprintf(stderr, "  factorize  replace FNN layers with low-rank factors\n");
+		fprintf(stderr, "  eval       compute cost, accuracy and AUC of predictions\n");
+		fprintf(stderr, "  snd        select, reorder and transform columns of SND files\n");
 		fprintf(stderr, "  version    show version number\n");
 		return 1;
 	}
@@ -251,6 +522,14 @@ int main(int argc, char *argv[])
 	if (strcmp(argv[1], "train") == 0) ret = main_train(argc-1, argv+1);
 	else if (strcmp(argv[1], "apply") == 0) ret = main_apply(argc-1, argv+1);
 	else if (strcmp(argv[1], "jacob") == 0) ret = main_jacob(argc-1, argv+1);
+	else if (strcmp(argv[1], "tune") == 0) ret = main_tune(argc-1, argv+1);
+	else if (strcmp(argv[1], "bench") == 0) ret = main_bench(argc-1, argv+1);
+	else if (strcmp(argv[1], "pretrain") == 0) ret = main_pretrain(argc-1, argv+1);
+	else if (strcmp(argv[1], "prune") == 0) ret = main_prune(argc-1, argv+1);
+	else if (strcmp(argv[1], "distill") == 0) ret = main_distill(argc-1, argv+1);
+	else if (strcmp(argv[1], "factorize") == 0) ret = main_factorize(argc-1, argv+1);
+	else if (strcmp(argv[1], "eval") == 0) ret = main_eval(argc-1, argv+1);
+	else if (strcmp(argv[1], "snd") == 0) ret = main_snd(argc-1, argv+1);
 	else if (strcmp(argv[1], "version") == 0) {
 		puts(SANN_VERSION);
 		return 0;
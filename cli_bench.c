@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include "sann_priv.h"
+
+/*
+ * Throughput benchmark. FLOP counts only include multiply-adds in the weight
+ * matrices: a forward pass takes 2 FLOPs per weight (4 for the tied weights
+ * of an AE) and a training step is counted as three forward passes.
+ */
+
+static double bench_time(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static double bench_flop_forward(const sann_t *m)
+{
+	int k;
+	double f = 0.;
+	if (!m->is_fnn) return 4. * sae_n_in(m) * sae_n_hidden(m);
+	for (k = 1; k < m->n_layers; ++k)
+		f += 2. * m->n_neurons[k-1] * m->n_neurons[k];
+	return f;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y? -1 : x > y? 1 : 0;
+}
+
+// IPC, LLC misses per sample and dTLB misses per sample; negative if unavailable
+static void bench_hw(int avail, const int64_t *v, int64_t n, double r[3])
+{
+	r[0] = (avail>>SANN_HW_CYCLES&1) && (avail>>SANN_HW_INSTR&1) && v[SANN_HW_CYCLES] > 0? (double)v[SANN_HW_INSTR] / v[SANN_HW_CYCLES] : -1.;
+	r[1] = (avail>>SANN_HW_LLC_MISS&1) && n > 0? (double)v[SANN_HW_LLC_MISS] / n : -1.;
+	r[2] = (avail>>SANN_HW_DTLB_MISS&1) && n > 0? (double)v[SANN_HW_DTLB_MISS] / n : -1.;
+}
+
+static float **bench_synthetic(int n, int n_col, int binary)
+{
+	float **x;
+	int i, j;
+	x = (float**)malloc(n * sizeof(float*));
+	for (i = 0; i < n; ++i) {
+		x[i] = (float*)malloc(n_col * sizeof(float));
+		for (j = 0; j < n_col; ++j)
+			x[i][j] = binary? (sann_drand() < .5? 0.0f : 1.0f) : sann_drand();
+	}
+	return x;
+}
+
+static void bench_put_str(const char *s, int json) // escaped for a JSON string if $json is set
+{
+	if (!json) {
+		fputs(s, stdout);
+		return;
+	}
+	for (; *s; ++s) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') putchar('\\'), putchar(c);
+		else if (c < 0x20) printf("\\u%04x", c);
+		else putchar(c);
+	}
+}
+
+int main_bench(int argc, char *argv[])
+{
+	int c, i, N = 10000, N_y = 0, n_in = 784, n_out = 10, n_rep = 3, n_lat = 10000, malgo = 0, dtype = SANN_DT_F32, json = 0, mini_batch = 0, n_threads = 1, hw = 0, avail = 0;
+	int32_t n_hidden = 1, *h_neurons, def_neurons = 100;
+	sann_trainer_t *tr;
+	double t, t_train, t_infer, *lat, f_fwd, r_train[3], r_infer[3];
+	int64_t h0[SANN_N_HW], h1[SANN_N_HW], h_train[SANN_N_HW];
+	sann_prof_t *prof = 0;
+	float **x, **y = 0, *out;
+	sann_t *m;
+	sann_tconf_t tc;
+	sann_data_t *dx, *dy = 0;
+	const char *src = "synthetic";
+
+	h_neurons = &def_neurons;
+	sann_srand(11);
+	while ((c = getopt(argc, argv, "i:h:o:N:n:l:t:m:B:Q:s:jH")) >= 0) {
+		if (c == 'i') n_in = atoi(optarg);
+		else if (c == 'o') n_out = atoi(optarg);
+		else if (c == 'N') N = atoi(optarg);
+		else if (c == 'n') n_rep = atoi(optarg);
+		else if (c == 'l') n_lat = atoi(optarg);
+		else if (c == 't') n_threads = atoi(optarg);
+		else if (c == 'm') malgo = atoi(optarg);
+		else if (c == 'B') mini_batch = atoi(optarg);
+		else if (c == 'Q') dtype = atoi(optarg);
+		else if (c == 's') sann_srand(atol(optarg));
+		else if (c == 'j') json = 1;
+		else if (c == 'H') hw = 1;
+		else if (c == '?') n_rep = 0; // print the usage
+		else if (c == 'h') {
+			char *p;
+			for (p = optarg, n_hidden = 1; *p; ++p)
+				if (*p == ',') ++n_hidden;
+			h_neurons = (int32_t*)alloca(n_hidden * 4);
+			for (p = optarg, i = 0; i < n_hidden; ++i, ++p)
+				h_neurons[i] = strtol(p, &p, 10);
+		}
+	}
+	if (n_rep < 1 || N < 1) {
+		fprintf(stderr, "Usage: sann bench [options] [input.snd [output.snd]]\n");
+		fprintf(stderr, "Options:\n");
+		fprintf(stderr, "  Model (shape taken from the input files if present):\n");
+		fprintf(stderr, "    -i INT        number of input neurons [784]\n");
+		fprintf(stderr, "    -h INT[,INT]  number of hidden neurons [100]\n");
+		fprintf(stderr, "    -o INT        number of output neurons; 0 for an autoencoder [10]\n");
+		fprintf(stderr, "  Benchmark:\n");
+		fprintf(stderr, "    -N INT        number of synthetic samples [10000]\n");
+		fprintf(stderr, "    -n INT        number of training epochs to time [3]\n");
+		fprintf(stderr, "    -l INT        number of single-sample calls to time [10000]\n");
+		fprintf(stderr, "    -t INT        number of threads [1]\n");
+		fprintf(stderr, "    -m INT        minibatch optimization algorithm (1:SGD; 2:RMSprop; 3:Adam) [2]\n");
+		fprintf(stderr, "    -B INT        size of a minibatch [50]\n");
+		fprintf(stderr, "    -Q INT        in-memory sample storage (0:float; 1:uint8; 2:fp16) [0]\n");
+		fprintf(stderr, "    -s INT        random seed [11]\n");
+		fprintf(stderr, "    -j            output JSON instead of TSV\n");
+		fprintf(stderr, "    -H            also report IPC and LLC and dTLB misses per sample, from an extra epoch\n");
+		return 1;
+	}
+
+	if (optind < argc) {
+		x = sann_data_read(argv[optind], &N, &n_in, 0, 0);
+		if (optind + 1 < argc) y = sann_data_read(argv[optind+1], &N_y, &n_out, 0, 0);
+		else n_out = 0, N_y = N;
+		if (N == 0 || N_y != N) {
+			if (N == 0 || N_y == 0) fprintf(stderr, "[E::%s] failed to read samples from '%s'\n", __func__, N == 0? argv[optind] : argv[optind+1]);
+			else fprintf(stderr, "[E::%s] different number of samples in the input and the output: %d != %d\n", __func__, N, N_y);
+			sann_free_vectors(N, x); sann_free_vectors(N_y, y);
+			return 1;
+		}
+		src = argv[optind];
+	} else {
+		x = bench_synthetic(N, n_in, 0);
+		if (n_out > 0) y = bench_synthetic(N, n_out, 1);
+	}
+	if (y) {
+		int32_t *n_neurons;
+		n_neurons = (int32_t*)alloca((n_hidden + 2) * 4);
+		n_neurons[0] = n_in, n_neurons[n_hidden+1] = n_out;
+		memcpy(n_neurons + 1, h_neurons, n_hidden * 4);
+		m = sann_init_fnn(n_hidden + 2, n_neurons);
+	} else m = sann_init_ae(n_in, h_neurons[0], SAE_SC_SQRT);
+	if (dtype != SANN_DT_F32) {
+		dx = sann_data_pack(N, n_in, x, dtype);
+		if (y) dy = sann_data_pack(N, n_out, y, dtype);
+	} else {
+		dx = sann_data_view(N, n_in, x);
+		if (y) dy = sann_data_view(N, n_out, y);
+	}
+
+	sann_tconf_init(&tc, malgo, SANN_MIN_BATCH_FIXED);
+	if (mini_batch > 0) tc.mini_batch = mini_batch;
+	tc.n_threads = n_threads;
+	f_fwd = bench_flop_forward(m);
+
+	tr = sann_trainer_init(m, &tc, N); // working space is allocated once, outside the timed epochs
+	sann_trainer_epoch(tr, N < tc.mini_batch * 4? N : tc.mini_batch * 4, dx, dy); // warm up
+	t = bench_time();
+	for (i = 0; i < n_rep; ++i)
+		sann_trainer_epoch(tr, N, dx, dy);
+	t_train = (bench_time() - t) / n_rep;
+	sann_trainer_destroy(tr);
+
+	t = bench_time();
+	sann_evaluate_range(m, 0, N, dx, dy, n_threads);
+	t_infer = bench_time() - t;
+
+	if (hw) { // counters are read for each sample, so they are collected separately from the timed runs
+		int k;
+		prof = sann_prof_init(0);
+		if ((avail = sann_prof_hw_open(prof)) != (1<<SANN_N_HW) - 1 && sann_verbose >= 2)
+			fprintf(stderr, "[W::%s] some hardware counters are unavailable; check /proc/sys/kernel/perf_event_paranoid\n", __func__);
+		tc.prof = prof;
+		tr = sann_trainer_init(m, &tc, N);
+		sann_trainer_epoch(tr, N, dx, dy);
+		sann_trainer_destroy(tr);
+		tc.prof = 0;
+		for (k = 0; k < SANN_N_HW; ++k)
+			h_train[k] = prof->hw[SANN_PH_FORWARD][k] + prof->hw[SANN_PH_BACKWARD][k] + prof->hw[SANN_PH_UPDATE][k];
+		bench_hw(avail, h_train, prof->n[SANN_PH_FORWARD], r_train);
+		if (sann_verbose >= 3 && avail) {
+			fprintf(stderr, "[M::%s] train hw", __func__);
+			sann_prof_hw_print(prof, 0);
+			fputc('\n', stderr);
+		}
+	}
+
+	lat = (double*)malloc(n_lat * sizeof(double));
+	out = (float*)malloc((sann_n_out(m) + sae_n_hidden(m)) * sizeof(float));
+	if (hw) sann_prof_hw_read(prof, h0);
+	for (i = 0; i < n_lat; ++i) {
+		const float *xi = x[(int)(sann_drand() * N)];
+		t = bench_time();
+		sann_apply(m, xi, out, m->is_fnn? 0 : out + sann_n_out(m));
+		lat[i] = bench_time() - t;
+	}
+	if (hw) {
+		sann_prof_hw_read(prof, h1);
+		for (i = 0; i < SANN_N_HW; ++i) h1[i] -= h0[i];
+		bench_hw(avail, h1, n_lat, r_infer);
+	}
+	qsort(lat, n_lat, sizeof(double), bench_cmp);
+
+	{
+		const char *key[] = { "version", "source", "model", "shape", "n_par", "n_samples", "n_threads", "malgo", "mini_batch", "dtype",
+			"train_samples_per_sec", "train_gflops", "infer_samples_per_sec", "infer_gflops", "apply_p50_us", "apply_p99_us",
+			"train_ipc", "train_llc_miss_per_sample", "train_dtlb_miss_per_sample", "apply_ipc", "apply_llc_miss_per_sample", "apply_dtlb_miss_per_sample" };
+		char val[22][64], shape[64];
+		int l, n_keys = hw? 22 : 16;
+		for (i = 0, l = 0; i < m->n_layers && l < 48; ++i)
+			l += sprintf(shape + l, i? ",%d" : "%d", m->n_neurons[i]);
+		snprintf(val[0], 64, "%s", SANN_VERSION);
+		val[1][0] = 0; // the source is printed directly, as it may be longer than val[] or need escaping
+		snprintf(val[2], 64, "%s", m->is_fnn? "fnn" : "ae");
+		snprintf(val[3], 64, "%s", shape);
+		snprintf(val[4], 64, "%d", sann_n_par(m));
+		snprintf(val[5], 64, "%d", N);
+		snprintf(val[6], 64, "%d", n_threads);
+		snprintf(val[7], 64, "%d", tc.malgo);
+		snprintf(val[8], 64, "%d", tc.mini_batch);
+		snprintf(val[9], 64, "%d", dtype);
+		snprintf(val[10], 64, "%.1f", N / t_train);
+		snprintf(val[11], 64, "%.3f", 3. * f_fwd * N / t_train * 1e-9);
+		snprintf(val[12], 64, "%.1f", N / t_infer);
+		snprintf(val[13], 64, "%.3f", f_fwd * N / t_infer * 1e-9);
+		snprintf(val[14], 64, "%.2f", n_lat? lat[n_lat / 2] * 1e6 : 0.);
+		snprintf(val[15], 64, "%.2f", n_lat? lat[(int)(n_lat * .99)] * 1e6 : 0.);
+		for (i = 0; hw && i < 6; ++i) {
+			double r = i < 3? r_train[i] : r_infer[i - 3];
+			if (r < 0.) snprintf(val[16 + i], 64, "%s", json? "null" : "NA");
+			else snprintf(val[16 + i], 64, i % 3 == 0? "%.3f" : "%.4f", r);
+		}
+		if (json) {
+			putchar('{');
+			for (i = 0; i < n_keys; ++i) { // strings for the first four fields; numbers for the rest
+				printf("%s\"%s\":%s", i? "," : "", key[i], i < 4? "\"" : "");
+				bench_put_str(i == 1? src : val[i], json);
+				if (i < 4) putchar('"');
+			}
+			puts("}");
+		} else {
+			for (i = 0; i < n_keys; ++i) printf("%s%s", i? "\t" : "#", key[i]);
+			putchar('\n');
+			for (i = 0; i < n_keys; ++i) {
+				if (i) putchar('\t');
+				bench_put_str(i == 1? src : val[i], json);
+			}
+			putchar('\n');
+		}
+	}
+
+	free(lat); free(out);
+	sann_prof_destroy(prof);
+	sann_data_destroy(dx); sann_data_destroy(dy);
+	sann_free_vectors(N, x); sann_free_vectors(N, y);
+	sann_destroy(m);
+	return 0;
+}
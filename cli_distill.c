@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "sann_priv.h"
+
+/*
+ * Knowledge distillation. The student is trained on the outputs of the
+ * teacher, which are computed once before training and kept in memory, as
+ * sann_train_data() would otherwise need the teacher in every epoch. The
+ * input may be a larger unlabeled transfer set.
+ */
+
+static int64_t distill_flops(const sann_t *m) // multiply-adds per sample
+{
+	int64_t n = 0;
+	int k;
+	for (k = 1; k < m->n_layers; ++k)
+		n += m->csr && m->csr[k-1]? m->csr[k-1]->nnz : (int64_t)m->n_neurons[k] * m->n_neurons[k-1];
+	return n;
+}
+
+int main_distill(int argc, char *argv[])
+{
+	int c, i, j, N = 0, n_in, n_out, n_layers = 3, af = -1, out_af = -1, malgo = 0, dtype = SANN_DT_F32, ret = 1;
+	int n_names_in = 0; // number of input names, from the teacher or the input
+	int32_t *n_neurons, *o_h_neurons = 0, o_h_layers = 1, def_n_hidden = 20;
+	float **x = 0, alpha = 0.0f;
+	char **col_names_in = 0, **col_names_out = 0, *fnout = 0;
+	sann_tconf_t tc, tc1;
+	sann_data_t *dx = 0, *dt = 0;
+	sann_t *teacher, *m = 0;
+	double t0;
+
+	sann_srand(11);
+	memset(&tc1, 0, sizeof(sann_tconf_t));
+	tc1.r_in = tc1.r_hidden = tc1.vfrac = -1.0f;
+	while ((c = getopt(argc, argv, "h:f:F:a:o:m:e:r:R:n:l:B:T:t:s:Q:")) >= 0) {
+		if (c == 'f') af = atoi(optarg);
+		else if (c == 'F') out_af = atoi(optarg);
+		else if (c == 'a') alpha = atof(optarg);
+		else if (c == 'o') fnout = optarg;
+		else if (c == 'm') malgo = atoi(optarg);
+		else if (c == 'e') tc1.h = atof(optarg);
+		else if (c == 'r') tc1.r_in = atof(optarg);
+		else if (c == 'R') tc1.r_hidden = atof(optarg);
+		else if (c == 'n') tc1.n_epochs = atoi(optarg);
+		else if (c == 'l') tc1.max_inc = atoi(optarg);
+		else if (c == 'B') tc1.mini_batch = atoi(optarg);
+		else if (c == 'T') tc1.vfrac = atof(optarg);
+		else if (c == 't') tc1.n_threads = atoi(optarg);
+		else if (c == 's') sann_srand(atol(optarg));
+		else if (c == 'Q') dtype = atoi(optarg);
+		else if (c == 'h') {
+			char *p;
+			for (p = optarg, o_h_layers = 1; *p; ++p)
+				if (*p == ',') ++o_h_layers;
+			o_h_neurons = (int32_t*)alloca(o_h_layers * 4);
+			for (p = optarg, i = 0; i < o_h_layers; ++i, ++p)
+				o_h_neurons[i] = strtol(p, &p, 10);
+		}
+	}
+	sann_tconf_init(&tc, malgo, 0);
+	if (argc - optind < 2) {
+		fprintf(stderr, "Usage: sann distill [options] <teacher.snm> <input.snd> [output.snd]\n");
+		fprintf(stderr, "Options:\n");
+		fprintf(stderr, "  Student model:\n");
+		fprintf(stderr, "    -h INT[,INT]  number of hidden neurons (use ',' to add a hidden layer) [%d]\n", def_n_hidden);
+		fprintf(stderr, "    -f INT        hidden activation (1:sigm; 2:tanh; 3:ReLU) [3]\n");
+		fprintf(stderr, "    -F INT        output activation (1:sigm; 4:softmax) [same as the teacher]\n");
+		fprintf(stderr, "    -s INT        random seed [11]\n");
+		fprintf(stderr, "    -o FILE       save the student to FILE [stdout]\n");
+		fprintf(stderr, "  Targets:\n");
+		fprintf(stderr, "    -a FLOAT      weight of the true output in output.snd; the teacher has 1-FLOAT [%g]\n", alpha);
+		fprintf(stderr, "    -Q INT        storage of samples and teacher outputs (0:float; 1:uint8; 2:fp16) [%d]\n", dtype);
+		fprintf(stderr, "  Training:\n");
+		fprintf(stderr, "    -m INT        minibatch optimization algorithm (1:SGD; 2:RMSprop; 3:Adam) [%d]\n", SANN_MIN_MINI_RMSPROP);
+		fprintf(stderr, "    -e FLOAT      learning rate [.01 for SGD; .001 for RMSprop and Adam]\n");
+		fprintf(stderr, "    -r FLOAT      dropout rate at the input layer [%g]\n", tc.r_in);
+		fprintf(stderr, "    -R FLOAT      dropout rate at the hidden layer(s) [%g]\n", tc.r_hidden);
+		fprintf(stderr, "    -T FLOAT      fraction of data used for testing [%g]\n", tc.vfrac);
+		fprintf(stderr, "    -n INT        max number of epochs [%d]\n", tc.n_epochs);
+		fprintf(stderr, "    -l INT        stop if validation cost not reduced after INT epochs [%d]\n", tc.max_inc);
+		fprintf(stderr, "    -B INT        size of a minibatch [%d]\n", tc.mini_batch);
+		fprintf(stderr, "    -t INT        number of threads [%d]\n", tc.n_threads);
+		return 1;
+	}
+	if (tc1.h > 0.0f) tc.h = tc1.h;
+	if (tc1.r_in >= 0.0f) tc.r_in = tc1.r_in;
+	if (tc1.r_hidden >= 0.0f) tc.r_hidden = tc1.r_hidden;
+	if (tc1.vfrac >= 0.0f) tc.vfrac = tc1.vfrac;
+	if (tc1.n_epochs > 0) tc.n_epochs = tc1.n_epochs;
+	if (tc1.max_inc > 0) tc.max_inc = tc1.max_inc;
+	if (tc1.mini_batch > 0) tc.mini_batch = tc1.mini_batch;
+	if (tc1.n_threads > 0) tc.n_threads = tc1.n_threads;
+	if (af == SANN_AF_SOFTMAX || (out_af > 0 && out_af != SANN_AF_SIGM && out_af != SANN_AF_SOFTMAX)) {
+		fprintf(stderr, "[E::%s] softmax is only available at the output layer, and the output can only be sigmoid or softmax\n", __func__);
+		return 1;
+	}
+	if (alpha < 0.0f || alpha > 1.0f) {
+		fprintf(stderr, "[E::%s] option -a must be in [0,1]\n", __func__);
+		return 1;
+	}
+
+	if ((teacher = sann_restore(argv[optind], &col_names_in, &col_names_out)) == 0) {
+		fprintf(stderr, "[E::%s] failed to read the teacher from '%s'\n", __func__, argv[optind]);
+		return 1;
+	}
+	n_out = sann_n_out(teacher);
+	if (col_names_in) n_names_in = sann_n_in(teacher);
+	if (!teacher->is_fnn) {
+		fprintf(stderr, "[E::%s] the teacher must be an FNN\n", __func__);
+		goto end_distill;
+	}
+	if (teacher->af[teacher->n_layers-2] != SANN_AF_SIGM && teacher->af[teacher->n_layers-2] != SANN_AF_SOFTMAX) { // its outputs are targets of the cross-entropy
+		fprintf(stderr, "[E::%s] the output of the teacher must be sigmoid or softmax\n", __func__);
+		goto end_distill;
+	}
+	if (dtype != SANN_DT_F32) {
+		if ((dx = sann_data_read_packed(argv[optind+1], dtype, 0, col_names_in? 0 : &col_names_in)) == 0) goto end_distill;
+		N = dx->n, n_in = dx->n_col;
+	} else {
+		x = sann_data_read(argv[optind+1], &N, &n_in, 0, col_names_in? 0 : &col_names_in);
+		dx = sann_data_view(N, n_in, x);
+	}
+	if (n_names_in == 0) n_names_in = n_in;
+	fprintf(stderr, "[M::%s] read %d vectors, each of size %d\n", __func__, N, n_in);
+	if (n_in != sann_n_in(teacher)) {
+		fprintf(stderr, "[E::%s] the teacher does not match the input: %d != %d\n", __func__, sann_n_in(teacher), n_in);
+		goto end_distill;
+	}
+
+	t0 = sann_prof_time();
+	if ((dt = sann_predict(teacher, dx, dtype, tc.n_threads)) == 0) goto end_distill;
+	fprintf(stderr, "[M::%s] computed the teacher outputs in %.3f sec\n", __func__, sann_prof_time() - t0);
+	if (alpha > 0.0f && optind + 2 < argc) { // mix in the true output, in the order of the input
+		int N_y, n_y;
+		float **y, *buf;
+		y = sann_data_read(argv[optind+2], &N_y, &n_y, 0, 0);
+		if (N_y != N || n_y != n_out) {
+			fprintf(stderr, "[E::%s] output.snd does not match the input or the teacher\n", __func__);
+			sann_free_vectors(N_y, y);
+			goto end_distill;
+		}
+		buf = (float*)malloc(n_out * 2 * sizeof(float));
+		for (i = 0; i < N; ++i) {
+			const float *ti = sann_data_row(dt, i, buf);
+			for (j = 0; j < n_out; ++j)
+				buf[n_out + j] = (1.0f - alpha) * ti[j] + alpha * y[i][j];
+			sann_data_set(dt, i, buf + n_out);
+		}
+		free(buf);
+		sann_free_vectors(N, y);
+	} else if (alpha > 0.0f && sann_verbose >= 2)
+		fprintf(stderr, "[W::%s] option -a is ignored without output.snd\n", __func__);
+	sann_data_shuffle(N, (float**)dx->row, (float**)dt->row, 0); // rows of both are shuffled as pointers
+
+	n_layers = o_h_layers + 2;
+	n_neurons = (int32_t*)alloca(n_layers * 4);
+	if (o_h_neurons) memcpy(n_neurons + 1, o_h_neurons, o_h_layers * 4);
+	else n_neurons[1] = def_n_hidden;
+	n_neurons[0] = n_in, n_neurons[n_layers-1] = n_out;
+	m = sann_init_fnn(n_layers, n_neurons);
+	if (af > 0)
+		for (i = 0; i < n_layers - 2; ++i) m->af[i] = af;
+	m->af[n_layers-2] = out_af > 0? out_af : teacher->af[teacher->n_layers-2];
+	fprintf(stderr, "[M::%s] multiply-adds per sample: %lld for the teacher; %lld for the student\n", __func__,
+			(long long)distill_flops(teacher), (long long)distill_flops(m));
+	sann_destroy(teacher);
+	teacher = 0;
+
+	sann_train_data(m, &tc, dx, dt);
+	sann_dump(fnout, m, col_names_in, col_names_out);
+	ret = 0;
+
+end_distill:
+	sann_data_destroy(dx);
+	sann_data_destroy(dt);
+	sann_free_vectors(N, x);
+	sann_free_names(n_names_in, col_names_in);
+	sann_free_names(n_out, col_names_out);
+	sann_destroy(teacher);
+	sann_destroy(m);
+	return ret;
+}
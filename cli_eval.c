@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <math.h>
+#include "sann_priv.h"
+
+/*
+ * Rows of the truth and the prediction are read in lockstep and must come in
+ * the same order, as is written by "sann apply". Nothing is kept per row: the
+ * AUC of each output is computed from two histograms of the predicted values,
+ * one for positive and one for negative rows. Bins are uniform in logit space
+ * such that confident predictions near 0 or 1 are still ordered. Predictions
+ * in the same bin are treated as ties.
+ */
+
+#define EVAL_MAX_LOGIT 16.0
+#define EVAL_TINY 1e-9
+
+typedef struct {
+	int n_col, n_bins, k;
+	int64_t n, n_acc, n_topk;
+	double cost, xent;
+	uint64_t *hist; // positive and negative counts of bin $b of column $j at 2*(j*n_bins+b) and +1
+} eval_t;
+
+static inline int eval_bin(int n_bins, float p)
+{
+	double x;
+	int b;
+	if (p <= 0.0f) return 0;
+	if (p >= 1.0f) return n_bins - 1;
+	x = log(p / (1.0 - p));
+	b = (int)((x + EVAL_MAX_LOGIT) / (2.0 * EVAL_MAX_LOGIT) * n_bins);
+	return b < 0? 0 : b >= n_bins? n_bins - 1 : b;
+}
+
+static void eval_add(eval_t *e, const float *y, const float *p)
+{
+	int j, max_y = 0, max_p = 0;
+	double c = 0.;
+	for (j = 0; j < e->n_col; ++j)
+		c += sann_sigm_cost(y[j], p[j]);
+	e->cost += c / e->n_col;
+	if (e->n_col > 1) {
+		int rank = 0;
+		for (j = 1; j < e->n_col; ++j) {
+			if (y[j] > y[max_y]) max_y = j;
+			if (p[j] > p[max_p]) max_p = j;
+		}
+		for (j = 0, c = 0.; j < e->n_col; ++j)
+			if (y[j] > 0.0f) c -= y[j] * log(p[j] + EVAL_TINY);
+		e->xent += c;
+		if (max_y == max_p) ++e->n_acc;
+		for (j = 0; j < e->n_col; ++j)
+			if (p[j] > p[max_y]) ++rank;
+		if (rank < e->k) ++e->n_topk;
+	} else if ((y[0] >= 0.5f) == (p[0] >= 0.5f)) ++e->n_acc;
+	if (e->hist)
+		for (j = 0; j < e->n_col; ++j)
+			++e->hist[((size_t)j * e->n_bins + eval_bin(e->n_bins, p[j])) * 2 + (y[j] >= 0.5f? 0 : 1)];
+	++e->n;
+}
+
+// ROC AUC with ties counted as half; PR AUC as average precision. Return the number of positive rows.
+static int64_t eval_auc(int n_bins, const uint64_t *h, double *roc, double *pr)
+{
+	int b;
+	uint64_t n_pos = 0, n_neg = 0, tp = 0, fp = 0;
+	double s_roc = 0., s_pr = 0.;
+	for (b = 0; b < n_bins; ++b)
+		n_pos += h[b*2], n_neg += h[b*2+1];
+	for (b = n_bins - 1; b >= 0; --b) { // from the highest threshold down
+		uint64_t pb = h[b*2], nb = h[b*2+1];
+		s_roc += (double)nb * (tp + .5 * pb);
+		tp += pb, fp += nb;
+		if (pb) s_pr += (double)pb * tp / (tp + fp);
+	}
+	*roc = n_pos && n_neg? s_roc / ((double)n_pos * n_neg) : -1.;
+	*pr = n_pos && n_neg? s_pr / n_pos : -1.;
+	return n_pos;
+}
+
+static void eval_print(const eval_t *e, char *const* col_names)
+{
+	int j, n_auc = 0;
+	double s_roc = 0., s_pr = 0.;
+	printf("N\t%lld\n", (long long)e->n);
+	if (e->n == 0) return;
+	printf("COST\t%.6f\n", e->cost / e->n);
+	if (e->n_col > 1) printf("XENT\t%.6f\n", e->xent / e->n);
+	printf("ACC\t%.6f\n", (double)e->n_acc / e->n);
+	if (e->n_col > e->k && e->k > 1) printf("TOP%d\t%.6f\n", e->k, (double)e->n_topk / e->n);
+	if (e->hist == 0) return;
+	for (j = 0; j < e->n_col; ++j) {
+		double roc, pr;
+		int64_t n_pos;
+		n_pos = eval_auc(e->n_bins, e->hist + (size_t)j * e->n_bins * 2, &roc, &pr);
+		if (col_names) printf("AUC\t%s\t%lld", col_names[j], (long long)n_pos);
+		else printf("AUC\t%d\t%lld", j + 1, (long long)n_pos);
+		if (roc >= 0.) {
+			printf("\t%.6f\t%.6f\n", roc, pr);
+			s_roc += roc, s_pr += pr, ++n_auc;
+		} else fputs("\tNA\tNA\n", stdout);
+	}
+	if (e->n_col > 1 && n_auc > 0)
+		printf("AUC\t*\t%d\t%.6f\t%.6f\n", n_auc, s_roc / n_auc, s_pr / n_auc);
+}
+
+int main_eval(int argc, char *argv[])
+{
+	int c, n_col_y, n_col_p, ret = 1;
+	const char *name_y, *name_p;
+	const float *y, *p;
+	sann_reader_t *ry = 0, *rp = 0;
+	eval_t e;
+
+	memset(&e, 0, sizeof(eval_t));
+	e.n_bins = 10000, e.k = 5;
+	while ((c = getopt(argc, argv, "b:k:")) >= 0) {
+		if (c == 'b') e.n_bins = atoi(optarg);
+		else if (c == 'k') e.k = atoi(optarg);
+	}
+	if (argc - optind < 2) {
+		fprintf(stderr, "Usage: sann eval [options] <truth.snd> <predict.snd>\n");
+		fprintf(stderr, "Options:\n");
+		fprintf(stderr, "  -k INT    report the top-INT accuracy if there are more than INT outputs [%d]\n", e.k);
+		fprintf(stderr, "  -b INT    histogram bins per output for AUC; 0 to skip AUC [%d]\n", e.n_bins);
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Notes: rows must be in the same order in both files. Truth values of 0.5 or above are\n");
+		fprintf(stderr, "  positive. Lines: N, number of rows; COST, sigmoid cost per output; XENT, categorical\n");
+		fprintf(stderr, "  cross-entropy; ACC, accuracy of the top output; AUC, column, number of positives, ROC\n");
+		fprintf(stderr, "  AUC and PR AUC, with '*' for the average over columns.\n");
+		return 1;
+	}
+	if ((ry = sann_reader_open(argv[optind])) == 0 || (rp = sann_reader_open(argv[optind+1])) == 0) {
+		fprintf(stderr, "[E::%s] failed to open the input files\n", __func__);
+		goto end_eval;
+	}
+	while ((y = sann_reader_next(ry, &n_col_y, &name_y)) != 0) {
+		if ((p = sann_reader_next(rp, &n_col_p, &name_p)) == 0) {
+			fprintf(stderr, "[E::%s] fewer rows in the prediction than in the truth\n", __func__);
+			goto end_eval;
+		}
+		if (e.n == 0) {
+			if (n_col_y != n_col_p) {
+				fprintf(stderr, "[E::%s] different number of columns: %d != %d\n", __func__, n_col_y, n_col_p);
+				goto end_eval;
+			}
+			e.n_col = n_col_y;
+			if (e.n_bins > 0) e.hist = (uint64_t*)calloc((size_t)e.n_col * e.n_bins * 2, sizeof(uint64_t));
+		}
+		if (strcmp(name_y, name_p) != 0) {
+			fprintf(stderr, "[E::%s] row %lld is named '%s' in the truth but '%s' in the prediction\n", __func__, (long long)e.n + 1, name_y, name_p);
+			goto end_eval;
+		}
+		eval_add(&e, y, p);
+	}
+	if (sann_reader_next(rp, &n_col_p, &name_p) != 0 && sann_verbose >= 2)
+		fprintf(stderr, "[W::%s] extra rows in the prediction are ignored\n", __func__);
+	eval_print(&e, sann_reader_col_names(rp)? sann_reader_col_names(rp) : sann_reader_col_names(ry));
+	ret = 0;
+end_eval:
+	free(e.hist);
+	sann_reader_close(ry);
+	sann_reader_close(rp);
+	return ret;
+}
@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "sann_priv.h"
+
+static int64_t fact_flops(const sann_t *m) // multiply-adds per sample
+{
+	int64_t n = 0;
+	int k;
+	for (k = 1; k < m->n_layers; ++k)
+		n += m->csr && m->csr[k-1]? m->csr[k-1]->nnz : (int64_t)m->n_neurons[k] * m->n_neurons[k-1];
+	return n;
+}
+
+static double fact_error(const sann_t *m, const sann_data_t *dx, const sann_data_t *dy, int n_threads) // fraction of samples with the wrong top output
+{
+	sann_data_t *dp;
+	int i, j, n_out = sann_n_out(m), n_err = 0;
+	float *buf;
+	dp = sann_predict(m, dx, SANN_DT_F32, n_threads);
+	buf = (float*)malloc(n_out * 2 * sizeof(float));
+	for (i = 0; i < dx->n; ++i) {
+		const float *p = sann_data_row(dp, i, buf), *y = sann_data_row(dy, i, buf + n_out);
+		int max_p = 0, max_y = 0;
+		for (j = 1; j < n_out; ++j) {
+			if (p[j] > p[max_p]) max_p = j;
+			if (y[j] > y[max_y]) max_y = j;
+		}
+		if (max_p != max_y) ++n_err;
+	}
+	free(buf);
+	sann_data_destroy(dp);
+	return dx->n? (double)n_err / dx->n : 0.;
+}
+
+static void fact_print(const sann_t *m, const sann_data_t *dx, const sann_data_t *dy, int n_threads)
+{
+	if (dx) {
+		fprintf(stderr, "\t%.6f", sann_evaluate_data(m, dx->n, dx, dy));
+		if (sann_n_out(m) > 1) fprintf(stderr, "\t%.4f", fact_error(m, dx, dy, n_threads));
+		else fputs("\tNA", stderr);
+	}
+	fputc('\n', stderr);
+}
+
+// factorize layers in $layers at rank $r; layers are processed from the top such that lower indices are unchanged
+static sann_t *fact_apply(const sann_t *m0, int n_layers, const int *layers, int r, int n_iter, float *max_err)
+{
+	sann_t *m = sann_dup(m0);
+	int i, k;
+	*max_err = 0.0f;
+	for (k = m0->n_layers - 1; k >= 1; --k) {
+		sann_t *d;
+		float err;
+		if (n_layers > 0) {
+			for (i = 0; i < n_layers && layers[i] != k; ++i);
+			if (i == n_layers) continue;
+		} else if ((int64_t)r * (m0->n_neurons[k] + m0->n_neurons[k-1]) >= (int64_t)m0->n_neurons[k] * m0->n_neurons[k-1]) {
+			continue; // no reduction in multiply-adds
+		}
+		if ((d = sann_factorize(m, k, r, n_iter, &err)) == 0) {
+			if (sann_verbose >= 2)
+				fprintf(stderr, "[W::%s] layer %d (%d x %d) can't be factorized at rank %d\n", __func__, k, m0->n_neurons[k], m0->n_neurons[k-1], r);
+			continue;
+		}
+		if (err > *max_err) *max_err = err;
+		sann_destroy(m);
+		m = d;
+	}
+	return m;
+}
+
+int main_factorize(int argc, char *argv[])
+{
+	int c, i, N = 0, N_y = 0, n_in, n_out, malgo = 0, n_iter = 0, n_layers = 0, *layers = 0, n_ranks = 1, *ranks, def_rank = 50;
+	int n_names_in, n_names_out, ret = 1;
+	float **x = 0, **y = 0;
+	char **col_names_in = 0, **col_names_out = 0, *fnout = 0;
+	sann_tconf_t tc, tc1;
+	sann_data_t *dx = 0, *dy = 0;
+	sann_t *m0, *m = 0;
+
+	ranks = &def_rank;
+	sann_srand(11);
+	memset(&tc1, 0, sizeof(sann_tconf_t));
+	tc1.vfrac = -1.0f;
+	while ((c = getopt(argc, argv, "r:L:i:o:m:e:n:l:B:T:t:s:")) >= 0) {
+		if (c == 'i') n_iter = atoi(optarg);
+		else if (c == 'o') fnout = optarg;
+		else if (c == 'm') malgo = atoi(optarg);
+		else if (c == 'e') tc1.h = atof(optarg);
+		else if (c == 'n') tc1.n_epochs = atoi(optarg);
+		else if (c == 'l') tc1.max_inc = atoi(optarg);
+		else if (c == 'B') tc1.mini_batch = atoi(optarg);
+		else if (c == 'T') tc1.vfrac = atof(optarg);
+		else if (c == 't') tc1.n_threads = atoi(optarg);
+		else if (c == 's') sann_srand(atol(optarg));
+		else if (c == 'r' || c == 'L') {
+			char *p;
+			int n = 1, *a;
+			for (p = optarg; *p; ++p)
+				if (*p == ',') ++n;
+			a = (int*)alloca(n * sizeof(int));
+			for (p = optarg, i = 0; i < n; ++i, ++p)
+				a[i] = strtol(p, &p, 10);
+			if (c == 'r') ranks = a, n_ranks = n;
+			else layers = a, n_layers = n;
+		}
+	}
+	sann_tconf_init(&tc, malgo, 0);
+	if (argc == optind || argc - optind == 2) {
+		fprintf(stderr, "Usage: sann factorize [options] <model.snm> [input.snd output.snd]\n");
+		fprintf(stderr, "Options:\n");
+		fprintf(stderr, "  Factorization:\n");
+		fprintf(stderr, "    -r INT[,INT]  ranks to evaluate; the model is written at the first rank [%d]\n", def_rank);
+		fprintf(stderr, "    -L INT[,INT]  factorize these layers, from 1 for the first hidden layer [layers with fewer multiply-adds]\n");
+		fprintf(stderr, "    -i INT        number of subspace iterations [8]\n");
+		fprintf(stderr, "    -o FILE       save the factorized model to FILE [stdout]\n");
+		fprintf(stderr, "  Fine-tuning of the written model, if samples are given:\n");
+		fprintf(stderr, "    -n INT        max number of epochs; 0 to disable [0]\n");
+		fprintf(stderr, "    -m INT        minibatch optimization algorithm (1:SGD; 2:RMSprop; 3:Adam) [%d]\n", SANN_MIN_MINI_RMSPROP);
+		fprintf(stderr, "    -e FLOAT      learning rate [.01 for SGD; .001 for RMSprop and Adam]\n");
+		fprintf(stderr, "    -T FLOAT      fraction of data used for testing [%g]\n", tc.vfrac);
+		fprintf(stderr, "    -l INT        stop if validation cost not reduced after INT epochs [%d]\n", tc.max_inc);
+		fprintf(stderr, "    -B INT        size of a minibatch [%d]\n", tc.mini_batch);
+		fprintf(stderr, "    -t INT        number of threads [%d]\n", tc.n_threads);
+		fprintf(stderr, "    -s INT        random seed [11]\n");
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Notes: given samples, the cost and the error rate of the top output are printed for each rank.\n");
+		return 1;
+	}
+	if (tc1.h > 0.0f) tc.h = tc1.h;
+	if (tc1.vfrac >= 0.0f) tc.vfrac = tc1.vfrac;
+	if (tc1.max_inc > 0) tc.max_inc = tc1.max_inc;
+	if (tc1.mini_batch > 0) tc.mini_batch = tc1.mini_batch;
+	if (tc1.n_threads > 0) tc.n_threads = tc1.n_threads;
+	tc.n_epochs = tc1.n_epochs;
+
+	if ((m0 = sann_restore(argv[optind], &col_names_in, &col_names_out)) == 0) {
+		fprintf(stderr, "[E::%s] failed to read the model from '%s'\n", __func__, argv[optind]);
+		return 1;
+	}
+	n_names_in = sann_n_in(m0), n_names_out = sann_n_out(m0); // kept by the factorized models
+	if (!m0->is_fnn) {
+		fprintf(stderr, "[E::%s] only FNN models can be factorized\n", __func__);
+		goto end_factorize;
+	}
+	if (argc - optind >= 3) {
+		x = sann_data_read(argv[optind+1], &N, &n_in, 0, 0);
+		y = sann_data_read_nl(argv[optind+2], sann_n_out(m0), &N_y, &n_out, 0, 0);
+		if (N == 0 || n_in != sann_n_in(m0) || n_out != sann_n_out(m0) || N_y != N) {
+			fprintf(stderr, "[E::%s] the samples do not match the model\n", __func__);
+			goto end_factorize;
+		}
+		dx = sann_data_view(N, n_in, x);
+		dy = sann_data_view(N, n_out, y);
+	}
+
+	fprintf(stderr, "#rank\tmult_adds\tratio\tmax_rel_err%s\n", dx? "\tcost\terror" : "");
+	fprintf(stderr, "full\t%lld\t1.000\t0", (long long)fact_flops(m0));
+	fact_print(m0, dx, dy, tc.n_threads);
+	for (i = 0; i < n_ranks; ++i) { // the first rank is kept for output
+		sann_t *mi;
+		float err;
+		mi = fact_apply(m0, n_layers, layers, ranks[i], n_iter, &err);
+		fprintf(stderr, "%d\t%lld\t%.3f\t%.4f", ranks[i], (long long)fact_flops(mi), (double)fact_flops(mi) / fact_flops(m0), err);
+		fact_print(mi, dx, dy, tc.n_threads);
+		if (i == 0) m = mi;
+		else sann_destroy(mi);
+	}
+	sann_destroy(m0);
+	m0 = 0;
+
+	if (dx && tc.n_epochs > 0) { // brief fine-tuning
+		sann_data_shuffle(N, (float**)dx->row, (float**)dy->row, 0);
+		sann_train_data(m, &tc, dx, dy);
+	}
+	sann_dump(fnout, m, col_names_in, col_names_out);
+	ret = 0;
+
+end_factorize:
+	sann_data_destroy(dx); sann_data_destroy(dy);
+	sann_free_vectors(N, x); sann_free_vectors(N_y, y);
+	sann_free_names(n_names_in, col_names_in);
+	sann_free_names(n_names_out, col_names_out);
+	sann_destroy(m0);
+	sann_destroy(m);
+	return ret;
+}
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "sann_priv.h"
+
+/*
+ * Greedy layer-wise pretraining. Autoencoder k is trained on the hidden
+ * activations of autoencoder k-1, which are computed once and cached in
+ * memory (and optionally in binary files) rather than recomputed through all
+ * lower layers in every epoch. The encoders are then stacked into an FNN.
+ */
+
+static char *pretrain_fn(const char *prefix, int k, const char *suffix)
+{
+	char *fn;
+	fn = (char*)malloc(strlen(prefix) + strlen(suffix) + 16);
+	sprintf(fn, "%s.%d.%s", prefix, k + 1, suffix);
+	return fn;
+}
+
+// restore layer $k and its codes written by an earlier run; the codes of the top layer are not needed
+static int pretrain_resume(const char *prefix, int k, int last, sann_t **ae, sann_data_t **codes)
+{
+	char *fn;
+	fn = pretrain_fn(prefix, k, "snm");
+	if (access(fn, R_OK) == 0) *ae = sann_restore(fn, 0, 0);
+	free(fn);
+	if (*ae == 0) return -1;
+	if (!last) {
+		fn = pretrain_fn(prefix, k, "snb");
+		*codes = sann_data_restore(fn);
+		free(fn);
+		if (*codes == 0) {
+			sann_destroy(*ae);
+			*ae = 0;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main_pretrain(int argc, char *argv[])
+{
+	int c, i, k, N = 0, n_in = 0, n_out = 0, af = -1, scaled = SAE_SC_SQRT, malgo = 0, dtype = SANN_DT_F32, resume = 0, ret = 1;
+	int32_t n_layers = 1, *n_hidden, def_n_hidden = 50;
+	float **x = 0;
+	char **col_names_in = 0, **col_names_out = 0, *fnout = 0, *prefix = 0;
+	sann_tconf_t tc, tc1;
+	sann_data_t *dx = 0, *cur = 0, *codes = 0;
+	sann_t **ae = 0, *fnn;
+
+	n_hidden = &def_n_hidden;
+	sann_srand(11);
+	memset(&tc1, 0, sizeof(sann_tconf_t));
+	tc1.r_in = tc1.vfrac = -1.0f;
+	while ((c = getopt(argc, argv, "h:O:o:p:uf:S:m:e:r:n:l:B:T:t:s:Q:")) >= 0) {
+		if (c == 'O') n_out = atoi(optarg);
+		else if (c == 'o') fnout = optarg;
+		else if (c == 'p') prefix = optarg;
+		else if (c == 'u') resume = 1;
+		else if (c == 'f') af = atoi(optarg);
+		else if (c == 'S') scaled = atoi(optarg);
+		else if (c == 'm') malgo = atoi(optarg);
+		else if (c == 'e') tc1.h = atof(optarg);
+		else if (c == 'r') tc1.r_in = atof(optarg);
+		else if (c == 'n') tc1.n_epochs = atoi(optarg);
+		else if (c == 'l') tc1.max_inc = atoi(optarg);
+		else if (c == 'B') tc1.mini_batch = atoi(optarg);
+		else if (c == 'T') tc1.vfrac = atof(optarg);
+		else if (c == 't') tc1.n_threads = atoi(optarg);
+		else if (c == 's') sann_srand(atol(optarg));
+		else if (c == 'Q') dtype = atoi(optarg);
+		else if (c == 'h') {
+			char *p;
+			for (p = optarg, n_layers = 1; *p; ++p)
+				if (*p == ',') ++n_layers;
+			n_hidden = (int32_t*)alloca(n_layers * 4);
+			for (p = optarg, i = 0; i < n_layers; ++i, ++p)
+				n_hidden[i] = strtol(p, &p, 10);
+		}
+	}
+	sann_tconf_init(&tc, malgo, 0);
+	if (argc == optind) {
+		fprintf(stderr, "Usage: sann pretrain [options] <input.snd> [output.snd]\n");
+		fprintf(stderr, "Options:\n");
+		fprintf(stderr, "  Model construction:\n");
+		fprintf(stderr, "    -h INT[,INT]  number of hidden neurons in each layer, from the bottom [%d]\n", def_n_hidden);
+		fprintf(stderr, "    -O INT        number of output neurons; taken from output.snd if present [0]\n");
+		fprintf(stderr, "    -f INT        hidden activation (1:sigm; 2:tanh; 3:ReLU) [1]\n");
+		fprintf(stderr, "    -S INT        weight scaling (0:none; 1:sqrt; 2:full) [%d]\n", scaled);
+		fprintf(stderr, "    -s INT        random seed [11]\n");
+		fprintf(stderr, "    -o FILE       save the stacked FNN to FILE [stdout]\n");
+		fprintf(stderr, "  Training of each layer:\n");
+		fprintf(stderr, "    -m INT        minibatch optimization algorithm (1:SGD; 2:RMSprop; 3:Adam) [%d]\n", SANN_MIN_MINI_RMSPROP);
+		fprintf(stderr, "    -e FLOAT      learning rate [.01 for SGD; .001 for RMSprop and Adam]\n");
+		fprintf(stderr, "    -r FLOAT      dropout rate at the input layer [%g]\n", tc.r_in);
+		fprintf(stderr, "    -T FLOAT      fraction of data used for testing [%g]\n", tc.vfrac);
+		fprintf(stderr, "    -n INT        max number of epochs [%d]\n", tc.n_epochs);
+		fprintf(stderr, "    -l INT        stop if validation cost not reduced after INT epochs [%d]\n", tc.max_inc);
+		fprintf(stderr, "    -B INT        size of a minibatch [%d]\n", tc.mini_batch);
+		fprintf(stderr, "    -t INT        number of threads [%d]\n", tc.n_threads);
+		fprintf(stderr, "    -Q INT        storage of samples and cached codes (0:float; 1:uint8; 2:fp16) [%d]\n", dtype);
+		fprintf(stderr, "  Intermediate files:\n");
+		fprintf(stderr, "    -p STR        write each autoencoder to STR.<layer>.snm and its codes to STR.<layer>.snb []\n");
+		fprintf(stderr, "    -u            reuse the layers written with -p by an earlier run with the same options\n");
+		return 1;
+	}
+	if (tc1.h > 0.0f) tc.h = tc1.h;
+	if (tc1.r_in >= 0.0f) tc.r_in = tc1.r_in;
+	if (tc1.vfrac >= 0.0f) tc.vfrac = tc1.vfrac;
+	if (tc1.n_epochs > 0) tc.n_epochs = tc1.n_epochs;
+	if (tc1.max_inc > 0) tc.max_inc = tc1.max_inc;
+	if (tc1.mini_batch > 0) tc.mini_batch = tc1.mini_batch;
+	if (tc1.n_threads > 0) tc.n_threads = tc1.n_threads;
+
+	if (optind + 1 < argc && sann_data_header(argv[optind+1], &n_out, &col_names_out) < 0) { // only the dimension and the names of the output are needed
+		fprintf(stderr, "[E::%s] failed to read '%s'\n", __func__, argv[optind+1]);
+		return 1;
+	}
+	if (n_out <= 0) {
+		fprintf(stderr, "[E::%s] the number of output neurons is not set; use -O or provide output.snd\n", __func__);
+		goto end_pretrain;
+	}
+	if (dtype != SANN_DT_F32) {
+		if ((dx = sann_data_read_packed(argv[optind], dtype, 0, &col_names_in)) == 0) goto end_pretrain;
+		N = dx->n, n_in = dx->n_col;
+	} else {
+		x = sann_data_read(argv[optind], &N, &n_in, 0, &col_names_in);
+		dx = sann_data_view(N, n_in, x);
+	}
+	fprintf(stderr, "[M::%s] read %d vectors, each of size %d\n", __func__, N, n_in);
+	sann_data_shuffle(N, (float**)dx->row, 0, 0); // validation samples are the same for all layers
+
+	ae = (sann_t**)calloc(n_layers, sizeof(sann_t*));
+	for (k = 0, cur = dx; k < n_layers; ++k) {
+		int last = (k == n_layers - 1);
+		codes = 0;
+		if (prefix && resume && pretrain_resume(prefix, k, last, &ae[k], &codes) == 0) {
+			fprintf(stderr, "[M::%s] reused layer %d from '%s'\n", __func__, k + 1, prefix);
+		} else {
+			ae[k] = sann_init_ae(cur->n_col, n_hidden[k], scaled);
+			if (af > 0) ae[k]->af[0] = af;
+			fprintf(stderr, "[M::%s] training layer %d: %d -> %d\n", __func__, k + 1, cur->n_col, n_hidden[k]);
+			if (sann_train_data(ae[k], &tc, cur, 0) < 0) goto end_pretrain;
+			if (!last) codes = sann_ae_encode(ae[k], cur, dtype, tc.n_threads);
+			if (prefix) {
+				char *fn;
+				fn = pretrain_fn(prefix, k, "snm");
+				if (sann_dump(fn, ae[k], 0, 0) != 0)
+					fprintf(stderr, "[W::%s] failed to write '%s'\n", __func__, fn);
+				free(fn);
+				if (codes) {
+					fn = pretrain_fn(prefix, k, "snb");
+					if (sann_data_dump(fn, codes) != 0)
+						fprintf(stderr, "[W::%s] failed to write '%s'\n", __func__, fn);
+					free(fn);
+				}
+			}
+		}
+		if (cur != dx) sann_data_destroy(cur); // codes of the layer below are no longer needed
+		cur = codes;
+	}
+	sann_data_destroy(dx);
+	sann_free_vectors(N, x);
+	dx = 0, x = 0;
+
+	fnn = sann_stack_fnn(n_layers, ae, n_out);
+	sann_dump(fnout, fnn, col_names_in, col_names_out);
+	sann_destroy(fnn);
+	ret = 0;
+
+end_pretrain:
+	if (cur != dx) sann_data_destroy(cur); // codes of the layer whose training failed
+	sann_data_destroy(dx);
+	sann_free_vectors(N, x);
+	for (k = 0; ae && k < n_layers; ++k) sann_destroy(ae[k]);
+	free(ae);
+	sann_free_names(n_in, col_names_in);
+	sann_free_names(n_out, col_names_out);
+	return ret;
+}
@@ -6,19 +6,36 @@
 #include <math.h>
 #include "sann_priv.h"
 
+typedef struct {
+	const sann_t *m;
+	int N;
+	float *const* x;
+	float **d;
+	sfnn_buf_t **b;
+} jacob_shared_t;
+
+static void jacob_worker(void *data, long k, int tid) // average jacobian of output $k; samples are added in order
+{
+	jacob_shared_t *s = (jacob_shared_t*)data;
+	const sann_t *m = s->m;
+	int j;
+	for (j = 0; j < s->N; ++j)
+		sfnn_core_jacobian(m->n_layers, m->n_neurons, m->af, m->t, s->x[j], k, s->d[k], s->b[tid]);
+}
+
 int main_jacob(int argc, char *argv[])
 {
-	int c, N, n_in, n_out, i, j, k, trans = 1;
+	int c, N, n_in, n_out, i, k, trans = 1, n_threads = 1;
 	float **x = 0;
 	char **cn_in, **cn_out;
 	sann_t *m;
-	sfnn_buf_t *b = 0;
 
-	while ((c = getopt(argc, argv, "T")) >= 0) {
+	while ((c = getopt(argc, argv, "Tt:")) >= 0) {
 		if (c == 'T') trans = 0;
+		else if (c == 't') n_threads = atoi(optarg);
 	}
 	if (argc - optind < 1) {
-		fprintf(stderr, "Usage: sann jacob [-T] <model.snm> [input.snd]\n");
+		fprintf(stderr, "Usage: sann jacob [-T] [-t nThreads] <model.snm> [input.snd]\n");
 		return 1;
 	}
 
@@ -29,13 +46,13 @@ int main_jacob(int argc, char *argv[])
 		assert(n_in == sann_n_in(m));
 	}
 
-	if (m->is_fnn) b = sfnn_buf_init(m->n_layers, m->n_neurons, m->t);
 	if (x == 0) {
 		const float *w;
+		int j;
 		if (!m->is_fnn) {
 			const float *b1, *b2;
 			sae_par2ptr(n_in, sae_n_hidden(m), m->t, &b1, &b2, &w);
-		} else w = b->w[1];
+		} else w = m->t + m->n_neurons[1];
 		for (i = 0; i < n_in; ++i) {
 			double s = 0.;
 			const float *wj;
@@ -44,48 +61,49 @@ int main_jacob(int argc, char *argv[])
 			else printf("i%d", i+1);
 			printf("\t%g\n", sqrt(s / m->n_neurons[1]));
 		}
-	} else if (!trans) {
-		float *d;
-		if (cn_in) {
-			printf("#NA");
-			for (i = 0; i < n_in; ++i) printf("\t%s", cn_in[i]);
-			putchar('\n');
-		}
-		d = (float*)malloc(n_in * sizeof(float));
-		for (k = 0; k < n_out; ++k) {
-			if (cn_out) printf("%s", cn_out[k]);
-			else printf("o%d", k+1);
-			memset(d, 0, sann_n_in(m) * sizeof(float));
-			for (j = 0; j < N; ++j)
-				sfnn_core_jacobian(m->n_layers, m->n_neurons, m->af, m->t, x[j], k, d, b);
-			for (i = 0; i < n_in; ++i)
-				printf("\t%g", d[i] / N);
-			putchar('\n');
-		}
-		free(d);
 	} else {
-		float **d;
-		if (cn_out) {
-			printf("#NA");
-			for (i = 0; i < n_out; ++i) printf("\t%s", cn_out[i]);
-			putchar('\n');
-		}
-		d = (float**)malloc(n_out * sizeof(float*));
-		for (k = 0; k < n_out; ++k) {
-			d[k] = (float*)calloc(n_in, sizeof(float));
-			for (j = 0; j < N; ++j)
-				sfnn_core_jacobian(m->n_layers, m->n_neurons, m->af, m->t, x[j], k, d[k], b);
-		}
-		for (i = 0; i < n_in; ++i) {
-			if (cn_in) printf("%s", cn_in[i]);
-			else printf("i%d", i+1);
-			for (k = 0; k < n_out; ++k)
-				printf("\t%g", d[k][i] / N);
-			putchar('\n');
+		jacob_shared_t s;
+		if (n_threads > n_out) n_threads = n_out;
+		if (n_threads < 1) n_threads = 1;
+		s.m = m, s.N = N, s.x = x;
+		s.d = (float**)malloc(n_out * sizeof(float*));
+		for (k = 0; k < n_out; ++k)
+			s.d[k] = (float*)calloc(n_in, sizeof(float));
+		s.b = (sfnn_buf_t**)malloc(n_threads * sizeof(sfnn_buf_t*));
+		for (i = 0; i < n_threads; ++i)
+			s.b[i] = sfnn_buf_init(m->n_layers, m->n_neurons, m->t);
+		sann_for(n_threads, jacob_worker, &s, n_out);
+		for (i = 0; i < n_threads; ++i) sfnn_buf_destroy(s.b[i]);
+		free(s.b);
+		if (!trans) {
+			if (cn_in) {
+				printf("#NA");
+				for (i = 0; i < n_in; ++i) printf("\t%s", cn_in[i]);
+				putchar('\n');
+			}
+			for (k = 0; k < n_out; ++k) {
+				if (cn_out) printf("%s", cn_out[k]);
+				else printf("o%d", k+1);
+				for (i = 0; i < n_in; ++i)
+					printf("\t%g", s.d[k][i] / N);
+				putchar('\n');
+			}
+		} else {
+			if (cn_out) {
+				printf("#NA");
+				for (i = 0; i < n_out; ++i) printf("\t%s", cn_out[i]);
+				putchar('\n');
+			}
+			for (i = 0; i < n_in; ++i) {
+				if (cn_in) printf("%s", cn_in[i]);
+				else printf("i%d", i+1);
+				for (k = 0; k < n_out; ++k)
+					printf("\t%g", s.d[k][i] / N);
+				putchar('\n');
+			}
 		}
-		sann_free_vectors(n_out, d);
+		sann_free_vectors(n_out, s.d);
 	}
-	if (b) sfnn_buf_destroy(b);
 
 	if (x) sann_free_vectors(N, x);
 	sann_free_names(sann_n_in(m), cn_in);
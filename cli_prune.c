@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "sann_priv.h"
+
+int main_prune(int argc, char *argv[])
+{
+	int c, i, k, N = 0, N_y = 0, n_in, n_out, malgo = 0, *layers = 0, ret = 1;
+	int64_t n_kept = 0, n_all = 0;
+	float sparsity = 0.9f, **x = 0, **y = 0;
+	char **col_names_in = 0, **col_names_out = 0, *fnout = 0;
+	sann_tconf_t tc, tc1;
+	sann_t *m;
+
+	sann_srand(11);
+	memset(&tc1, 0, sizeof(sann_tconf_t));
+	tc1.vfrac = -1.0f;
+	while ((c = getopt(argc, argv, "p:L:o:m:e:n:l:B:T:t:s:")) >= 0) {
+		if (c == 'p') sparsity = atof(optarg);
+		else if (c == 'o') fnout = optarg;
+		else if (c == 'm') malgo = atoi(optarg);
+		else if (c == 'e') tc1.h = atof(optarg);
+		else if (c == 'n') tc1.n_epochs = atoi(optarg);
+		else if (c == 'l') tc1.max_inc = atoi(optarg);
+		else if (c == 'B') tc1.mini_batch = atoi(optarg);
+		else if (c == 'T') tc1.vfrac = atof(optarg);
+		else if (c == 't') tc1.n_threads = atoi(optarg);
+		else if (c == 's') sann_srand(atol(optarg));
+		else if (c == 'L') {
+			char *p;
+			int n = 1;
+			for (p = optarg; *p; ++p)
+				if (*p == ',') ++n;
+			layers = (int*)alloca((n + 1) * sizeof(int));
+			for (p = optarg, i = 0; i < n; ++i, ++p)
+				layers[i] = strtol(p, &p, 10);
+			layers[n] = 0;
+		}
+	}
+	sann_tconf_init(&tc, malgo, 0);
+	tc.n_epochs = 10;
+	if (argc == optind || argc - optind == 2) {
+		fprintf(stderr, "Usage: sann prune [options] <model.snm> [input.snd output.snd]\n");
+		fprintf(stderr, "Options:\n");
+		fprintf(stderr, "  Pruning:\n");
+		fprintf(stderr, "    -p FLOAT      fraction of weights set to zero at each pruned layer [%g]\n", sparsity);
+		fprintf(stderr, "    -L INT[,INT]  prune these layers, from 1 for the first hidden layer [all]\n");
+		fprintf(stderr, "    -o FILE       save the pruned model to FILE [stdout]\n");
+		fprintf(stderr, "  Fine-tuning, if samples are given:\n");
+		fprintf(stderr, "    -m INT        minibatch optimization algorithm (1:SGD; 2:RMSprop; 3:Adam) [%d]\n", SANN_MIN_MINI_RMSPROP);
+		fprintf(stderr, "    -e FLOAT      learning rate [.01 for SGD; .001 for RMSprop and Adam]\n");
+		fprintf(stderr, "    -T FLOAT      fraction of data used for testing [%g]\n", tc.vfrac);
+		fprintf(stderr, "    -n INT        max number of epochs [%d]\n", tc.n_epochs);
+		fprintf(stderr, "    -l INT        stop if validation cost not reduced after INT epochs [%d]\n", tc.max_inc);
+		fprintf(stderr, "    -B INT        size of a minibatch [%d]\n", tc.mini_batch);
+		fprintf(stderr, "    -t INT        number of threads [%d]\n", tc.n_threads);
+		fprintf(stderr, "    -s INT        random seed [11]\n");
+		return 1;
+	}
+	if (tc1.h > 0.0f) tc.h = tc1.h;
+	if (tc1.vfrac >= 0.0f) tc.vfrac = tc1.vfrac;
+	if (tc1.n_epochs > 0) tc.n_epochs = tc1.n_epochs;
+	if (tc1.max_inc > 0) tc.max_inc = tc1.max_inc;
+	if (tc1.mini_batch > 0) tc.mini_batch = tc1.mini_batch;
+	if (tc1.n_threads > 0) tc.n_threads = tc1.n_threads;
+
+	if (sparsity < 0.0f || sparsity >= 1.0f) {
+		fprintf(stderr, "[E::%s] option -p must be in [0,1)\n", __func__);
+		return 1;
+	}
+	if ((m = sann_restore(argv[optind], &col_names_in, &col_names_out)) == 0) {
+		fprintf(stderr, "[E::%s] failed to read the model from '%s'\n", __func__, argv[optind]);
+		return 1;
+	}
+	if (!m->is_fnn) {
+		fprintf(stderr, "[E::%s] only FNN models can be pruned\n", __func__);
+		goto end_prune;
+	}
+	for (k = 1; k < m->n_layers; ++k) {
+		int n, n_w = m->n_neurons[k] * m->n_neurons[k-1];
+		if (layers) {
+			for (i = 0; layers[i] && layers[i] != k; ++i);
+			if (layers[i] == 0) continue;
+		}
+		n = sann_prune(m, k, sparsity);
+		fprintf(stderr, "[M::%s] layer %d: kept %d of %d weights\n", __func__, k, n, n_w);
+	}
+	for (k = 1; k < m->n_layers; ++k) {
+		n_all += m->n_neurons[k] * m->n_neurons[k-1];
+		n_kept += m->csr && m->csr[k-1]? m->csr[k-1]->nnz : m->n_neurons[k] * m->n_neurons[k-1];
+	}
+	fprintf(stderr, "[M::%s] kept %lld of %lld weights (%.1f%%)\n", __func__, (long long)n_kept, (long long)n_all, 100. * n_kept / n_all);
+
+	if (argc - optind >= 3) { // fine-tune with the pruned weights fixed at zero
+		x = sann_data_read(argv[optind+1], &N, &n_in, 0, 0);
+		y = sann_data_read_nl(argv[optind+2], sann_n_out(m), &N_y, &n_out, 0, 0);
+		if (N == 0 || n_in != sann_n_in(m) || n_out != sann_n_out(m) || N_y != N) {
+			fprintf(stderr, "[E::%s] the samples do not match the model\n", __func__);
+			goto end_prune;
+		}
+		sann_data_shuffle(N, x, y, 0);
+		sann_train(m, &tc, N, x, y);
+	}
+
+	sann_dump(fnout, m, col_names_in, col_names_out);
+	ret = 0;
+
+end_prune:
+	sann_free_vectors(N, x);
+	sann_free_vectors(N_y, y);
+	sann_free_names(sann_n_in(m), col_names_in);
+	sann_free_names(sann_n_out(m), col_names_out);
+	sann_destroy(m);
+	return ret;
+}
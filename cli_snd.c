@@ -0,0 +1,422 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "sann_priv.h"
+
+/*
+ * Column and row transforms of SND files, streamed one row at a time. Text
+ * rows are split into fields at TABs; a field is only converted to float by
+ * the commands that need its value, and is otherwise copied verbatim. Binary
+ * input written by sann_data_dump() is decoded and printed with "%g". Each
+ * output line is built in a buffer and written with one fwrite().
+ */
+
+typedef struct {
+	int l, m;
+	char *s;
+} snd_buf_t;
+
+typedef struct {
+	sann_reader_t *r;
+	int n_col, m_st;
+	const char *line, *name; // $line is NULL for binary input
+	int *st; // field $j (0 for the row name) starts at line[st[j]] and ends before line[st[j+1]-1]
+	const float *x; // binary input only
+} snd_row_t;
+
+static inline void snd_put(snd_buf_t *b, const char *s, int l)
+{
+	if (b->l + l + 1 > b->m) {
+		b->m = b->l + l + 1;
+		b->m += b->m >> 1;
+		b->s = (char*)realloc(b->s, b->m);
+	}
+	memcpy(b->s + b->l, s, l);
+	b->l += l;
+}
+
+static inline void snd_putc(snd_buf_t *b, int c)
+{
+	char t = c;
+	snd_put(b, &t, 1);
+}
+
+static inline void snd_putf(snd_buf_t *b, const char *fmt, double x)
+{
+	char t[32];
+	snd_put(b, t, snprintf(t, sizeof(t), fmt, x));
+}
+
+static inline void snd_flush(snd_buf_t *b)
+{
+	fwrite(b->s, 1, b->l, stdout);
+	b->l = 0;
+}
+
+static int snd_open(snd_row_t *r, const char *fn)
+{
+	memset(r, 0, sizeof(snd_row_t));
+	if ((r->r = sann_reader_open(fn)) == 0) {
+		fprintf(stderr, "[E::%s] failed to open '%s'\n", __func__, fn? fn : "-");
+		return -1;
+	}
+	return 0;
+}
+
+static void snd_close(snd_row_t *r)
+{
+	sann_reader_close(r->r);
+	free(r->st);
+}
+
+static int snd_next(snd_row_t *r) // return 0 at the end
+{
+	int i, k, len;
+	if (sann_reader_is_bin(r->r))
+		return (r->x = sann_reader_next(r->r, &r->n_col, &r->name)) != 0;
+	if ((r->line = sann_reader_next_text(r->r, &r->n_col, &len)) == 0) return 0;
+	if (r->n_col + 2 > r->m_st) {
+		r->m_st = r->n_col + 2;
+		r->st = (int*)realloc(r->st, r->m_st * sizeof(int));
+	}
+	for (i = k = 0, r->st[k++] = 0; i < len; ++i)
+		if (r->line[i] == '\t') r->st[k++] = i + 1;
+	r->st[k] = len + 1;
+	r->name = 0;
+	return 1;
+}
+
+static inline void snd_put_name(snd_buf_t *b, const snd_row_t *r)
+{
+	if (r->line) snd_put(b, r->line, r->st[1] - 1);
+	else snd_put(b, r->name, strlen(r->name));
+}
+
+static inline void snd_put_field(snd_buf_t *b, const snd_row_t *r, int j) // value column $j, from 0
+{
+	if (r->line) snd_put(b, r->line + r->st[j+1], r->st[j+2] - r->st[j+1] - 1);
+	else snd_putf(b, "%g", r->x[j]);
+}
+
+static inline float snd_value(const snd_row_t *r, int j)
+{
+	return r->line? strtod(r->line + r->st[j+1], 0) : r->x[j];
+}
+
+static void snd_put_header(snd_buf_t *b, int n, char *const* names, const int *idx) // $idx can be NULL
+{
+	int j;
+	snd_put(b, "#sample", 7);
+	for (j = 0; j < n; ++j) {
+		const char *s = idx? (idx[j] >= 0? names[idx[j]] : 0) : names[j];
+		snd_putc(b, '\t');
+		if (s) snd_put(b, s, strlen(s));
+	}
+	snd_putc(b, '\n');
+	snd_flush(b);
+}
+
+static char **snd_read_list(const char *fn, int *n_) // the first field of each line
+{
+	FILE *fp;
+	char buf[4096], **a = 0;
+	int n = 0, m = 0;
+	*n_ = 0;
+	if ((fp = fopen(fn, "r")) == 0) return 0;
+	while (fgets(buf, sizeof(buf), fp)) {
+		buf[strcspn(buf, "\t\r\n")] = 0;
+		if (buf[0] == 0) continue;
+		if (n == m) {
+			m = m? m<<1 : 16;
+			a = (char**)realloc(a, m * sizeof(char*));
+		}
+		a[n++] = strdup(buf);
+	}
+	fclose(fp);
+	*n_ = n;
+	return a;
+}
+
+static void snd_free_list(int n, char **a)
+{
+	int i;
+	for (i = 0; i < n; ++i) free(a[i]);
+	free(a);
+}
+
+typedef struct {
+	const char *s;
+	int i;
+} snd_name_t;
+
+static int snd_name_cmp(const void *a, const void *b)
+{
+	return strcmp(((const snd_name_t*)a)->s, ((const snd_name_t*)b)->s);
+}
+
+static int snd_name_get(int n, const snd_name_t *a, const char *s) // index of $s in sorted $a, or -1
+{
+	snd_name_t t, *p;
+	t.s = s, t.i = -1;
+	p = (snd_name_t*)bsearch(&t, a, n, sizeof(snd_name_t), snd_name_cmp);
+	return p? p->i : -1;
+}
+
+static snd_name_t *snd_name_index(int n, char *const* s)
+{
+	snd_name_t *a;
+	int i;
+	a = (snd_name_t*)malloc(n * sizeof(snd_name_t));
+	for (i = 0; i < n; ++i) a[i].s = s[i], a[i].i = i;
+	qsort(a, n, sizeof(snd_name_t), snd_name_cmp);
+	return a;
+}
+
+/************
+ * Commands *
+ ************/
+
+static int snd_cname(int argc, char *argv[])
+{
+	snd_row_t r;
+	char *const* names;
+	int j;
+	if (argc < 2) {
+		fprintf(stderr, "Usage: sann snd cname <in.snd>\n");
+		return 1;
+	}
+	if (snd_open(&r, argv[1]) < 0) return 1;
+	snd_next(&r);
+	if ((names = sann_reader_col_names(r.r)) != 0)
+		for (j = 0; j < r.n_col; ++j) puts(names[j]);
+	snd_close(&r);
+	return 0;
+}
+
+static int snd_select(int argc, char *argv[], int reorder) // selcol and reorder
+{
+	snd_row_t r;
+	snd_buf_t b = {0,0,0};
+	snd_name_t *h;
+	char **list;
+	int c, i, j, n_list, n_idx = 0, *idx = 0, ret = 1;
+	while ((c = getopt(argc, argv, "")) >= 0);
+	if (argc - optind < 1) {
+		fprintf(stderr, "Usage: sann snd %s <col.list> [in.snd]\n", reorder? "reorder" : "selcol");
+		if (reorder) fprintf(stderr, "Notes: columns are written in the order of col.list; those missing in in.snd are zero.\n");
+		else fprintf(stderr, "Notes: columns in col.list are kept in the order of in.snd.\n");
+		return 1;
+	}
+	if ((list = snd_read_list(argv[optind], &n_list)) == 0) {
+		fprintf(stderr, "[E::%s] failed to read the column list '%s'\n", __func__, argv[optind]);
+		return 1;
+	}
+	if (snd_open(&r, optind + 1 < argc? argv[optind+1] : 0) < 0) goto end_select;
+	while (snd_next(&r)) {
+		if (idx == 0) { // map columns at the first row, after the header is read
+			char *const* names = sann_reader_col_names(r.r);
+			if (names == 0) {
+				fprintf(stderr, "[E::%s] no column names in the input\n", __func__);
+				goto end_select;
+			}
+			idx = (int*)malloc((reorder? n_list : r.n_col) * sizeof(int));
+			if (reorder) {
+				h = snd_name_index(r.n_col, names);
+				for (i = 0; i < n_list; ++i)
+					idx[n_idx++] = snd_name_get(r.n_col, h, list[i]);
+				snd_put_header(&b, n_list, list, 0);
+			} else {
+				h = snd_name_index(n_list, list);
+				for (j = 0; j < r.n_col; ++j)
+					if (snd_name_get(n_list, h, names[j]) >= 0)
+						idx[n_idx++] = j;
+				snd_put_header(&b, n_idx, names, idx);
+			}
+			free(h);
+		}
+		snd_put_name(&b, &r);
+		for (i = 0; i < n_idx; ++i) {
+			snd_putc(&b, '\t');
+			if (idx[i] >= 0) snd_put_field(&b, &r, idx[i]);
+			else snd_putc(&b, '0');
+		}
+		snd_putc(&b, '\n');
+		snd_flush(&b);
+	}
+	ret = 0;
+end_select:
+	snd_close(&r);
+	snd_free_list(n_list, list);
+	free(idx); free(b.s);
+	return ret;
+}
+
+typedef struct {
+	float x;
+	int i;
+} snd_val_t;
+
+static int snd_val_cmp(const void *a, const void *b)
+{
+	float x = ((const snd_val_t*)a)->x, y = ((const snd_val_t*)b)->x;
+	return x < y? -1 : x > y? 1 : 0;
+}
+
+static int snd_rank(int argc, char *argv[])
+{
+	snd_row_t r;
+	snd_buf_t b = {0,0,0};
+	snd_val_t *a = 0;
+	float *y = 0;
+	int c, i, j, k, m = 0, zero_trun = 0;
+	while ((c = getopt(argc, argv, "0")) >= 0)
+		if (c == '0') zero_trun = 1;
+	if (argc == optind) {
+		fprintf(stderr, "Usage: sann snd rank [-0] <in.snd>\n");
+		fprintf(stderr, "Notes: values in each row are replaced with ranks in [0,1], where ties get the average\n");
+		fprintf(stderr, "  rank. With -0, values not above 0 become 0 and are not ranked.\n");
+		return 1;
+	}
+	if (snd_open(&r, argv[optind]) < 0) return 1;
+	while (snd_next(&r)) {
+		int i0 = 0;
+		if (m == 0) {
+			char *const* names = sann_reader_col_names(r.r);
+			if (names) snd_put_header(&b, r.n_col, names, 0);
+		}
+		if (r.n_col > m) {
+			m = r.n_col;
+			a = (snd_val_t*)realloc(a, m * sizeof(snd_val_t));
+			y = (float*)realloc(y, m * sizeof(float));
+		}
+		for (j = 0; j < r.n_col; ++j)
+			a[j].x = snd_value(&r, j), a[j].i = j;
+		qsort(a, r.n_col, sizeof(snd_val_t), snd_val_cmp);
+		if (zero_trun)
+			for (; i0 < r.n_col && a[i0].x <= 0.0f; ++i0)
+				y[a[i0].i] = 0.0f;
+		for (i = i0; i < r.n_col; i = j) { // ties in [i,j)
+			float v;
+			for (j = i + 1; j < r.n_col && a[j].x == a[i].x; ++j);
+			v = r.n_col - i0 > 1? (.5 * (i + j - 1) - i0) / (r.n_col - i0 - 1) : .5;
+			for (k = i; k < j; ++k) y[a[k].i] = v;
+		}
+		snd_put_name(&b, &r);
+		for (j = 0; j < r.n_col; ++j) {
+			snd_putc(&b, '\t');
+			snd_putf(&b, "%g", y[j]);
+		}
+		snd_putc(&b, '\n');
+		snd_flush(&b);
+	}
+	snd_close(&r);
+	free(a); free(y); free(b.s);
+	return 0;
+}
+
+static int snd_noise(int argc, char *argv[])
+{
+	snd_row_t r;
+	snd_buf_t b = {0,0,0};
+	int c, j, n = 0;
+	double rate = .3;
+	sann_srand(11);
+	while ((c = getopt(argc, argv, "r:s:")) >= 0) {
+		if (c == 'r') rate = atof(optarg);
+		else if (c == 's') sann_srand(atol(optarg));
+	}
+	if (argc == optind) {
+		fprintf(stderr, "Usage: sann snd noise [options] <in.snd>\n");
+		fprintf(stderr, "Options:\n");
+		fprintf(stderr, "  -r FLOAT  fraction of values set to zero [%g]\n", rate);
+		fprintf(stderr, "  -s INT    random seed [11]\n");
+		return 1;
+	}
+	if (snd_open(&r, argv[optind]) < 0) return 1;
+	while (snd_next(&r)) {
+		if (n++ == 0) {
+			char *const* names = sann_reader_col_names(r.r);
+			if (names) snd_put_header(&b, r.n_col, names, 0);
+		}
+		snd_put_name(&b, &r);
+		for (j = 0; j < r.n_col; ++j) {
+			snd_putc(&b, '\t');
+			if (sann_drand() < rate) snd_putc(&b, '0');
+			else snd_put_field(&b, &r, j);
+		}
+		snd_putc(&b, '\n');
+		snd_flush(&b);
+	}
+	snd_close(&r);
+	free(b.s);
+	return 0;
+}
+
+static int snd_top(int argc, char *argv[])
+{
+	snd_row_t r;
+	snd_buf_t b = {0,0,0};
+	char *const* names = 0;
+	int c, j;
+	while ((c = getopt(argc, argv, "")) >= 0);
+	if (argc == optind) {
+		fprintf(stderr, "Usage: sann snd top <in.snd>\n");
+		fprintf(stderr, "Notes: for each row, print the name, the top two values and their column names.\n");
+		return 1;
+	}
+	if (snd_open(&r, argv[optind]) < 0) return 1;
+	while (snd_next(&r)) {
+		int i1 = -1, i2 = -1;
+		float max = -1.0f, max2 = -1.0f;
+		if (names == 0) names = sann_reader_col_names(r.r);
+		for (j = 0; j < r.n_col; ++j) {
+			float x = snd_value(&r, j);
+			if (x > max) max2 = max, i2 = i1, max = x, i1 = j;
+			else if (x > max2) max2 = x, i2 = j;
+		}
+		snd_put_name(&b, &r);
+		snd_putf(&b, "\t%.6f", max);
+		snd_putf(&b, "\t%.6f", max2);
+		for (j = 0; j < 2; ++j) {
+			int k = j? i2 : i1;
+			snd_putc(&b, '\t');
+			if (k < 0) snd_put(&b, "NA", 2);
+			else if (names) snd_put(&b, names[k], strlen(names[k]));
+			else {
+				char t[16];
+				snd_put(&b, t, snprintf(t, sizeof(t), "%d", k + 1));
+			}
+		}
+		snd_putc(&b, '\n');
+		snd_flush(&b);
+	}
+	snd_close(&r);
+	free(b.s);
+	return 0;
+}
+
+int main_snd(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: sann snd <command> <arguments>\n");
+		fprintf(stderr, "Commands:\n");
+		fprintf(stderr, "  cname     print column names\n");
+		fprintf(stderr, "  selcol    select columns by their names\n");
+		fprintf(stderr, "  reorder   reorder columns by their names and fill missing ones with zero\n");
+		fprintf(stderr, "  rank      convert values in each row to ranks\n");
+		fprintf(stderr, "  noise     randomly set some values to zero\n");
+		fprintf(stderr, "  top       top two columns of each row\n");
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Notes: input may be text, gzip'd or binary as is written by sann_data_dump().\n");
+		return 1;
+	}
+	if (strcmp(argv[1], "cname") == 0) return snd_cname(argc-1, argv+1);
+	else if (strcmp(argv[1], "selcol") == 0) return snd_select(argc-1, argv+1, 0);
+	else if (strcmp(argv[1], "reorder") == 0) return snd_select(argc-1, argv+1, 1);
+	else if (strcmp(argv[1], "rank") == 0) return snd_rank(argc-1, argv+1);
+	else if (strcmp(argv[1], "noise") == 0) return snd_noise(argc-1, argv+1);
+	else if (strcmp(argv[1], "top") == 0) return snd_top(argc-1, argv+1);
+	fprintf(stderr, "[E::%s] unknown command '%s'\n", __func__, argv[1]);
+	return 1;
+}
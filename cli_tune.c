@@ -0,0 +1,326 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include "sann_priv.h"
+
+/*
+ * Hyperparameter search. All configurations share one read-only copy of the
+ * data and the same train/validation split. They are trained concurrently,
+ * one configuration per thread. A configuration is stopped early if, after
+ * the warm-up epochs, its best validation cost is worse than the median of
+ * the best costs other configurations had reached at the same epoch.
+ */
+
+#define TUNE_N_OPT 7
+
+static const char tune_opt_char[TUNE_N_OPT] = { 'h', 'e', 'B', 'r', 'R', 'm', 'b' };
+
+typedef struct {
+	int n;
+	char **s; // alternatives
+} tune_opt_t;
+
+typedef struct {
+	char *s[TUNE_N_OPT]; // textual value of each option; NULL for the default
+	int n_epochs, halted;
+	float cost;
+	sann_t *m;
+} tune_conf_t;
+
+typedef struct {
+	int n_conf, n_epochs, warmup, dtype;
+	uint64_t seed;
+	sann_tconf_t tc0;
+	tune_conf_t *conf;
+	const sann_data_t *x, *y;
+	int n_in, n_out;
+	float *curve;  // curve[i*n_epochs+k]: best validation cost of configuration i after epoch k
+	int *n_done;   // n_done[k]: number of configurations that have finished epoch k
+	pthread_mutex_t lock;
+} tune_shared_t;
+
+typedef struct {
+	tune_shared_t *s;
+	int i, halted, n_epochs;
+	float best;
+} tune_worker_t;
+
+static void tune_opt_add(tune_opt_t *o, const char *arg)
+{
+	const char *p, *q;
+	for (p = q = arg;; ++p) {
+		if (*p == '/' || *p == 0) {
+			o->s = (char**)realloc(o->s, (o->n + 1) * sizeof(char*));
+			o->s[o->n] = (char*)calloc(p - q + 1, 1);
+			strncpy(o->s[o->n++], q, p - q);
+			if (*p == 0) break;
+			q = p + 1;
+		}
+	}
+}
+
+static char *tune_sample(const char *s, int opt) // sample from "lo:hi"; log-uniform for the learning rate
+{
+	char buf[64], *p;
+	double lo, hi, x;
+	lo = strtod(s, &p);
+	if (*p != ':') return strdup(s);
+	hi = strtod(p + 1, &p);
+	x = sann_drand();
+	if (tune_opt_char[opt] == 'e' && lo > 0. && hi > 0.) x = exp(log(lo) + x * (log(hi) - log(lo)));
+	else if (tune_opt_char[opt] == 'B') x = (int)(lo + x * (hi - lo + 1));
+	else x = lo + x * (hi - lo);
+	snprintf(buf, 64, "%g", x);
+	return strdup(buf);
+}
+
+static int tune_n_hidden(const char *s, int32_t *n_neurons)
+{
+	int n = 0;
+	char *p = (char*)s;
+	do {
+		int x = strtol(p, &p, 10);
+		if (n_neurons) n_neurons[n] = x;
+		++n;
+	} while (*p++ == ',');
+	return n;
+}
+
+static int tune_epoch(int epoch, float cost, void *data)
+{
+	tune_worker_t *w = (tune_worker_t*)data;
+	tune_shared_t *s = w->s;
+	int j, n = 0, halt = 0;
+	float *a;
+	if (cost < w->best) w->best = cost;
+	w->n_epochs = epoch + 1;
+	if (epoch >= s->n_epochs) return 0;
+	a = (float*)alloca(s->n_conf * sizeof(float));
+	pthread_mutex_lock(&s->lock);
+	s->curve[w->i * s->n_epochs + epoch] = w->best;
+	++s->n_done[epoch];
+	if (epoch + 1 >= s->warmup && s->n_done[epoch] >= 3) {
+		for (j = 0; j < s->n_conf; ++j) {
+			float c = s->curve[j * s->n_epochs + epoch];
+			if (j != w->i && c < FLT_MAX) a[n++] = c;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	if (n >= 2) { // median stopping rule
+		int k, l;
+		for (k = 1; k < n; ++k) // insertion sort; n is small
+			for (l = k; l > 0 && a[l] < a[l-1]; --l) {
+				float t = a[l]; a[l] = a[l-1]; a[l-1] = t;
+			}
+		halt = (w->best > (n&1? a[n>>1] : .5f * (a[(n>>1)-1] + a[n>>1])));
+	}
+	return (w->halted = halt);
+}
+
+static void tune_worker(void *data, long i, int tid)
+{
+	tune_shared_t *s = (tune_shared_t*)data;
+	tune_conf_t *c = &s->conf[i];
+	tune_worker_t w;
+	sann_tconf_t tc;
+	int malgo = 0, balgo = 0;
+	sann_t *m;
+
+	sann_srand(s->seed); // the generator is thread-local; all configurations start from the same seed
+	if (c->s[5]) malgo = atoi(c->s[5]);
+	if (c->s[6]) balgo = atoi(c->s[6]);
+	sann_tconf_init(&tc, malgo, balgo);
+	tc.n_epochs = s->tc0.n_epochs, tc.vfrac = s->tc0.vfrac;
+	if (s->tc0.max_inc > 0) tc.max_inc = s->tc0.max_inc;
+	if (c->s[1]) tc.h = atof(c->s[1]);
+	if (c->s[2]) tc.mini_batch = atoi(c->s[2]);
+	if (c->s[3]) tc.r_in = atof(c->s[3]);
+	if (c->s[4]) tc.r_hidden = atof(c->s[4]);
+	tc.n_threads = 1;
+
+	if (s->y) {
+		int32_t *n_neurons, n_hidden;
+		n_hidden = c->s[0]? tune_n_hidden(c->s[0], 0) : 1;
+		n_neurons = (int32_t*)alloca((n_hidden + 2) * 4);
+		if (c->s[0]) tune_n_hidden(c->s[0], n_neurons + 1);
+		else n_neurons[1] = 50;
+		n_neurons[0] = s->n_in, n_neurons[n_hidden+1] = s->n_out;
+		m = sann_init_fnn(n_hidden + 2, n_neurons);
+	} else m = sann_init_ae(s->n_in, c->s[0]? atoi(c->s[0]) : 50, SAE_SC_SQRT);
+
+	w.s = s, w.i = i, w.halted = w.n_epochs = 0, w.best = FLT_MAX;
+	sann_train_core(m, &tc, s->x, s->y, tune_epoch, &w);
+	c->n_epochs = w.n_epochs;
+	c->halted = w.halted;
+	c->cost = w.best;
+	c->m = m;
+}
+
+static int tune_cmp(const void *a, const void *b)
+{
+	float x = ((const tune_conf_t*)a)->cost, y = ((const tune_conf_t*)b)->cost;
+	return x < y? -1 : x > y? 1 : 0;
+}
+
+static void tune_free_conf(tune_shared_t *s)
+{
+	int i, j;
+	for (i = 0; i < s->n_conf; ++i) {
+		for (j = 0; j < TUNE_N_OPT; ++j) free(s->conf[i].s[j]);
+		sann_destroy(s->conf[i].m);
+	}
+	free(s->conf);
+}
+
+int main_tune(int argc, char *argv[])
+{
+	int c, i, j, N = 0, N_y = 0, n_in = 0, n_out = 0, n_threads = 1, ret = 1, n_rand = 0, verbose0 = sann_verbose;
+	float **x = 0, **y = 0;
+	char **col_names_in = 0, **col_names_out = 0, *fnout = 0;
+	tune_opt_t opt[TUNE_N_OPT];
+	tune_shared_t s;
+	sann_data_t *dx = 0, *dy = 0;
+
+	memset(opt, 0, sizeof(tune_opt_t) * TUNE_N_OPT);
+	memset(&s, 0, sizeof(tune_shared_t));
+	sann_tconf_init(&s.tc0, 0, 0);
+	s.tc0.max_inc = 0, s.seed = 11, s.warmup = 5, s.dtype = SANN_DT_F32;
+	while ((c = getopt(argc, argv, "h:e:B:r:R:m:b:N:t:n:l:T:s:w:o:Q:")) >= 0) {
+		for (j = 0; j < TUNE_N_OPT; ++j)
+			if (c == tune_opt_char[j]) tune_opt_add(&opt[j], optarg);
+		if (c == 'N') n_rand = atoi(optarg);
+		else if (c == 't') n_threads = atoi(optarg);
+		else if (c == 'n') s.tc0.n_epochs = atoi(optarg);
+		else if (c == 'l') s.tc0.max_inc = atoi(optarg);
+		else if (c == 'T') s.tc0.vfrac = atof(optarg);
+		else if (c == 's') s.seed = atol(optarg);
+		else if (c == 'w') s.warmup = atoi(optarg);
+		else if (c == 'o') fnout = optarg;
+		else if (c == 'Q') s.dtype = atoi(optarg);
+	}
+	if (argc == optind) {
+		fprintf(stderr, "Usage: sann tune [options] <input.snd> [output.snd]\n");
+		fprintf(stderr, "Options:\n");
+		fprintf(stderr, "  Search space (separate alternatives with '/'; LO:HI for a range with -N):\n");
+		fprintf(stderr, "    -h STR        hidden layers, e.g. 50/100/100,50\n");
+		fprintf(stderr, "    -e STR        learning rates, e.g. .0001:.01 (sampled log-uniformly)\n");
+		fprintf(stderr, "    -B STR        minibatch sizes\n");
+		fprintf(stderr, "    -r STR        input dropout rates\n");
+		fprintf(stderr, "    -R STR        hidden dropout rates\n");
+		fprintf(stderr, "    -m STR        minibatch optimization algorithms (1:SGD; 2:RMSprop; 3:Adam)\n");
+		fprintf(stderr, "    -b STR        batch optimization algorithms (1:fixed rate; 2:iRprop-; 3:L-BFGS)\n");
+		fprintf(stderr, "  Search:\n");
+		fprintf(stderr, "    -N INT        sample INT random configurations instead of the full grid\n");
+		fprintf(stderr, "    -t INT        number of configurations trained concurrently [%d]\n", n_threads);
+		fprintf(stderr, "    -w INT        stop a configuration worse than the median after INT epochs [%d]\n", s.warmup);
+		fprintf(stderr, "    -n INT        max number of epochs [%d]\n", s.tc0.n_epochs);
+		fprintf(stderr, "    -l INT        stop if validation cost not reduced after INT epochs [10]\n");
+		fprintf(stderr, "    -T FLOAT      fraction of data used for validation [%g]\n", s.tc0.vfrac);
+		fprintf(stderr, "    -s INT        random seed [11]\n");
+		fprintf(stderr, "    -Q INT        in-memory sample storage (0:float; 1:uint8; 2:fp16) [%d]\n", s.dtype);
+		fprintf(stderr, "    -o FILE       save the best model to FILE []\n");
+		return 1;
+	}
+	if (s.tc0.vfrac <= 0.0f) {
+		fprintf(stderr, "[E::%s] -T must be positive\n", __func__);
+		return 1;
+	}
+
+	sann_srand(s.seed);
+	if (n_rand > 0) { // random search
+		s.n_conf = n_rand;
+		s.conf = (tune_conf_t*)calloc(s.n_conf, sizeof(tune_conf_t));
+		for (i = 0; i < s.n_conf; ++i)
+			for (j = 0; j < TUNE_N_OPT; ++j)
+				if (opt[j].n) s.conf[i].s[j] = tune_sample(opt[j].s[(int)(sann_drand() * opt[j].n)], j);
+	} else { // grid search
+		for (j = 0, s.n_conf = 1; j < TUNE_N_OPT; ++j) {
+			for (i = 0; i < opt[j].n; ++i)
+				if (strchr(opt[j].s[i], ':')) {
+					fprintf(stderr, "[E::%s] ranges are only allowed with -N\n", __func__);
+					return 1;
+				}
+			if (opt[j].n) s.n_conf *= opt[j].n;
+		}
+		s.conf = (tune_conf_t*)calloc(s.n_conf, sizeof(tune_conf_t));
+		for (i = 0; i < s.n_conf; ++i) {
+			int k = i;
+			for (j = 0; j < TUNE_N_OPT; ++j) {
+				if (opt[j].n == 0) continue;
+				s.conf[i].s[j] = strdup(opt[j].s[k % opt[j].n]);
+				k /= opt[j].n;
+			}
+		}
+	}
+	for (j = 0; j < TUNE_N_OPT; ++j)
+		sann_free_names(opt[j].n, opt[j].s);
+
+	if (s.dtype != SANN_DT_F32) { // compact samples are read without a 32-bit copy
+		if ((dx = sann_data_read_packed(argv[optind], s.dtype, 0, &col_names_in)) != 0) N = dx->n, n_in = dx->n_col;
+		if (optind + 1 < argc && (dy = sann_data_read_packed(argv[optind+1], s.dtype, 0, &col_names_out)) != 0) N_y = dy->n, n_out = dy->n_col;
+	} else {
+		x = sann_data_read(argv[optind], &N, &n_in, 0, &col_names_in);
+		if (optind + 1 < argc) y = sann_data_read(argv[optind+1], &N_y, &n_out, 0, &col_names_out);
+	}
+	if (N == 0 || (optind + 1 < argc && N_y == 0)) {
+		fprintf(stderr, "[E::%s] failed to read samples from '%s'\n", __func__, N == 0? argv[optind] : argv[optind+1]);
+		goto end_tune;
+	}
+	if (optind + 1 < argc && N_y != N) {
+		fprintf(stderr, "[E::%s] different number of samples in the input and the output: %d != %d\n", __func__, N, N_y);
+		goto end_tune;
+	}
+	if (dx) sann_data_shuffle(N, (float**)dx->row, dy? (float**)dy->row : 0, 0); // the same split for all configurations
+	else {
+		sann_data_shuffle(N, x, y, 0);
+		dx = sann_data_view(N, n_in, x);
+		if (y) dy = sann_data_view(N, n_out, y);
+	}
+	fprintf(stderr, "[M::%s] read %d samples; trying %d configurations\n", __func__, N, s.n_conf);
+	s.x = dx, s.y = dy, s.n_in = n_in, s.n_out = n_out;
+
+	s.n_epochs = s.tc0.n_epochs;
+	s.curve = (float*)malloc((size_t)s.n_conf * s.n_epochs * sizeof(float));
+	for (i = 0; i < s.n_conf * s.n_epochs; ++i) s.curve[i] = FLT_MAX;
+	s.n_done = (int*)calloc(s.n_epochs, sizeof(int));
+	pthread_mutex_init(&s.lock, 0);
+	sann_verbose = verbose0 < 2? verbose0 : 2; // per-epoch messages of concurrent runs would be interleaved
+	sann_for(n_threads, tune_worker, &s, s.n_conf);
+	sann_verbose = verbose0;
+	pthread_mutex_destroy(&s.lock);
+	if (sann_verbose >= 3) // printed here, as sann_verbose is capped during the search
+		for (i = 0; i < s.n_conf; ++i) {
+			tune_conf_t *ci = &s.conf[i];
+			fprintf(stderr, "[M::%s] config %d:", __func__, i + 1);
+			for (j = 0; j < TUNE_N_OPT; ++j)
+				if (ci->s[j]) fprintf(stderr, " -%c%s", tune_opt_char[j], ci->s[j]);
+			fprintf(stderr, "; %d epochs; validation cost %g\n", ci->n_epochs, ci->cost);
+		}
+
+	qsort(s.conf, s.n_conf, sizeof(tune_conf_t), tune_cmp);
+	printf("#rank\tcost\tepochs\thalted");
+	for (j = 0; j < TUNE_N_OPT; ++j) printf("\t-%c", tune_opt_char[j]);
+	putchar('\n');
+	for (i = 0; i < s.n_conf; ++i) {
+		tune_conf_t *ci = &s.conf[i];
+		printf("%d\t%g\t%d\t%d", i + 1, ci->cost, ci->n_epochs, ci->halted);
+		for (j = 0; j < TUNE_N_OPT; ++j)
+			printf("\t%s", ci->s[j]? ci->s[j] : "*");
+		putchar('\n');
+	}
+	if (fnout && s.n_conf > 0) sann_dump(fnout, s.conf[0].m, col_names_in, col_names_out);
+	ret = 0;
+
+end_tune:
+	tune_free_conf(&s);
+	free(s.curve); free(s.n_done);
+	sann_data_destroy(dx); sann_data_destroy(dy);
+	sann_free_vectors(N, x); sann_free_vectors(N_y, y);
+	sann_free_names(n_in, col_names_in);
+	sann_free_names(n_out, col_names_out);
+	return ret;
+}
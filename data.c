@@ -1,7 +1,11 @@
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <float.h>
 #include <stdio.h>
-#include "sann.h"
+#include <math.h>
+#include <pthread.h>
+#include "sann_priv.h"
 #include "kseq.h"
 #ifdef HAVE_ZLIB
 #include <zlib.h>
@@ -14,105 +18,880 @@ KSTREAM_INIT(int, read, 16384)
 
 #define SANN_MAGIC "SAN\1"
 
-float **sann_data_read(const char *fn, int *n_, int *n_col_, char ***row_names, char ***col_names)
-{
-	kstream_t *ks;
-	float **x = 0;
-	int n = 0, m = 0, dret, n_col = 0;
-	kstring_t str = {0,0,0};
+/*
+ * A reader returns one data line at a time. Lines starting with '#' are
+ * comments, except that the first such line with TABs gives column names.
+ * Lines with a different number of columns from the first are skipped.
+ */
 
+typedef struct {
 #ifdef HAVE_ZLIB
 	gzFile fp;
-	fp = fn && strcmp(fn, "-")? gzopen(fn, "r") : gzdopen(fileno(stdin), "r");
 #else
 	int fp;
-	fp = fn && strcmp(fn, "-")? open(fn, O_RDONLY) : fileno(stdin);
 #endif
-	ks = ks_init(fp);
-	if (row_names) *row_names = 0;
-	if (col_names) *col_names = 0;
-	while (ks_getuntil(ks, KS_SEP_LINE, &str, &dret) >= 0) {
+	kstream_t *ks;
+	kstring_t str;
+	int n_col;
+} data_reader_t;
+
+static void data_open(data_reader_t *r, const char *fn)
+{
+	memset(r, 0, sizeof(data_reader_t));
+#ifdef HAVE_ZLIB
+	r->fp = fn && strcmp(fn, "-")? gzopen(fn, "r") : gzdopen(fileno(stdin), "r");
+#else
+	r->fp = fn && strcmp(fn, "-")? open(fn, O_RDONLY) : fileno(stdin);
+#endif
+	r->ks = ks_init(r->fp);
+}
+
+static void data_close(data_reader_t *r)
+{
+	free(r->str.s);
+	ks_destroy(r->ks);
+#ifdef HAVE_ZLIB
+	gzclose(r->fp);
+#else
+	close(r->fp);
+#endif
+}
+
+// read the next data line; fill $col_names if not NULL and a header is found
+static int data_next(data_reader_t *r, char ***col_names)
+{
+	kstring_t *str = &r->str;
+	int dret;
+	while (ks_getuntil(r->ks, KS_SEP_LINE, str, &dret) >= 0) {
 		int st, i, k;
-		if (str.s[0] == '#' && col_names) {
-			for (i = k = 0; i < str.l; ++i)
-				if (str.s[i] == '\t') ++k;
+		if (str->s[0] == '#' && col_names) {
+			for (i = k = 0; i < str->l; ++i)
+				if (str->s[i] == '\t') ++k;
 			if (k > 0) {
-				n_col = k;
-				*col_names = (char**)malloc(n_col * sizeof(char*));
-				for (i = k = st = 0; i <= str.l; ++i) {
-					if (i == str.l || str.s[i] == '\t') {
-						if (k > 0) str.s[i] = 0, (*col_names)[k-1] = strdup(&str.s[st]);
+				r->n_col = k;
+				*col_names = (char**)malloc(r->n_col * sizeof(char*));
+				for (i = k = st = 0; i <= str->l; ++i) {
+					if (i == str->l || str->s[i] == '\t') {
+						if (k > 0) str->s[i] = 0, (*col_names)[k-1] = strdup(&str->s[st]);
 						++k, st = i + 1;
 					}
 				}
 			}
 		}
-		if (str.s[0] == '#') continue;
-		for (i = k = 0; i < str.l; ++i)
-			if (str.s[i] == '\t') ++k;
-		if (n_col == 0) n_col = k;
-		if (k != n_col) continue; // TODO: throw a warning/error
+		if (str->s[0] == '#') continue;
+		for (i = k = 0; i < str->l; ++i)
+			if (str->s[i] == '\t') ++k;
+		if (r->n_col == 0) r->n_col = k;
+		if (k != r->n_col) continue; // TODO: throw a warning/error
+		return 0;
+	}
+	return -1;
+}
+
+// parse the current line into $x; return the number of bytes allocated for the row name
+static int data_parse(data_reader_t *r, float *x, char **name)
+{
+	kstring_t *str = &r->str;
+	int i, k, st, l = 0;
+	for (i = k = st = 0; i <= str->l; ++i) {
+		if (i == str->l || str->s[i] == '\t') {
+			char *p;
+			if (k == 0) {
+				str->s[i] = 0;
+				if (name) *name = strdup(&str->s[st]), l = i - st + 1;
+			} else x[k-1] = strtod(&str->s[st], &p);
+			++k, st = i + 1;
+		}
+	}
+	return l;
+}
+
+static int data_fill(data_reader_t *r) // refill the buffer of the stream if empty; return the number of buffered bytes
+{
+	kstream_t *ks = r->ks;
+	if (ks->begin >= ks->end && !ks->is_eof) {
+		ks->begin = 0;
+#ifdef HAVE_ZLIB
+		ks->end = gzread(r->fp, ks->buf, ks->bufsize);
+#else
+		ks->end = read(r->fp, ks->buf, ks->bufsize);
+#endif
+		if (ks->end < 0) ks->end = 0;
+		if (ks->end < ks->bufsize) ks->is_eof = 1;
+	}
+	return ks->end - ks->begin;
+}
+
+static int64_t data_read(data_reader_t *r, void *p, int64_t n) // read $n bytes from the stream
+{
+	int64_t l = 0;
+	while (l < n) {
+		int m = data_fill(r);
+		if (m == 0) break;
+		if (m > n - l) m = n - l;
+		memcpy((uint8_t*)p + l, r->ks->buf + r->ks->begin, m);
+		r->ks->begin += m, l += m;
+	}
+	return l;
+}
+
+static int64_t data_names_size(int n, char *const* s)
+{
+	int64_t l = n * sizeof(char*);
+	int i;
+	for (i = 0; i < n; ++i) l += strlen(s[i]) + 1;
+	return l;
+}
+
+/*
+ * IDX files of unsigned bytes, as distributed with MNIST, are detected by the
+ * magic: two zero bytes, 0x08 and the number of dimensions. With three
+ * dimensions, each image is a row with pixels scaled to [0,1]. With one, each
+ * label is a one-hot row with a column for every label up to the largest.
+ * Rows are named by their indices from 1, and pixels by "row:col" as with
+ * mnist/mnist2snd. The *_nl() readers take the number of label columns
+ * instead, such that a subset missing the largest labels still matches the
+ * model.
+ */
+
+typedef struct {
+	int n, n_col, n_dim, width;
+	uint8_t *dat; // $n images of $n_col pixels, or $n labels
+} data_idx_t;
+
+static int data_is_idx(data_reader_t *r) // the number of dimensions, or 0 if not IDX
+{
+	const uint8_t *p;
+	if (data_fill(r) < 4) return 0;
+	p = r->ks->buf + r->ks->begin;
+	return p[0] == 0 && p[1] == 0 && p[2] == 0x08 && (p[3] == 1 || p[3] == 3)? p[3] : 0;
+}
+
+static int data_idx_read(data_reader_t *r, int n_dim, int header_only, int n_label, data_idx_t *a) // read the file after data_is_idx(); labels are always read
+{
+	uint8_t h[16];
+	int i, k;
+	int64_t size, n_col = 1;
+	memset(a, 0, sizeof(data_idx_t));
+	if (data_read(r, h, 4 + 4 * n_dim) != 4 + 4 * n_dim) return -1;
+	for (k = 0; k < n_dim; ++k) { // dimensions are big-endian
+		const uint8_t *p = &h[4 + 4 * k];
+		uint32_t d = (uint32_t)p[0]<<24 | (uint32_t)p[1]<<16 | (uint32_t)p[2]<<8 | p[3];
+		if (d == 0 || d > INT32_MAX) return -1;
+		if (k == 0) a->n = d;
+		else if ((n_col *= d) > INT32_MAX) return -1; // both factors are below 2^31, so the product can't overflow
+		else a->width = d;
+	}
+	a->n_dim = n_dim, a->n_col = n_col;
+	if (header_only && n_dim > 1) return 0;
+	size = (int64_t)a->n * a->n_col;
+	if ((a->dat = (uint8_t*)malloc(size)) == 0) return -1;
+	if (data_read(r, a->dat, size) != size) {
+		free(a->dat);
+		return -1;
+	}
+	if (n_dim == 1) { // one column per label
+		for (i = 0, a->n_col = 1; i < a->n; ++i)
+			if (a->dat[i] + 1 > a->n_col) a->n_col = a->dat[i] + 1;
+		if (n_label > 0) {
+			if (a->n_col > n_label) {
+				if (sann_verbose >= 1)
+					fprintf(stderr, "[E::%s] label %d is out of the %d label columns\n", __func__, a->n_col - 1, n_label);
+				free(a->dat);
+				return -1;
+			}
+			a->n_col = n_label;
+		}
+	}
+	return 0;
+}
+
+static inline void data_idx_row(const data_idx_t *a, int i, float *x)
+{
+	int j;
+	if (a->n_dim == 1) {
+		memset(x, 0, a->n_col * sizeof(float));
+		x[a->dat[i]] = 1.0f;
+	} else {
+		const uint8_t *p = a->dat + (size_t)i * a->n_col;
+		for (j = 0; j < a->n_col; ++j)
+			x[j] = p[j] / 255.0f;
+	}
+}
+
+static void data_idx_names(const data_idx_t *a, char ***row_names, char ***col_names)
+{
+	char buf[32];
+	int i;
+	if (row_names) {
+		*row_names = (char**)malloc(a->n * sizeof(char*));
+		for (i = 0; i < a->n; ++i) {
+			snprintf(buf, sizeof(buf), "%d", i + 1);
+			(*row_names)[i] = strdup(buf);
+		}
+	}
+	if (col_names) {
+		*col_names = (char**)malloc(a->n_col * sizeof(char*));
+		for (i = 0; i < a->n_col; ++i) {
+			if (a->n_dim == 1) snprintf(buf, sizeof(buf), "%d", i);
+			else snprintf(buf, sizeof(buf), "%d:%d", i / a->width, i % a->width);
+			(*col_names)[i] = strdup(buf);
+		}
+	}
+}
+
+int sann_data_idx_dim(const char *fn)
+{
+	data_reader_t r;
+	int k;
+	if (fn == 0 || strcmp(fn, "-") == 0) return 0; // stdin can't be read twice
+	data_open(&r, fn);
+	k = data_is_idx(&r);
+	data_close(&r);
+	return k;
+}
+
+int sann_data_header(const char *fn, int *n_col, char ***col_names)
+{
+	data_reader_t r;
+	int k, ret = 0;
+	*n_col = 0;
+	if (col_names) *col_names = 0;
+	data_open(&r, fn);
+	if ((k = data_is_idx(&r)) > 0) { // labels are read in full, as their column count comes from the data
+		data_idx_t a;
+		if (data_idx_read(&r, k, 1, 0, &a) == 0) {
+			*n_col = a.n_col;
+			data_idx_names(&a, 0, col_names);
+			free(a.dat);
+		} else ret = -1;
+	} else if (data_next(&r, col_names) >= 0) *n_col = r.n_col;
+	else ret = -1;
+	data_close(&r);
+	if (col_names && *col_names) sann_mem_add(SANN_MEM_DATA, data_names_size(*n_col, *col_names));
+	return ret;
+}
+
+/*
+ * Vectors do not carry their dimension. sann_data_read() records it for
+ * each returned array, such that sann_free_vectors() can release the memory
+ * it accounted for.
+ */
+
+typedef struct { float **x; int n_col; } data_tracked_t;
+
+static data_tracked_t *data_tracked; // grown as needed; not accounted for
+static int data_n_tracked, data_m_tracked;
+static pthread_mutex_t data_tracked_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void data_track(float **x, int n_col)
+{
+	pthread_mutex_lock(&data_tracked_lock);
+	if (data_n_tracked == data_m_tracked) {
+		data_m_tracked = data_m_tracked? data_m_tracked<<1 : 16;
+		data_tracked = (data_tracked_t*)realloc(data_tracked, data_m_tracked * sizeof(data_tracked_t));
+	}
+	data_tracked[data_n_tracked].x = x, data_tracked[data_n_tracked++].n_col = n_col;
+	pthread_mutex_unlock(&data_tracked_lock);
+}
+
+static int data_untrack(float **x) // return the dimension of the vectors, or -1 if not tracked
+{
+	int i, n_col = -1;
+	pthread_mutex_lock(&data_tracked_lock);
+	for (i = 0; i < data_n_tracked; ++i)
+		if (data_tracked[i].x == x) {
+			n_col = data_tracked[i].n_col;
+			data_tracked[i] = data_tracked[--data_n_tracked]; // the order doesn't matter
+			break;
+		}
+	pthread_mutex_unlock(&data_tracked_lock);
+	return n_col;
+}
+
+float **sann_data_read(const char *fn, int *n_, int *n_col_, char ***row_names, char ***col_names)
+{
+	return sann_data_read_nl(fn, 0, n_, n_col_, row_names, col_names);
+}
+
+float **sann_data_read_nl(const char *fn, int n_label, int *n_, int *n_col_, char ***row_names, char ***col_names)
+{
+	data_reader_t r;
+	float **x = 0;
+	int i, k, n = 0, m = 0;
+	int64_t mem = 0;
+
+	data_open(&r, fn);
+	if (row_names) *row_names = 0;
+	if (col_names) *col_names = 0;
+	if ((k = data_is_idx(&r)) > 0) {
+		data_idx_t a;
+		if (data_idx_read(&r, k, 0, n_label, &a) < 0) {
+			if (sann_verbose >= 1)
+				fprintf(stderr, "[E::%s] failed to read the IDX file '%s'\n", __func__, fn? fn : "-");
+			data_close(&r);
+			*n_ = *n_col_ = 0;
+			return 0;
+		}
+		n = a.n, r.n_col = a.n_col;
+		x = (float**)malloc(n * sizeof(float*));
+		for (i = 0; i < n; ++i) {
+			x[i] = (float*)malloc(a.n_col * sizeof(float));
+			data_idx_row(&a, i, x[i]);
+		}
+		data_idx_names(&a, row_names, col_names);
+		if (row_names) mem += data_names_size(n, *row_names) - n * sizeof(char*);
+		free(a.dat);
+	}
+	while (k == 0 && data_next(&r, col_names) >= 0) { // text SND
 		if (n == m) {
 			m = m? m<<1 : 8;
 			x = (float**)realloc(x, m * sizeof(float*));
 			if (row_names)
 				*row_names = (char**)realloc(*row_names, m * sizeof(char*));
 		}
-		x[n] = (float*)malloc(n_col * sizeof(float));
-		for (i = k = st = 0; i <= str.l; ++i) {
-			if (i == str.l || str.s[i] == '\t') {
-				char *p;
-				if (k == 0) {
-					str.s[i] = 0;
-					if (row_names) (*row_names)[n] = strdup(&str.s[st]);
-				} else x[n][k-1] = strtod(&str.s[st], &p);
-				++k, st = i + 1;
-			}
-		}
+		x[n] = (float*)malloc(r.n_col * sizeof(float));
+		mem += data_parse(&r, x[n], row_names? &(*row_names)[n] : 0);
 		++n;
 	}
-	free(str.s);
-	ks_destroy(ks);
+	data_close(&r);
 	x = (float**)realloc(x, n * sizeof(float*));
-	if (row_names) *row_names = (char**)realloc(*row_names, n * sizeof(char*));
-	*n_ = n, *n_col_ = n_col;
-#ifdef HAVE_ZLIB
-	gzclose(fp);
-#else
-	close(fp);
-#endif
+	if (row_names) *row_names = (char**)realloc(*row_names, n * sizeof(char*)), mem += n * sizeof(char*);
+	if (col_names && *col_names) mem += data_names_size(r.n_col, *col_names);
+	*n_ = n, *n_col_ = r.n_col;
+	sann_mem_add(SANN_MEM_DATA, mem + (int64_t)n * (r.n_col * sizeof(float) + sizeof(float*)));
+	if (x) data_track(x, r.n_col);
 	return x;
 }
 
+int sann_data_scan(const char *fn, int *n_, int *n_col_, int64_t *name_size)
+{
+	return sann_data_scan_nl(fn, 0, n_, n_col_, name_size);
+}
+
+int sann_data_scan_nl(const char *fn, int n_label, int *n_, int *n_col_, int64_t *name_size)
+{
+	data_reader_t r;
+	char **col_names = 0;
+	int i, k, n = 0;
+	if (fn == 0 || strcmp(fn, "-") == 0) return -1;
+	*name_size = 0;
+	data_open(&r, fn);
+	if ((k = data_is_idx(&r)) > 0) { // only the header of images is read; label columns are counted from the data
+		data_idx_t a;
+		if (data_idx_read(&r, k, 1, n_label, &a) < 0) {
+			data_close(&r);
+			return -1;
+		}
+		for (i = 0; i < a.n; ++i)
+			*name_size += snprintf(0, 0, "%d", i + 1) + 1 + sizeof(char*);
+		n = a.n, r.n_col = a.n_col;
+		free(a.dat);
+	}
+	while (k == 0 && data_next(&r, &col_names) >= 0) {
+		char *p = strchr(r.str.s, '\t');
+		*name_size += (p? p - r.str.s : r.str.l) + 1 + sizeof(char*);
+		++n;
+	}
+	data_close(&r);
+	if (col_names) { // not accounted for
+		for (i = 0; i < r.n_col; ++i) free(col_names[i]);
+		free(col_names);
+	}
+	*n_ = n, *n_col_ = r.n_col;
+	return 0;
+}
+
 void sann_data_shuffle(int n, float **x, float **y, char **names)
 {
-	int i, *s;
-	s = (int*)malloc(n * sizeof(int));
-	for (i = n - 1; i >= 0; --i)
-		s[i] = (int)(sann_drand() * (i+1));
-	for (i = n - 1; i >= 0; --i) {
+	int i;
+	for (i = n - 1; i >= 0; --i) { // Fisher-Yates; no allocation, such that training epochs don't allocate
 		float *tf;
 		char *ts;
-		int j = s[i];
+		int j = (int)(sann_drand() * (i+1));
 		if (x) tf = x[i], x[i] = x[j], x[j] = tf;
 		if (y) tf = y[i], y[i] = y[j], y[j] = tf;
 		if (names) ts = names[i], names[i] = names[j], names[j] = ts;
 	}
-	free(s);
 }
 
 void sann_free_names(int n, char **s)
 {
 	int i;
 	if (s == 0) return;
+	sann_mem_add(SANN_MEM_DATA, -data_names_size(n, s));
 	for (i = 0; i < n; ++i) free(s[i]);
 	free(s);
 }
 
 void sann_free_vectors(int n, float **x)
 {
-	int i;
+	int i, n_col;
 	if (x == 0) return;
+	if ((n_col = data_untrack(x)) >= 0)
+		sann_mem_add(SANN_MEM_DATA, -(int64_t)n * (n_col * sizeof(float) + sizeof(float*)));
 	for (i = 0; i < n; ++i) free(x[i]);
 	free(x);
 }
+
+/*******************
+ * Compact storage *
+ *******************/
+
+static inline uint16_t sann_f32_to_f16(float f) // round to nearest even
+{
+	union { float f; uint32_t u; } x;
+	uint32_t sign, e, m;
+	x.f = f;
+	sign = x.u >> 16 & 0x8000, e = x.u >> 23 & 0xff, m = x.u & 0x7fffff;
+	if (e == 0xff) return sign | 0x7c00 | (m? 0x200 : 0); // inf or nan
+	if (e > 142) return sign | 0x7c00; // overflow
+	if (e < 113) { // subnormal or zero
+		uint32_t shift, r;
+		if (e < 102) return sign;
+		m |= 0x800000, shift = 126 - e;
+		r = m >> shift;
+		if ((m & ((1U<<shift) - 1)) > (1U<<(shift-1)) || ((m & ((1U<<shift) - 1)) == (1U<<(shift-1)) && (r&1))) ++r;
+		return sign | r;
+	}
+	e = (e - 112) << 10 | m >> 13;
+	if ((m & 0x1fff) > 0x1000 || ((m & 0x1fff) == 0x1000 && (e&1))) ++e; // may carry into the exponent, which is correct
+	return sign | e;
+}
+
+static inline float sann_f16_to_f32(uint16_t h)
+{
+	union { float f; uint32_t u; } x;
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16, e = h >> 10 & 0x1f, m = h & 0x3ff;
+	if (e == 0x1f) x.u = sign | 0x7f800000 | m << 13;
+	else if (e) x.u = sign | (e + 112) << 23 | m << 13;
+	else if (m) { // subnormal
+		x.f = m * (1.0f / 16777216.0f);
+		x.u |= sign;
+	} else x.u = sign;
+	return x.f;
+}
+
+static inline int data_type_size(int type)
+{
+	return type == SANN_DT_U8? 1 : type == SANN_DT_F16? 2 : 4;
+}
+
+static int64_t data_mem_size(const sann_data_t *d)
+{
+	int64_t l = d->n * sizeof(void*);
+	if (d->mem) l += (int64_t)d->n * d->n_col * data_type_size(d->type);
+	if (d->scale) l += d->n_col * 3 * sizeof(float);
+	return l;
+}
+
+int64_t sann_data_mem(int n, int n_col, int type)
+{
+	return (int64_t)n * (n_col * data_type_size(type) + sizeof(void*)) + (type == SANN_DT_U8? n_col * 3 * sizeof(float) : 0);
+}
+
+sann_data_t *sann_data_init(int n, int n_col, int type)
+{
+	sann_data_t *d;
+	int i, j, size;
+	if (type != SANN_DT_F32 && type != SANN_DT_F16 && type != SANN_DT_U8) return 0;
+	size = data_type_size(type);
+	d = (sann_data_t*)calloc(1, sizeof(sann_data_t));
+	d->n = n, d->n_col = n_col, d->type = type;
+	d->row = (void**)malloc(n * sizeof(void*));
+	d->mem = malloc((size_t)n * n_col * size);
+	for (i = 0; i < n; ++i)
+		d->row[i] = (uint8_t*)d->mem + (size_t)i * n_col * size;
+	if (type == SANN_DT_U8) {
+		float *max;
+		d->scale = (float*)malloc(n_col * 3 * sizeof(float));
+		d->offset = d->scale + n_col, max = d->offset + n_col;
+		for (j = 0; j < n_col; ++j) d->offset[j] = FLT_MAX, max[j] = -FLT_MAX;
+	}
+	sann_mem_add(SANN_MEM_DATA, data_mem_size(d));
+	return d;
+}
+
+static inline void data_range(sann_data_t *d, const float *x) // U8 only; the range is kept in offset[] and offset[n_col..]
+{
+	float *max = d->offset + d->n_col;
+	int j;
+	for (j = 0; j < d->n_col; ++j) {
+		if (x[j] < d->offset[j]) d->offset[j] = x[j];
+		if (x[j] > max[j]) max[j] = x[j];
+	}
+}
+
+static void data_set_scale(sann_data_t *d)
+{
+	float *max = d->offset + d->n_col;
+	int j;
+	for (j = 0; j < d->n_col; ++j) {
+		if (d->n == 0) d->offset[j] = max[j] = 0.0f;
+		if (d->offset[j] == 0.0f && max[j] <= 1.0f && max[j] > 0.0f) max[j] = 1.0f; // keep pixels/255 and 0/1 labels exact
+		d->scale[j] = (max[j] - d->offset[j]) / 255.0f;
+		while (d->scale[j] > 0.0f && d->offset[j] + d->scale[j] * 255.0f > max[j]) // the largest value must not decode beyond the range
+			d->scale[j] = nextafterf(d->scale[j], 0.0f);
+	}
+}
+
+void sann_data_set(sann_data_t *d, int i, const float *x)
+{
+	int j;
+	if (d->type == SANN_DT_F32) {
+		memcpy(d->row[i], x, d->n_col * sizeof(float));
+	} else if (d->type == SANN_DT_F16) {
+		uint16_t *p = (uint16_t*)d->row[i];
+		for (j = 0; j < d->n_col; ++j)
+			p[j] = sann_f32_to_f16(x[j]);
+	} else if (d->type == SANN_DT_U8) {
+		uint8_t *p = (uint8_t*)d->row[i];
+		for (j = 0; j < d->n_col; ++j)
+			p[j] = d->scale[j] > 0.0f? (uint8_t)((x[j] - d->offset[j]) / d->scale[j] + .5f) : 0;
+	}
+}
+
+#define SANN_PACK_BLOCK 256
+
+typedef struct {
+	sann_data_t *d;
+	float *const* x;
+} data_pack_t;
+
+static void data_pack_worker(void *data, long blk, int tid)
+{
+	data_pack_t *p = (data_pack_t*)data;
+	int i, st = blk * SANN_PACK_BLOCK, en = st + SANN_PACK_BLOCK < p->d->n? st + SANN_PACK_BLOCK : p->d->n;
+	for (i = st; i < en; ++i) sann_data_set(p->d, i, p->x[i]);
+}
+
+sann_data_t *sann_data_pack(int n, int n_col, float *const* x, int type)
+{
+	data_pack_t p;
+	int i;
+	if ((p.d = sann_data_init(n, n_col, type)) == 0) return 0;
+	if (type == SANN_DT_U8) {
+		for (i = 0; i < n; ++i) data_range(p.d, x[i]);
+		data_set_scale(p.d);
+	}
+	p.x = x;
+	sann_for(sann_get_threads(), data_pack_worker, &p, (n + SANN_PACK_BLOCK - 1) / SANN_PACK_BLOCK); // rows are encoded on the shared pool, if any
+	return p.d;
+}
+
+static sann_data_t *data_idx_packed(const char *fn, data_reader_t *r, int n_dim, int type, int n_label, char ***row_names, char ***col_names)
+{
+	data_idx_t a;
+	sann_data_t *d = 0;
+	float *buf;
+	int i;
+	int64_t mem = 0;
+	if (data_idx_read(r, n_dim, 0, n_label, &a) < 0) {
+		if (sann_verbose >= 1)
+			fprintf(stderr, "[E::%s] failed to read the IDX file '%s'\n", __func__, fn);
+		data_close(r);
+		return 0;
+	}
+	data_close(r);
+	if ((d = sann_data_init(a.n, a.n_col, type)) == 0) {
+		free(a.dat);
+		return 0;
+	}
+	if (type == SANN_DT_U8) { // values are in [0,1], at which data_set_scale() keeps k/255 exact
+		for (i = 0; i < a.n_col; ++i) d->offset[i] = 0.0f, d->offset[a.n_col + i] = 1.0f;
+		data_set_scale(d);
+	}
+	if (type == SANN_DT_U8 && n_dim == 3) {
+		memcpy(d->mem, a.dat, (size_t)a.n * a.n_col); // pixels are stored as is; unlike SND, columns are not scaled to their own max
+	} else {
+		buf = (float*)malloc(a.n_col * sizeof(float));
+		for (i = 0; i < a.n; ++i) {
+			data_idx_row(&a, i, buf);
+			sann_data_set(d, i, buf);
+		}
+		free(buf);
+	}
+	data_idx_names(&a, row_names, col_names);
+	if (row_names) mem += data_names_size(a.n, *row_names);
+	if (col_names) mem += data_names_size(a.n_col, *col_names);
+	sann_mem_add(SANN_MEM_DATA, mem);
+	free(a.dat);
+	return d;
+}
+
+sann_data_t *sann_data_read_packed(const char *fn, int type, char ***row_names, char ***col_names)
+{
+	return sann_data_read_packed_nl(fn, type, 0, row_names, col_names);
+}
+
+sann_data_t *sann_data_read_packed_nl(const char *fn, int type, int n_label, char ***row_names, char ***col_names)
+{
+	data_reader_t r;
+	sann_data_t *d;
+	float *buf = 0, *lo = 0, *hi = 0;
+	char **cn = 0;
+	int i, j, k, n = 0;
+	int64_t mem = 0;
+
+	if (row_names) *row_names = 0;
+	if (col_names) *col_names = 0;
+	if (fn == 0 || strcmp(fn, "-") == 0) {
+		if (sann_verbose >= 1)
+			fprintf(stderr, "[E::%s] reading into compact storage needs a file, not stdin\n", __func__);
+		return 0;
+	}
+	data_open(&r, fn); // first pass: count rows; find the range of each column for SANN_DT_U8
+	if ((k = data_is_idx(&r)) > 0) // IDX is read in one pass
+		return data_idx_packed(fn, &r, k, type, n_label, row_names, col_names);
+	while (data_next(&r, &cn) >= 0) {
+		if (lo == 0) {
+			lo = (float*)malloc(r.n_col * 3 * sizeof(float));
+			hi = lo + r.n_col, buf = hi + r.n_col;
+			for (j = 0; j < r.n_col; ++j) lo[j] = FLT_MAX, hi[j] = -FLT_MAX;
+		}
+		if (type == SANN_DT_U8) {
+			data_parse(&r, buf, 0);
+			for (j = 0; j < r.n_col; ++j) {
+				if (buf[j] < lo[j]) lo[j] = buf[j];
+				if (buf[j] > hi[j]) hi[j] = buf[j];
+			}
+		}
+		++n;
+	}
+	data_close(&r);
+	if (cn) { // not accounted for
+		for (j = 0; j < r.n_col; ++j) free(cn[j]);
+		free(cn);
+	}
+	if ((d = sann_data_init(n, r.n_col, type)) == 0) {
+		free(lo);
+		return 0;
+	}
+	if (type == SANN_DT_U8) {
+		memcpy(d->offset, lo, d->n_col * sizeof(float));
+		memcpy(d->offset + d->n_col, hi, d->n_col * sizeof(float));
+		data_set_scale(d);
+	}
+
+	data_open(&r, fn); // second pass: encode each row
+	if (row_names && n > 0) *row_names = (char**)calloc(n, sizeof(char*)), mem += n * sizeof(char*);
+	for (i = 0; i < n && data_next(&r, col_names) >= 0; ++i) {
+		mem += data_parse(&r, buf, row_names? &(*row_names)[i] : 0);
+		sann_data_set(d, i, buf);
+	}
+	data_close(&r);
+	if (col_names && *col_names) mem += data_names_size(d->n_col, *col_names);
+	sann_mem_add(SANN_MEM_DATA, mem);
+	free(lo);
+	return d;
+}
+
+/*
+ * Binary format of compact storage: magic, n, n_col, type, the per-column
+ * scale and offset for SANN_DT_U8, then the rows in order.
+ */
+
+#define SANN_DATA_MAGIC "SND\1"
+
+int sann_data_dump(const char *fn, const sann_data_t *d)
+{
+	FILE *fp;
+	int i, size = data_type_size(d->type), ret = 0;
+	if ((fp = fn && strcmp(fn, "-")? fopen(fn, "wb") : stdout) == 0) return -1;
+	fwrite(SANN_DATA_MAGIC, 1, 4, fp);
+	fwrite(&d->n, 4, 1, fp);
+	fwrite(&d->n_col, 4, 1, fp);
+	fwrite(&d->type, 4, 1, fp);
+	if (d->type == SANN_DT_U8) {
+		fwrite(d->scale, sizeof(float), d->n_col, fp);
+		fwrite(d->offset, sizeof(float), d->n_col, fp);
+	}
+	for (i = 0; i < d->n; ++i)
+		fwrite(d->row[i], size, d->n_col, fp);
+	if (ferror(fp)) ret = -1;
+	if (fp != stdout && fclose(fp) != 0) ret = -1;
+	return ret;
+}
+
+sann_data_t *sann_data_restore(const char *fn)
+{
+	FILE *fp;
+	sann_data_t *d;
+	char magic[4];
+	int32_t n, n_col, type;
+	if ((fp = fn && strcmp(fn, "-")? fopen(fn, "rb") : stdin) == 0) return 0;
+	if (fread(magic, 1, 4, fp) != 4 || strncmp(magic, SANN_DATA_MAGIC, 4) != 0
+		|| fread(&n, 4, 1, fp) != 1 || fread(&n_col, 4, 1, fp) != 1 || fread(&type, 4, 1, fp) != 1
+		|| n < 0 || n_col < 0 || (d = sann_data_init(n, n_col, type)) == 0)
+	{
+		if (fp != stdin) fclose(fp);
+		return 0;
+	}
+	if (type == SANN_DT_U8) {
+		fread(d->scale, sizeof(float), n_col, fp);
+		fread(d->offset, sizeof(float), n_col, fp);
+	}
+	if (fread(d->mem, data_type_size(type), (size_t)n * n_col, fp) != (size_t)n * n_col) {
+		sann_data_destroy(d);
+		d = 0;
+	}
+	if (fp != stdin) fclose(fp);
+	return d;
+}
+
+/*
+ * A streaming reader for tools that look at each row once, such as "sann
+ * eval" and "sann snd". Binary files written by sann_data_dump() are detected
+ * by the magic; they have no names, so rows and columns are named by their
+ * indices from 1. The returned row, line and name are valid until the next
+ * call.
+ */
+
+struct sann_reader_s {
+	data_reader_t r;
+	char **col_names;
+	int m_x;
+	float *x;
+	int64_t n; // number of rows read
+	sann_data_t *bin; // non-NULL for binary input; row[0] keeps the raw row
+	char name[24];
+};
+
+static int data_open_bin(sann_reader_t *r) // return -1 if the header is broken
+{
+	int32_t h[3]; // n, n_col and type
+	int j;
+	char buf[24];
+	r->r.ks->begin += 4; // skip the magic
+	if (data_read(&r->r, h, 12) != 12 || h[1] <= 0 || (r->bin = sann_data_init(1, h[1], h[2])) == 0)
+		return -1;
+	if (h[2] == SANN_DT_U8 && (data_read(&r->r, r->bin->scale, h[1] * sizeof(float)) != h[1] * sizeof(float)
+		|| data_read(&r->r, r->bin->offset, h[1] * sizeof(float)) != h[1] * sizeof(float)))
+		return -1;
+	r->r.n_col = r->m_x = h[1];
+	r->x = (float*)malloc(h[1] * sizeof(float));
+	r->col_names = (char**)malloc(h[1] * sizeof(char*));
+	for (j = 0; j < h[1]; ++j) {
+		snprintf(buf, sizeof(buf), "%d", j + 1);
+		r->col_names[j] = strdup(buf);
+	}
+	return 0;
+}
+
+sann_reader_t *sann_reader_open(const char *fn)
+{
+	sann_reader_t *r;
+	r = (sann_reader_t*)calloc(1, sizeof(sann_reader_t));
+	data_open(&r->r, fn);
+#ifdef HAVE_ZLIB
+	if (r->r.fp == 0) {
+#else
+	if (r->r.fp < 0) {
+#endif
+		ks_destroy(r->r.ks);
+		free(r);
+		return 0;
+	}
+	if (data_fill(&r->r) >= 4 && memcmp(r->r.ks->buf + r->r.ks->begin, SANN_DATA_MAGIC, 4) == 0 && data_open_bin(r) < 0) {
+		if (sann_verbose >= 1)
+			fprintf(stderr, "[E::%s] failed to read the header of binary SND '%s'\n", __func__, fn? fn : "-");
+		sann_reader_close(r);
+		return 0;
+	}
+	return r;
+}
+
+void sann_reader_close(sann_reader_t *r)
+{
+	int i;
+	if (r == 0) return;
+	if (r->col_names) { // not accounted for
+		for (i = 0; i < r->r.n_col; ++i) free(r->col_names[i]);
+		free(r->col_names);
+	}
+	data_close(&r->r);
+	sann_data_destroy(r->bin);
+	free(r->x);
+	free(r);
+}
+
+int sann_reader_is_bin(const sann_reader_t *r)
+{
+	return r->bin != 0;
+}
+
+const char *sann_reader_next_text(sann_reader_t *r, int *n_col, int *len)
+{
+	if (r->bin || data_next(&r->r, r->col_names? 0 : &r->col_names) < 0) return 0;
+	++r->n;
+	*n_col = r->r.n_col;
+	if (len) *len = r->r.str.l;
+	return r->r.str.s;
+}
+
+const float *sann_reader_next(sann_reader_t *r, int *n_col, const char **name)
+{
+	if (r->bin) {
+		const float *x;
+		int64_t size = (int64_t)r->bin->n_col * data_type_size(r->bin->type);
+		if (data_read(&r->r, r->bin->row[0], size) != size) return 0;
+		x = sann_data_decode(r->bin, r->bin->row[0], r->x);
+		snprintf(r->name, sizeof(r->name), "%lld", (long long)++r->n);
+		if (name) *name = r->name;
+		*n_col = r->bin->n_col;
+		return x;
+	}
+	if (sann_reader_next_text(r, n_col, 0) == 0) return 0;
+	if (r->r.n_col > r->m_x) {
+		r->m_x = r->r.n_col;
+		r->x = (float*)realloc(r->x, r->m_x * sizeof(float));
+	}
+	data_parse(&r->r, r->x, 0); // this terminates the row name in place
+	if (name) *name = r->r.str.s;
+	return r->x;
+}
+
+char *const* sann_reader_col_names(const sann_reader_t *r)
+{
+	return r->col_names;
+}
+
+sann_data_t *sann_data_view(int n, int n_col, float *const* x)
+{
+	sann_data_t *d;
+	d = (sann_data_t*)calloc(1, sizeof(sann_data_t));
+	d->n = n, d->n_col = n_col, d->type = SANN_DT_F32;
+	d->row = (void**)malloc(n * sizeof(void*));
+	memcpy(d->row, x, n * sizeof(void*));
+	sann_mem_add(SANN_MEM_DATA, data_mem_size(d));
+	return d;
+}
+
+const float *sann_data_decode(const sann_data_t *d, const void *r, float *buf)
+{
+	int j;
+	if (d->type == SANN_DT_U8) {
+		const uint8_t *q = (const uint8_t*)r;
+		for (j = 0; j < d->n_col; ++j)
+			buf[j] = d->offset[j] + d->scale[j] * q[j];
+		return buf;
+	} else if (d->type == SANN_DT_F16) {
+		const uint16_t *q = (const uint16_t*)r;
+		for (j = 0; j < d->n_col; ++j)
+			buf[j] = sann_f16_to_f32(q[j]);
+		return buf;
+	}
+	return (const float*)r;
+}
+
+const float *sann_data_row(const sann_data_t *d, int i, float *buf)
+{
+	return sann_data_decode(d, d->row[i], buf);
+}
+
+void sann_data_destroy(sann_data_t *d)
+{
+	if (d == 0) return;
+	sann_mem_add(SANN_MEM_DATA, -data_mem_size(d));
+	free(d->scale); free(d->mem); free(d->row); free(d);
+}
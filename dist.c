@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "sann_priv.h"
+
+/*
+ * Processes form a ring: process i sends to process (i+1)%n and receives from
+ * process (i-1+n)%n over TCP. An allreduce over n processes is done in 2(n-1)
+ * rounds, each transferring 1/n of the vector (reduce-scatter, then
+ * allgather), such that the traffic per process does not grow with n.
+ */
+
+#define SANN_DIST_TIMEOUT 60000 // ms to wait for the neighbors to connect
+
+/***************
+ * Connections *
+ ***************/
+
+static int dist_parse_addr(const char *addr, char **host, char **port)
+{
+	const char *p;
+	if ((p = strrchr(addr, ':')) == 0) return -1;
+	*host = (char*)calloc(p - addr + 1, 1);
+	strncpy(*host, addr, p - addr);
+	*port = strdup(p + 1);
+	return 0;
+}
+
+static int dist_listen(const char *addr)
+{
+	struct addrinfo hints, *res;
+	char *host, *port;
+	int fd = -1, on = 1;
+	if (dist_parse_addr(addr, &host, &port) < 0) return -1;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET, hints.ai_socktype = SOCK_STREAM, hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(0, port, &hints, &res) == 0) { // listen on all interfaces
+		fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (fd >= 0 && (bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, 1) < 0))
+			close(fd), fd = -1;
+		freeaddrinfo(res);
+	}
+	free(host); free(port);
+	return fd;
+}
+
+static int dist_connect(const char *addr)
+{
+	struct addrinfo hints, *res;
+	char *host, *port;
+	int fd = -1, i;
+	if (dist_parse_addr(addr, &host, &port) < 0) return -1;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET, hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res) == 0) {
+		for (i = 0; i < SANN_DIST_TIMEOUT / 100; ++i) { // the peer may not be listening yet
+			fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+			if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) == 0) break;
+			close(fd), fd = -1;
+			usleep(100000);
+		}
+		freeaddrinfo(res);
+	}
+	free(host); free(port);
+	return fd;
+}
+
+static int dist_accept(int fd_listen)
+{
+	struct pollfd p;
+	p.fd = fd_listen, p.events = POLLIN;
+	if (poll(&p, 1, SANN_DIST_TIMEOUT) <= 0) return -1;
+	return accept(fd_listen, 0, 0);
+}
+
+static void dist_setopt(int fd)
+{
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// send $sn bytes to the next process while receiving $rn bytes from the previous one
+static int dist_sendrecv(sann_dist_t *d, const void *sbuf, size_t sn, void *rbuf, size_t rn)
+{
+	size_t s = 0, r = 0;
+	if (d->err) return -1;
+	while (s < sn || r < rn) {
+		struct pollfd p[2];
+		int n = 0, is = -1, ir = -1;
+		ssize_t l;
+		if (s < sn) p[is = n].fd = d->fd_next, p[n++].events = POLLOUT;
+		if (r < rn) p[ir = n].fd = d->fd_prev, p[n++].events = POLLIN;
+		if (poll(p, n, -1) <= 0) goto dist_err; // no timeout: other processes may be slower
+		if (is >= 0 && p[is].revents) {
+			if ((l = send(d->fd_next, (const uint8_t*)sbuf + s, sn - s, MSG_NOSIGNAL)) < 0 && errno != EAGAIN) goto dist_err;
+			if (l > 0) s += l;
+		}
+		if (ir >= 0 && p[ir].revents) {
+			if ((l = recv(d->fd_prev, (uint8_t*)rbuf + r, rn - r, 0)) == 0 || (l < 0 && errno != EAGAIN)) goto dist_err;
+			if (l > 0) r += l;
+		}
+	}
+	return 0;
+
+dist_err:
+	if (sann_verbose >= 1)
+		fprintf(stderr, "[E::%s] lost the connection to a neighbor of process %d\n", __func__, d->rank);
+	d->err = 1;
+	return -1;
+}
+
+sann_dist_t *sann_dist_init(int rank, int n, char *const* addr)
+{
+	sann_dist_t *d;
+	int fd_listen, prev;
+	d = (sann_dist_t*)calloc(1, sizeof(sann_dist_t));
+	d->rank = rank, d->n = n, d->fd_next = d->fd_prev = -1;
+	if (n == 1) return d;
+	if ((fd_listen = dist_listen(addr[rank])) < 0) {
+		if (sann_verbose >= 1)
+			fprintf(stderr, "[E::%s] failed to listen on '%s'\n", __func__, addr[rank]);
+		goto init_err;
+	}
+	d->fd_next = dist_connect(addr[(rank + 1) % n]);
+	d->fd_prev = dist_accept(fd_listen);
+	close(fd_listen);
+	if (d->fd_next < 0 || d->fd_prev < 0) {
+		if (sann_verbose >= 1)
+			fprintf(stderr, "[E::%s] failed to connect process %d to its neighbors\n", __func__, rank);
+		goto init_err;
+	}
+	dist_setopt(d->fd_next);
+	dist_setopt(d->fd_prev);
+	if (dist_sendrecv(d, &rank, 4, &prev, 4) < 0 || prev != (rank + n - 1) % n) { // handshake
+		if (sann_verbose >= 1)
+			fprintf(stderr, "[E::%s] process %d is connected to the wrong neighbor\n", __func__, rank);
+		goto init_err;
+	}
+	return d;
+
+init_err:
+	sann_dist_destroy(d);
+	return 0;
+}
+
+void sann_dist_destroy(sann_dist_t *d)
+{
+	if (d == 0) return;
+	if (d->fd_next >= 0) close(d->fd_next);
+	if (d->fd_prev >= 0) close(d->fd_prev);
+	free(d->buf); free(d);
+}
+
+/******************
+ * Ring allreduce *
+ ******************/
+
+static inline int dist_st(int n, int p, int c) // start of the c-th chunk
+{
+	c = (c % p + p) % p;
+	return (int)((int64_t)n * c / p);
+}
+
+static inline int dist_len(int n, int p, int c)
+{
+	c = (c % p + p) % p;
+	return (int)((int64_t)n * (c + 1) / p - (int64_t)n * c / p);
+}
+
+int sann_dist_allreduce(sann_dist_t *d, int n, float *x)
+{
+	int i, j, p = d->n;
+	if (p == 1) return 0;
+	if (d->m_buf < n / p + 1) {
+		d->m_buf = n / p + 1;
+		d->buf = (float*)realloc(d->buf, d->m_buf * sizeof(float));
+	}
+	for (i = 0; i < p - 1; ++i) { // reduce-scatter: afterwards, process r holds the sum of chunk r+1
+		int cs = d->rank - i, cr = d->rank - i - 1, lr = dist_len(n, p, cr);
+		const float *xr = x + dist_st(n, p, cr);
+		if (dist_sendrecv(d, x + dist_st(n, p, cs), dist_len(n, p, cs) * sizeof(float), d->buf, lr * sizeof(float)) < 0) return -1;
+		for (j = 0; j < lr; ++j) d->buf[j] += xr[j];
+		memcpy(x + dist_st(n, p, cr), d->buf, lr * sizeof(float));
+	}
+	for (i = 0; i < p - 1; ++i) { // allgather
+		int cs = d->rank + 1 - i, cr = d->rank - i;
+		if (dist_sendrecv(d, x + dist_st(n, p, cs), dist_len(n, p, cs) * sizeof(float), x + dist_st(n, p, cr), dist_len(n, p, cr) * sizeof(float)) < 0) return -1;
+	}
+	return 0;
+}
+
+int sann_dist_average(sann_dist_t *d, int n, float *x)
+{
+	int i;
+	float a = 1.0f / d->n;
+	if (d->n == 1) return 0;
+	if (sann_dist_allreduce(d, n, x) < 0) return -1;
+	for (i = 0; i < n; ++i) x[i] *= a;
+	return 0;
+}
+
+int sann_dist_bcast(sann_dist_t *d, int n, float *x) // broadcast from process 0
+{
+	if (d->rank != 0) memset(x, 0, n * sizeof(float));
+	return sann_dist_allreduce(d, n, x);
+}
+
+int sann_dist_min(sann_dist_t *d, int x)
+{
+	int i, min = x;
+	float *v;
+	if (d->n == 1) return x;
+	v = (float*)calloc(d->n, sizeof(float));
+	v[d->rank] = x; // each process fills its own slot; exact for |x| < 2^24
+	if (sann_dist_allreduce(d, d->n, v) == 0)
+		for (i = 0; i < d->n; ++i)
+			min = min < (int)v[i]? min : (int)v[i];
+	free(v);
+	return min;
+}
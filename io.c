@@ -2,9 +2,10 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
-#include "sann.h"
+#include "sann_priv.h"
 
 #define SANN_MAGIC "SAN\1"
+#define SANN_CKPT_MAGIC "SCK\1"
 
 static void sann_dump_names(FILE *fp, int n, char *const* names)
 {
@@ -18,29 +19,66 @@ static void sann_dump_names(FILE *fp, int n, char *const* names)
 		fwrite(names[i], 1, strlen(names[i]) + 1, fp);
 }
 
-int sann_dump(const char *fn, const sann_t *m, char *const* col_names_in, char *const* col_names_out)
+/*
+ * With SANN_IO_SPARSE set in the flag word, the number of weights kept at
+ * each layer follows the activation functions, -1 for a dense layer. The
+ * parameters are then written layer by layer: the biases, followed by either
+ * the dense weights or row[], col[] and val[] of the CSR layer.
+ */
+#define SANN_IO_SPARSE 1
+
+static void sann_dump_par(FILE *fp, const sann_t *m)
 {
-	FILE *fp;
-	int n_par;
+	const float *p = m->t;
+	int k;
+	for (k = 1; k < m->n_layers; ++k) {
+		const sann_csr_t *a = m->csr[k-1];
+		int n_w = m->n_neurons[k] * m->n_neurons[k-1];
+		fwrite(p, sizeof(float), m->n_neurons[k], fp);
+		p += m->n_neurons[k];
+		if (a) {
+			fwrite(a->row, 4, a->n_rows + 1, fp);
+			fwrite(a->col, 4, a->nnz, fp);
+			fwrite(a->val, sizeof(float), a->nnz, fp);
+		} else fwrite(p, sizeof(float), n_w, fp);
+		p += n_w;
+	}
+}
+
+static void sann_dump_fp(FILE *fp, const sann_t *m, char *const* col_names_in, char *const* col_names_out)
+{
+	int k, n_par;
 	uint8_t name_flag = 0;
-	int32_t tmp = 0;
+	int32_t flag = m->csr? SANN_IO_SPARSE : 0;
 
 	n_par = sann_n_par(m);
-	fp = fn && strcmp(fn, "-")? fopen(fn, "w") : stdout;
-	if (fp == 0) return -1;
 	fwrite(SANN_MAGIC, 1, 4, fp);
 	fwrite(&m->is_fnn, 4, 1, fp);
-	fwrite(&tmp, 4, 1, fp);
+	fwrite(&flag, 4, 1, fp);
 	fwrite(&m->scaled, 4, 1, fp);
 	fwrite(&m->n_layers, 4, 1, fp);
 	fwrite(m->n_neurons, 4, m->n_layers, fp);
 	fwrite(m->af, 4, m->n_layers - 1, fp);
-	fwrite(m->t, sizeof(float), n_par, fp);
+	if (flag & SANN_IO_SPARSE) {
+		for (k = 0; k < m->n_layers - 1; ++k) {
+			int32_t nnz = m->csr[k]? m->csr[k]->nnz : -1;
+			fwrite(&nnz, 4, 1, fp);
+		}
+		sann_dump_par(fp, m);
+	} else fwrite(m->t, sizeof(float), n_par, fp);
 	if (col_names_in) name_flag |= 1;
 	if (col_names_out) name_flag |= 2;
 	fwrite(&name_flag, 1, 1, fp);
 	sann_dump_names(fp, sann_n_in(m), col_names_in);
 	sann_dump_names(fp, sann_n_out(m), col_names_out);
+}
+
+int sann_dump(const char *fn, const sann_t *m, char *const* col_names_in, char *const* col_names_out)
+{
+	FILE *fp;
+	fp = fn && strcmp(fn, "-")? fopen(fn, "w") : stdout;
+	if (fp == 0) return -1;
+	sann_dump_fp(fp, m, col_names_in, col_names_out);
 	if (fp != stdout) fclose(fp);
 	return 0;
 }
@@ -64,27 +102,48 @@ static char **sann_restore_names(FILE *fp, int n)
 		}
 		free(p);
 		assert(q - p == tot_len);
+		sann_mem_add(SANN_MEM_DATA, tot_len + n * sizeof(char*));
 		return names;
 	} else return 0;
 }
 
-sann_t *sann_restore(const char *fn, char ***col_names_in, char ***col_names_out)
+static void sann_restore_par(FILE *fp, sann_t *m, const int32_t *nnz)
+{
+	float *p = m->t;
+	int i, j, k;
+	m->csr = (sann_csr_t**)calloc(m->n_layers - 1, sizeof(sann_csr_t*));
+	for (k = 1; k < m->n_layers; ++k) {
+		int n_w = m->n_neurons[k] * m->n_neurons[k-1];
+		fread(p, sizeof(float), m->n_neurons[k], fp);
+		p += m->n_neurons[k];
+		if (nnz[k-1] >= 0) { // weights not in the CSR layer stay at zero
+			sann_csr_t *a;
+			a = m->csr[k-1] = sann_csr_init(m->n_neurons[k], m->n_neurons[k-1], nnz[k-1]);
+			fread(a->row, 4, a->n_rows + 1, fp);
+			fread(a->col, 4, a->nnz, fp);
+			fread(a->val, sizeof(float), a->nnz, fp);
+			for (j = 0; j < a->n_rows; ++j)
+				for (i = a->row[j]; i < a->row[j+1]; ++i)
+					p[(size_t)j * a->n_cols + a->col[i]] = a->val[i];
+		} else fread(p, sizeof(float), n_w, fp);
+		p += n_w;
+	}
+}
+
+static sann_t *sann_restore_fp(FILE *fp, char ***col_names_in, char ***col_names_out)
 {
-	FILE *fp;
 	char magic[4];
 	sann_t *m;
-	int32_t tmp, n_par;
+	int32_t flag, n_par;
 	uint8_t name_flag;
 
 	if (col_names_in)  *col_names_in  = 0;
 	if (col_names_out) *col_names_out = 0;
-	fp = fn && strcmp(fn, "-")? fopen(fn, "r") : stdin;
-	if (fp == 0) return 0;
 	fread(magic, 1, 4, fp);
 	if (strncmp(magic, SANN_MAGIC, 4) != 0) return 0;
 	m = (sann_t*)calloc(1, sizeof(sann_t));
 	fread(&m->is_fnn, 4, 1, fp);
-	fread(&tmp, 4, 1, fp);
+	fread(&flag, 4, 1, fp);
 	fread(&m->scaled, 4, 1, fp);
 	fread(&m->n_layers, 4, 1, fp);
 	m->n_neurons = (int32_t*)calloc(m->n_layers, 4);
@@ -92,8 +151,18 @@ sann_t *sann_restore(const char *fn, char ***col_names_in, char ***col_names_out
 	fread(m->n_neurons, 4, m->n_layers, fp);
 	fread(m->af, 4, m->n_layers - 1, fp);
 	n_par = sann_n_par(m);
-	m->t = (float*)malloc(n_par * sizeof(float));
-	fread(m->t, sizeof(float), n_par, fp);
+	if (flag & SANN_IO_SPARSE) {
+		int32_t *nnz;
+		nnz = (int32_t*)malloc((m->n_layers - 1) * 4);
+		fread(nnz, 4, m->n_layers - 1, fp);
+		m->t = (float*)calloc(n_par, sizeof(float));
+		sann_restore_par(fp, m, nnz);
+		free(nnz);
+	} else {
+		m->t = (float*)malloc(n_par * sizeof(float));
+		fread(m->t, sizeof(float), n_par, fp);
+	}
+	sann_mem_add(SANN_MEM_PARAM, (int64_t)n_par * sizeof(float));
 	if (fread(&name_flag, 1, 1, fp) == 1) {
 		char **p;
 		if (name_flag&1) {
@@ -107,6 +176,140 @@ sann_t *sann_restore(const char *fn, char ***col_names_in, char ***col_names_out
 			else sann_free_names(sann_n_out(m), p);
 		}
 	}
+	return m;
+}
+
+sann_t *sann_restore(const char *fn, char ***col_names_in, char ***col_names_out)
+{
+	FILE *fp;
+	sann_t *m;
+	if (col_names_in)  *col_names_in  = 0;
+	if (col_names_out) *col_names_out = 0;
+	fp = fn && strcmp(fn, "-")? fopen(fn, "r") : stdin;
+	if (fp == 0) return 0;
+	m = sann_restore_fp(fp, col_names_in, col_names_out);
 	if (fp != stdin) fclose(fp);
 	return m;
 }
+
+/***************
+ * Checkpoints *
+ ***************/
+
+int sann_ckpt_dump(const char *fn, const sann_ckpt_t *c)
+{
+	FILE *fp;
+	char *tmp;
+	int32_t flag = (c->h? 1 : 0) | (c->snap? 2 : 0) | (c->moments? 4 : 0) | (c->lbfgs? 8 : 0);
+	int ret = 0;
+
+	tmp = (char*)malloc(strlen(fn) + 5);
+	strcat(strcpy(tmp, fn), ".tmp");
+	fp = fopen(tmp, "wb");
+	if (fp == 0) {
+		free(tmp);
+		return -1;
+	}
+	sann_dump_fp(fp, c->m, 0, 0);
+	fwrite(SANN_CKPT_MAGIC, 1, 4, fp);
+	fwrite(&flag, 4, 1, fp);
+	fwrite(&c->epoch, 4, 1, fp);
+	fwrite(&c->N, 4, 1, fp);
+	fwrite(&c->n_par, 4, 1, fp);
+	fwrite(&c->n_cost_inc, 4, 1, fp);
+	fwrite(&c->best_epoch, 4, 1, fp);
+	fwrite(&c->cost_best, 4, 1, fp);
+	fwrite(&c->rc_pending, 4, 1, fp);
+	fwrite(c->rng, 8, 2, fp);
+	fwrite(c->best, sizeof(float), c->n_par, fp);
+	fwrite(c->g_prev, sizeof(float), c->n_par, fp);
+	if (c->h) fwrite(c->h, sizeof(float), c->n_par, fp);
+	if (c->snap) fwrite(c->snap, sizeof(float), c->n_par, fp);
+	if (c->moments) {
+		fwrite(&c->n_steps, 8, 1, fp);
+		fwrite(c->moments, sizeof(float), c->n_par * 2, fp);
+	}
+	if (c->lbfgs) {
+		fwrite(&c->n_pairs, 4, 1, fp);
+		fwrite(&c->head, 4, 1, fp);
+		fwrite(c->rho, 8, SANN_LBFGS_M, fp);
+		fwrite(&c->gamma, 8, 1, fp);
+		fwrite(&c->f, 8, 1, fp);
+		fwrite(&c->rc, 8, 1, fp);
+		fwrite(c->lbfgs, sizeof(float), (size_t)SANN_LBFGS_M * 2 * c->n_par, fp);
+	}
+	if (ferror(fp)) ret = -1;
+	if (fclose(fp) != 0) ret = -1;
+	if (ret == 0 && rename(tmp, fn) != 0) ret = -1; // replace the previous checkpoint atomically
+	free(tmp);
+	return ret;
+}
+
+sann_ckpt_t *sann_ckpt_restore(const char *fn)
+{
+	FILE *fp;
+	sann_ckpt_t *c;
+	char magic[4];
+	int32_t flag;
+	int ok = 1;
+
+	fp = fopen(fn, "rb");
+	if (fp == 0) return 0;
+	c = (sann_ckpt_t*)calloc(1, sizeof(sann_ckpt_t));
+	c->m = sann_restore_fp(fp, 0, 0);
+	if (c->m == 0 || fread(magic, 1, 4, fp) != 4 || strncmp(magic, SANN_CKPT_MAGIC, 4) != 0) {
+		fclose(fp);
+		sann_ckpt_destroy(c);
+		return 0;
+	}
+	ok &= fread(&flag, 4, 1, fp);
+	ok &= fread(&c->epoch, 4, 1, fp);
+	ok &= fread(&c->N, 4, 1, fp);
+	ok &= fread(&c->n_par, 4, 1, fp);
+	ok &= fread(&c->n_cost_inc, 4, 1, fp);
+	ok &= fread(&c->best_epoch, 4, 1, fp);
+	ok &= fread(&c->cost_best, 4, 1, fp);
+	ok &= fread(&c->rc_pending, 4, 1, fp);
+	ok &= (fread(c->rng, 8, 2, fp) == 2);
+	if (ok && c->n_par == sann_n_par(c->m)) {
+		c->best = (float*)malloc(c->n_par * sizeof(float));
+		c->g_prev = (float*)malloc(c->n_par * sizeof(float));
+		if (flag&1) c->h = (float*)malloc(c->n_par * sizeof(float));
+		if (flag&2) c->snap = (float*)malloc(c->n_par * sizeof(float));
+		ok &= (fread(c->best, sizeof(float), c->n_par, fp) == c->n_par);
+		ok &= (fread(c->g_prev, sizeof(float), c->n_par, fp) == c->n_par);
+		if (c->h) ok &= (fread(c->h, sizeof(float), c->n_par, fp) == c->n_par);
+		if (c->snap) ok &= (fread(c->snap, sizeof(float), c->n_par, fp) == c->n_par);
+		if (flag&4) {
+			c->moments = (float*)malloc(c->n_par * 2 * sizeof(float));
+			ok &= fread(&c->n_steps, 8, 1, fp);
+			ok &= (fread(c->moments, sizeof(float), c->n_par * 2, fp) == c->n_par * 2);
+		}
+		if (flag&8) {
+			size_t n = (size_t)SANN_LBFGS_M * 2 * c->n_par;
+			c->lbfgs = (float*)malloc(n * sizeof(float));
+			ok &= fread(&c->n_pairs, 4, 1, fp);
+			ok &= fread(&c->head, 4, 1, fp);
+			ok &= (fread(c->rho, 8, SANN_LBFGS_M, fp) == SANN_LBFGS_M);
+			ok &= fread(&c->gamma, 8, 1, fp);
+			ok &= fread(&c->f, 8, 1, fp);
+			ok &= fread(&c->rc, 8, 1, fp);
+			ok &= (fread(c->lbfgs, sizeof(float), n, fp) == n);
+			ok &= (c->n_pairs >= 0 && c->n_pairs <= SANN_LBFGS_M && c->head >= 0 && c->head < SANN_LBFGS_M);
+		}
+	} else ok = 0;
+	fclose(fp);
+	if (!ok) {
+		sann_ckpt_destroy(c);
+		return 0;
+	}
+	return c;
+}
+
+void sann_ckpt_destroy(sann_ckpt_t *c)
+{
+	if (c == 0) return;
+	sann_destroy(c->m);
+	free(c->best); free(c->g_prev); free(c->h); free(c->snap); free(c->moments); free(c->lbfgs);
+	free(c);
+}
@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include "sann_priv.h"
+
+/*
+ * Microbenchmark of the math.c kernels. Each implementation is timed at vector
+ * lengths from 4 to 1M and compared to a double-precision reference. Scalar
+ * versions are always available; SIMD versions are the public functions when
+ * compiled with the matching instruction set. The SGD update is also checked
+ * to be bit-identical to the unfused update; the program fails if it is not.
+ */
+
+#define KB_MAX_LEN (1<<20)
+#define KB_WORK    (1<<24) // number of elements processed per timing
+
+typedef struct {
+	float *x, *y, *g, *t, *r, *m1, *m2; // inputs
+	float *t1, *r1, *m11, *m21;         // outputs
+} kb_buf_t;
+
+typedef struct {
+	const char *kernel, *impl;
+	float (*sdot)(int, const float*, const float*);
+	void (*saxpy)(int, float, const float*, float*);
+	void (*sgd)(int, float, float, float, float*, const float*);
+	void (*rmsprop)(int, float, const float*, float, float, float, float*, const float*, float*);
+	void (*adam)(int, float, const float*, float, float, float, int64_t, float, float, float*, const float*, float*, float*);
+	void (*softmax)(int, const float*, float*, float*);
+	sann_activate_f af;
+	int cost;
+} kb_kernel_t;
+
+#define KB_DECAY .9f
+#define KB_BETA1 .9f
+#define KB_BETA2 .999f
+#define KB_WD    .01f
+#define KB_H     .001f
+#define KB_A     .02f
+#define KB_L2    .001f
+#define KB_STEP  10
+
+static double kb_time(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static float *kb_rand(int n, double lo, double hi)
+{
+	float *a;
+	int i;
+	a = (float*)malloc(n * sizeof(float));
+	for (i = 0; i < n; ++i) a[i] = lo + (hi - lo) * sann_drand();
+	return a;
+}
+
+static volatile float kb_sink;
+
+static void kb_run(const kb_kernel_t *k, kb_buf_t *b, int n)
+{
+	int i;
+	if (k->sdot) kb_sink = k->sdot(n, b->x, b->y);
+	else if (k->saxpy) k->saxpy(n, KB_A, b->x, b->t1);
+	else if (k->sgd) k->sgd(n, KB_H, KB_A, KB_L2, b->t1, b->g);
+	else if (k->rmsprop) k->rmsprop(n, KB_H, 0, KB_DECAY, KB_A, KB_L2, b->t1, b->g, b->r1);
+	else if (k->adam) k->adam(n, KB_H, 0, KB_BETA1, KB_BETA2, KB_WD, KB_STEP, KB_A, KB_L2, b->t1, b->g, b->m11, b->m21);
+	else if (k->softmax) k->softmax(n, b->x, b->t1, b->r1);
+	else if (k->af) {
+		float d, s = 0.0f;
+		for (i = 0; i < n; ++i) s += k->af(b->x[i], &d) + d;
+		kb_sink = s;
+	} else if (k->cost) {
+		float s = 0.0f;
+		for (i = 0; i < n; ++i) s += sann_sigm_cost(b->y[i], b->r[i]);
+		kb_sink = s;
+	}
+}
+
+static void kb_reset(kb_buf_t *b, int n)
+{
+	memcpy(b->t1, b->t, n * sizeof(float));
+	memcpy(b->r1, b->r, n * sizeof(float));
+	memcpy(b->m11, b->m1, n * sizeof(float));
+	memcpy(b->m21, b->m2, n * sizeof(float));
+}
+
+static inline void kb_err(double ref, double v, double *max_abs, double *max_rel)
+{
+	double e = fabs(v - ref);
+	if (e > *max_abs) *max_abs = e;
+	if (fabs(ref) > 1e-3 && e / fabs(ref) > *max_rel) *max_rel = e / fabs(ref); // ignore cancellation near zero
+}
+
+// compute the kernel once on fresh inputs and compare to the reference
+static void kb_error(const kb_kernel_t *k, kb_buf_t *b, int n, double *max_abs, double *max_rel)
+{
+	int i;
+	*max_abs = *max_rel = 0.;
+	kb_reset(b, n);
+	if (k->sdot) {
+		double s = 0.;
+		for (i = 0; i < n; ++i) s += (double)b->x[i] * b->y[i];
+		kb_err(s, k->sdot(n, b->x, b->y), max_abs, max_rel);
+		return;
+	}
+	kb_run(k, b, n);
+	if (k->softmax) {
+		double max = -1e300, s = 0.;
+		for (i = 0; i < n; ++i)
+			if (b->x[i] > max) max = b->x[i];
+		for (i = 0; i < n; ++i) s += exp(b->x[i] - max);
+		for (i = 0; i < n; ++i) {
+			kb_err(exp(b->x[i] - max) / s, b->t1[i], max_abs, max_rel);
+			kb_err(b->x[i] - max - log(s), b->r1[i], max_abs, max_rel);
+		}
+		return;
+	}
+	for (i = 0; i < n; ++i) {
+		double x = b->x[i], y = b->y[i], t = b->t[i], gi = KB_A * ((double)b->g[i] + KB_L2 * t);
+		if (k->saxpy) {
+			kb_err(t + KB_A * x, b->t1[i], max_abs, max_rel);
+		} else if (k->sgd) {
+			kb_err(t - KB_H * gi, b->t1[i], max_abs, max_rel);
+		} else if (k->rmsprop) {
+			double r = (1. - KB_DECAY) * gi * gi + KB_DECAY * b->r[i];
+			kb_err(t - KB_H / sqrt(1e-6 + r) * gi, b->t1[i], max_abs, max_rel);
+		} else if (k->adam) {
+			double m1 = KB_BETA1 * b->m1[i] + (1. - KB_BETA1) * gi, m2 = KB_BETA2 * b->m2[i] + (1. - KB_BETA2) * gi * gi;
+			double c1 = 1. / (1. - pow(KB_BETA1, KB_STEP)), c2 = 1. / (1. - pow(KB_BETA2, KB_STEP));
+			kb_err(t - KB_H * (c1 * m1 / (sqrt(c2 * m2) + 1e-8) + KB_WD * t), b->t1[i], max_abs, max_rel);
+		} else if (k->af) {
+			float d, v = k->af(b->x[i], &d);
+			double e = k->af == sann_sigm? 1. / (1. + exp(-x)) : k->af == sann_tanh? tanh(x) : x > 0.? x : 0.;
+			double de = k->af == sann_sigm? e * (1. - e) : k->af == sann_tanh? 1. - e * e : x < 0.? 0. : 1.;
+			kb_err(e, v, max_abs, max_rel);
+			kb_err(de, d, max_abs, max_rel);
+		} else if (k->cost) {
+			double p = b->r[i];
+			double c = -(y == 0.? 0. : y * log(p / y)) - (1. - y == 0.? 0. : (1. - y) * log((1. - p) / (1. - y)));
+			kb_err(c, sann_sigm_cost(b->y[i], b->r[i]), max_abs, max_rel);
+		}
+	}
+}
+
+// SGD must match the update before fusion bit for bit, such that "sann train -m1" is unchanged
+static int kb_check_sgd(const kb_kernel_t *k, kb_buf_t *b, int n)
+{
+	const float h = .37f, a = 1.0f / 3; // large enough for rounding differences to reach $t
+	int i, n_diff = 0;
+	kb_reset(b, n);
+	k->sgd(n, h, a, KB_L2, b->t1, b->g);
+	for (i = 0; i < n; ++i) {
+		float t = b->t[i];
+		t -= h * (a * (b->g[i] + KB_L2 * t));
+		if (t != b->t1[i]) ++n_diff;
+	}
+	return n_diff;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, j, n, max_len = KB_MAX_LEN, ret = 0;
+	kb_buf_t b;
+	kb_kernel_t ks[16];
+	int n_ks = 0;
+
+	while ((c = getopt(argc, argv, "n:")) >= 0)
+		if (c == 'n') max_len = atoi(optarg);
+	if (max_len < 4) max_len = 4;
+
+	memset(ks, 0, sizeof(ks));
+#define kb_add(_k, _i, _f, _p) (ks[n_ks].kernel = (_k), ks[n_ks].impl = (_i), ks[n_ks++]._f = (_p))
+	kb_add("sdot", "scalar", sdot, sann_sdot_scalar);
+	kb_add("saxpy", "scalar", saxpy, sann_saxpy_scalar);
+	kb_add("SGD_update", "scalar", sgd, sann_SGD_update_scalar);
+	kb_add("RMSprop_update", "scalar", rmsprop, sann_RMSprop_update_scalar);
+	kb_add("Adam_update", "scalar", adam, sann_Adam_update_scalar);
+	kb_add("softmax", "scalar", softmax, sann_softmax_scalar);
+#ifdef __SSE__
+	kb_add("sdot", "sse", sdot, sann_sdot);
+	kb_add("saxpy", "sse", saxpy, sann_saxpy);
+	kb_add("SGD_update", "sse", sgd, sann_SGD_update);
+	kb_add("RMSprop_update", "sse", rmsprop, sann_RMSprop_update);
+	kb_add("Adam_update", "sse", adam, sann_Adam_update);
+	kb_add("softmax", "sse", softmax, sann_softmax);
+#endif
+	kb_add("sigm", "scalar", af, sann_sigm);
+	kb_add("tanh", "scalar", af, sann_tanh);
+	kb_add("ReLU", "scalar", af, sann_reclin);
+	kb_add("sigm_cost", "scalar", cost, 1);
+#undef kb_add
+
+	sann_srand(11);
+	b.x = kb_rand(max_len, -8., 8.);
+	b.y = kb_rand(max_len, 0., 1.);
+	b.g = kb_rand(max_len, -1., 1.);
+	b.t = kb_rand(max_len, -1., 1.);
+	b.r = kb_rand(max_len, 1e-3, 1.);
+	b.m1 = kb_rand(max_len, -.1, .1);
+	b.m2 = kb_rand(max_len, 1e-4, 1e-2);
+	b.t1 = kb_rand(max_len, 0., 0.);
+	b.r1 = kb_rand(max_len, 0., 0.);
+	b.m11 = kb_rand(max_len, 0., 0.);
+	b.m21 = kb_rand(max_len, 0., 0.);
+	for (i = 0; i < max_len; ++i) // sigm_cost takes y0 in [0,1]; use the 0/1 labels at every third position
+		if (i % 3 == 0) b.y[i] = b.y[i] < .5f? 0.0f : 1.0f;
+
+	printf("#kernel\timpl\tlen\tns_per_elem\tmax_abs_err\tmax_rel_err\n");
+	for (j = 0; j < n_ks; ++j) {
+		for (n = 4; n <= max_len; n <<= 2) {
+			int rep = KB_WORK / n > 0? KB_WORK / n : 1;
+			double t, e_abs, e_rel;
+			kb_error(&ks[j], &b, n, &e_abs, &e_rel);
+			kb_reset(&b, n);
+			kb_run(&ks[j], &b, n); // warm up
+			t = kb_time();
+			for (i = 0; i < rep; ++i)
+				kb_run(&ks[j], &b, n);
+			t = kb_time() - t;
+			printf("%s\t%s\t%d\t%.4f\t%.3g\t%.3g\n", ks[j].kernel, ks[j].impl, n, t * 1e9 / rep / n, e_abs, e_rel);
+		}
+	}
+
+	for (j = 0; j < n_ks; ++j) { // an odd length covers the remainder of SIMD versions
+		int n_diff;
+		if (ks[j].sgd == 0 || (n_diff = kb_check_sgd(&ks[j], &b, max_len - 1)) == 0) continue;
+		fprintf(stderr, "[E::%s] %s %s differs from the unfused SGD update at %d of %d elements\n", __func__, ks[j].kernel, ks[j].impl, n_diff, max_len - 1);
+		ret = 1;
+	}
+
+	free(b.x); free(b.y); free(b.g); free(b.t); free(b.r); free(b.m1); free(b.m2);
+	free(b.t1); free(b.r1); free(b.m11); free(b.m21);
+	return ret;
+}
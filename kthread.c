@@ -0,0 +1,296 @@
+#ifdef __linux__
+#define _GNU_SOURCE // for pthread_setaffinity_np()
+#endif
+#include <pthread.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include "kthread.h"
+
+/************
+ * kt_for() *
+ ************/
+
+struct kt_for_t;
+
+typedef struct {
+	struct kt_for_t *t;
+	long i;
+} ktf_worker_t;
+
+typedef struct kt_for_t {
+	int n_threads;
+	long n;
+	ktf_worker_t *w;
+	void (*func)(void*,long,int);
+	void *data;
+} kt_for_t;
+
+static inline long steal_work(kt_for_t *t)
+{
+	int i, min_i = -1;
+	long k, min = LONG_MAX;
+	for (i = 0; i < t->n_threads; ++i)
+		if (min > t->w[i].i) min = t->w[i].i, min_i = i;
+	k = __sync_fetch_and_add(&t->w[min_i].i, t->n_threads);
+	return k >= t->n? -1 : k;
+}
+
+static void *ktf_worker(void *data)
+{
+	ktf_worker_t *w = (ktf_worker_t*)data;
+	long i;
+	for (;;) {
+		i = __sync_fetch_and_add(&w->i, w->t->n_threads);
+		if (i >= w->t->n) break;
+		w->t->func(w->t->data, i, w - w->t->w);
+	}
+	while ((i = steal_work(w->t)) >= 0)
+		w->t->func(w->t->data, i, w - w->t->w);
+	pthread_exit(0);
+}
+
+void kt_for(int n_threads, void (*func)(void*,long,int), void *data, long n)
+{
+	if (n_threads > 1) {
+		int i;
+		kt_for_t t;
+		pthread_t *tid;
+		t.func = func, t.data = data, t.n_threads = n_threads, t.n = n;
+		t.w = (ktf_worker_t*)calloc(n_threads, sizeof(ktf_worker_t));
+		tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+		for (i = 0; i < n_threads; ++i)
+			t.w[i].t = &t, t.w[i].i = i;
+		for (i = 0; i < n_threads; ++i) pthread_create(&tid[i], 0, ktf_worker, &t.w[i]);
+		for (i = 0; i < n_threads; ++i) pthread_join(tid[i], 0);
+		free(tid); free(t.w);
+	} else {
+		long j;
+		for (j = 0; j < n; ++j) func(data, j, 0);
+	}
+}
+
+/*****************
+ * kt_forpool() *
+ *****************/
+
+/*
+ * A persistent pool for kt_for()-like loops. The caller works as thread 0 and
+ * the pool keeps n_threads-1 threads waiting between loops. Each thread takes
+ * a contiguous range of items, such that neighboring items stay on the same
+ * core, and then steals from the thread with the most items left.
+ *
+ * An idle pool thread can also run one long task, such as a helper that
+ * overlaps with loops in the calling thread. A loop only uses the threads
+ * not running a task, and a task is never queued: kt_forpool_spawn() fails if
+ * no thread is idle, in which case the caller runs the task itself.
+ */
+
+struct kt_forpool_t;
+
+typedef struct {
+	void (*func)(void*);
+	void *data;
+	struct kt_forpool_t *t;
+	int done;
+} ktp_task_t;
+
+typedef struct {
+	struct kt_forpool_t *t;
+	long i, end;
+	int slot, in_loop; // thread index in the current loop; whether this thread takes part in it
+	ktp_task_t *task;
+} ktp_worker_t;
+
+typedef struct kt_forpool_t {
+	int n_threads, n_pending, busy, quit;
+	long n, gen;
+	pthread_t *tid;
+	ktp_worker_t *w;
+	void (*func)(void*,long,int);
+	void *data;
+	pthread_mutex_t mutex;
+	pthread_cond_t cv_m, cv_s;
+} kt_forpool_t;
+
+static __thread int ktp_nested = 0; // set in pool threads and in a caller running a loop
+
+static inline long ktp_steal(kt_forpool_t *t) // -1 if no work is left; -2 if the race is lost
+{
+	int i, max_i = -1;
+	long k, max = 0;
+	for (i = 0; i < t->n_threads; ++i)
+		if (t->w[i].end - t->w[i].i > max)
+			max = t->w[i].end - t->w[i].i, max_i = i;
+	if (max_i < 0) return -1;
+	k = __sync_fetch_and_add(&t->w[max_i].i, 1);
+	return k < t->w[max_i].end? k : -2;
+}
+
+static void ktp_run(ktp_worker_t *w)
+{
+	kt_forpool_t *t = w->t;
+	int tid = w->slot;
+	long k;
+	while ((k = __sync_fetch_and_add(&w->i, 1)) < w->end)
+		t->func(t->data, k, tid);
+	while ((k = ktp_steal(t)) != -1)
+		if (k >= 0) t->func(t->data, k, tid);
+}
+
+static void *ktp_worker(void *data)
+{
+	ktp_worker_t *w = (ktp_worker_t*)data;
+	kt_forpool_t *t = w->t;
+	long gen = 0;
+	ktp_nested = 1;
+	for (;;) {
+		ktp_task_t *task;
+		pthread_mutex_lock(&t->mutex);
+		while (t->gen == gen && w->task == 0 && !t->quit) pthread_cond_wait(&t->cv_s, &t->mutex);
+		if (t->quit) {
+			pthread_mutex_unlock(&t->mutex);
+			break;
+		}
+		if (t->gen != gen) { // a new loop, which this thread may not take part in
+			int active = w->in_loop;
+			gen = t->gen;
+			pthread_mutex_unlock(&t->mutex);
+			if (!active) continue;
+			ktp_run(w);
+			pthread_mutex_lock(&t->mutex);
+			w->in_loop = 0;
+			if (--t->n_pending == 0) pthread_cond_broadcast(&t->cv_m);
+			pthread_mutex_unlock(&t->mutex);
+			continue;
+		}
+		task = w->task;
+		pthread_mutex_unlock(&t->mutex);
+		ktp_nested = 0; // a task may start its own loops
+		task->func(task->data);
+		ktp_nested = 1;
+		pthread_mutex_lock(&t->mutex);
+		w->task = 0, task->done = 1;
+		pthread_cond_broadcast(&t->cv_m);
+		pthread_mutex_unlock(&t->mutex);
+	}
+	pthread_exit(0);
+}
+
+void *kt_forpool_init(int n_threads, int pin)
+{
+	kt_forpool_t *t;
+	int i;
+	if (n_threads < 1) n_threads = 1;
+	t = (kt_forpool_t*)calloc(1, sizeof(kt_forpool_t));
+	t->n_threads = n_threads;
+	t->w = (ktp_worker_t*)calloc(n_threads, sizeof(ktp_worker_t));
+	t->tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+	pthread_mutex_init(&t->mutex, 0);
+	pthread_cond_init(&t->cv_m, 0);
+	pthread_cond_init(&t->cv_s, 0);
+	for (i = 0; i < n_threads; ++i) t->w[i].t = t;
+	for (i = 1; i < n_threads; ++i) {
+		pthread_create(&t->tid[i], 0, ktp_worker, &t->w[i]);
+#ifdef __linux__
+		if (pin) { // thread i on CPU i; the caller is not pinned
+			long n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(i % (n_cpu > 0? n_cpu : 1), &set);
+			pthread_setaffinity_np(t->tid[i], sizeof(cpu_set_t), &set);
+		}
+#endif
+	}
+	return t;
+}
+
+void kt_forpool_destroy(void *_t)
+{
+	kt_forpool_t *t = (kt_forpool_t*)_t;
+	int i;
+	if (t == 0) return;
+	pthread_mutex_lock(&t->mutex);
+	t->quit = 1;
+	pthread_cond_broadcast(&t->cv_s);
+	pthread_mutex_unlock(&t->mutex);
+	for (i = 1; i < t->n_threads; ++i) pthread_join(t->tid[i], 0);
+	pthread_cond_destroy(&t->cv_s); pthread_cond_destroy(&t->cv_m);
+	pthread_mutex_destroy(&t->mutex);
+	free(t->tid); free(t->w); free(t);
+}
+
+void *kt_forpool_spawn(void *_t, void (*func)(void*), void *data)
+{
+	kt_forpool_t *t = (kt_forpool_t*)_t;
+	ktp_task_t *task;
+	int i;
+	if (t == 0) return 0;
+	pthread_mutex_lock(&t->mutex);
+	for (i = 1; i < t->n_threads; ++i)
+		if (!t->w[i].in_loop && t->w[i].task == 0) break;
+	if (i == t->n_threads) { // no idle thread
+		pthread_mutex_unlock(&t->mutex);
+		return 0;
+	}
+	task = (ktp_task_t*)calloc(1, sizeof(ktp_task_t));
+	task->func = func, task->data = data, task->t = t;
+	t->w[i].task = task;
+	pthread_cond_broadcast(&t->cv_s);
+	pthread_mutex_unlock(&t->mutex);
+	return task;
+}
+
+void kt_forpool_join(void *_task)
+{
+	ktp_task_t *task = (ktp_task_t*)_task;
+	kt_forpool_t *t;
+	if (task == 0) return;
+	t = task->t;
+	pthread_mutex_lock(&t->mutex);
+	while (!task->done) pthread_cond_wait(&t->cv_m, &t->mutex);
+	pthread_mutex_unlock(&t->mutex);
+	free(task);
+}
+
+int kt_forpool_size(const void *_t)
+{
+	return _t? ((const kt_forpool_t*)_t)->n_threads : 1;
+}
+
+void kt_forpool(void *_t, int n_threads, void (*func)(void*,long,int), void *data, long n)
+{
+	kt_forpool_t *t = (kt_forpool_t*)_t;
+	if (n_threads > n) n_threads = n;
+	if (t && n_threads > t->n_threads) n_threads = t->n_threads;
+	if (t && n_threads > 1 && !ktp_nested && __sync_bool_compare_and_swap(&t->busy, 0, 1)) {
+		int i, k;
+		pthread_mutex_lock(&t->mutex);
+		t->func = func, t->data = data, t->n = n;
+		for (i = 1, k = 1; i < t->n_threads; ++i) { // threads running a task are left out
+			ktp_worker_t *w = &t->w[i];
+			w->in_loop = (k < n_threads && w->task == 0);
+			w->slot = w->in_loop? k++ : -1;
+		}
+		t->w[0].slot = 0;
+		for (i = 0; i < t->n_threads; ++i) {
+			ktp_worker_t *w = &t->w[i];
+			if (w->slot >= 0) w->i = n * w->slot / k, w->end = n * (w->slot + 1) / k;
+			else w->i = w->end = 0;
+		}
+		t->n_pending = k - 1;
+		++t->gen;
+		pthread_cond_broadcast(&t->cv_s);
+		pthread_mutex_unlock(&t->mutex);
+		ktp_nested = 1;
+		ktp_run(&t->w[0]);
+		ktp_nested = 0;
+		pthread_mutex_lock(&t->mutex);
+		while (t->n_pending > 0) pthread_cond_wait(&t->cv_m, &t->mutex);
+		pthread_mutex_unlock(&t->mutex);
+		__sync_lock_release(&t->busy);
+	} else { // nested, busy or single-threaded: run in the calling thread
+		long j;
+		for (j = 0; j < n; ++j) func(data, j, 0);
+	}
+}
@@ -0,0 +1,21 @@
+#ifndef KTHREAD_H
+#define KTHREAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void kt_for(int n_threads, void (*func)(void*,long,int), void *data, long n);
+
+void *kt_forpool_init(int n_threads, int pin);
+void kt_forpool_destroy(void *fp);
+int kt_forpool_size(const void *fp);
+void *kt_forpool_spawn(void *fp, void (*func)(void*), void *data);
+void kt_forpool_join(void *task);
+void kt_forpool(void *fp, int n_threads, void (*func)(void*,long,int), void *data, long n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sann_priv.h"
+
+/*
+ * Truncated SVD by subspace iteration. For an m-by-n matrix W, the r columns
+ * of Q converge to the top right singular vectors of W, after which W is
+ * approximated by (W*Q)*Q^T. Only products with W and W^T are needed, which
+ * are computed with sdot and saxpy on the row-major weights.
+ */
+
+#define SANN_LR_ITER 8
+
+static void lr_orth(int n, int r, float *q) // orthonormalize the r vectors of size n in $q with modified Gram-Schmidt
+{
+	int i, j, l;
+	for (j = 0; j < r; ++j) {
+		float *qj = q + (size_t)j * n, s;
+		for (l = 0; l < 2; ++l) // twice is enough in single precision
+			for (i = 0; i < j; ++i)
+				sann_saxpy(n, -sann_sdot(n, q + (size_t)i * n, qj), q + (size_t)i * n, qj);
+		s = sqrtf(sann_sdot(n, qj, qj));
+		if (s < 1e-20f) { // W is of rank lower than r; any unit vector orthogonal to the rest does
+			int iset = 0;
+			double gset;
+			for (i = 0; i < n; ++i) qj[i] = sann_normal(&iset, &gset);
+			--j;
+			continue;
+		}
+		for (i = 0, s = 1.0f / s; i < n; ++i) qj[i] *= s;
+	}
+}
+
+static void lr_subspace(int m, int n, const float *w, int r, int n_iter, float *q, float *y) // $q: r*n; $y: r*m
+{
+	int i, j, it, iset = 0;
+	double gset;
+	for (i = 0; i < r * n; ++i) q[i] = sann_normal(&iset, &gset);
+	lr_orth(n, r, q);
+	for (it = 0; it < n_iter; ++it) {
+		for (j = 0; j < r; ++j) // Y = W * Q
+			for (i = 0; i < m; ++i)
+				y[(size_t)j * m + i] = sann_sdot(n, w + (size_t)i * n, q + (size_t)j * n);
+		lr_orth(m, r, y);
+		memset(q, 0, (size_t)r * n * sizeof(float));
+		for (j = 0; j < r; ++j) // Q = W^T * Y
+			for (i = 0; i < m; ++i)
+				sann_saxpy(n, y[(size_t)j * m + i], w + (size_t)i * n, q + (size_t)j * n);
+		lr_orth(n, r, q);
+	}
+}
+
+sann_t *sann_factorize(const sann_t *m, int k, int r, int n_iter, float *rel_err)
+{
+	int32_t *n_neurons;
+	int i, j, l, n_in, n_out;
+	const float *p;
+	float *q, *y, *t;
+	double s_w = 0., s_u = 0.;
+	sann_t *d;
+
+	if (!m->is_fnn || k < 1 || k >= m->n_layers || r < 1) return 0;
+	n_in = m->n_neurons[k-1], n_out = m->n_neurons[k];
+	if (r > n_in || r > n_out) return 0;
+	if (n_iter <= 0) n_iter = SANN_LR_ITER;
+	n_neurons = (int32_t*)alloca((m->n_layers + 1) * 4);
+	for (l = 0; l < m->n_layers; ++l)
+		n_neurons[l + (l >= k)] = m->n_neurons[l];
+	n_neurons[k] = r;
+	d = sann_init_fnn(m->n_layers + 1, n_neurons);
+	for (l = 0; l < m->n_layers - 1; ++l)
+		d->af[l + (l >= k)] = m->af[l];
+	d->af[k-1] = SANN_AF_LINEAR;
+
+	for (l = 1, p = m->t, t = d->t; l < k; ++l) { // layers below $k are unchanged
+		int n = m->n_neurons[l] * (m->n_neurons[l-1] + 1);
+		memcpy(t, p, n * sizeof(float));
+		p += n, t += n;
+	}
+	q = (float*)malloc((size_t)r * (n_in + n_out) * sizeof(float));
+	y = q + (size_t)r * n_in;
+	lr_subspace(n_out, n_in, p + n_out, r, n_iter, q, y);
+	memset(t, 0, r * sizeof(float)); // bottleneck: V = Q^T, without biases
+	memcpy(t + r, q, (size_t)r * n_in * sizeof(float));
+	t += r + r * n_in;
+	memcpy(t, p, n_out * sizeof(float)); // U = W*Q, with the original biases
+	for (i = 0; i < n_out; ++i) {
+		const float *wi = p + n_out + (size_t)i * n_in;
+		for (j = 0; j < r; ++j) {
+			float u = sann_sdot(n_in, wi, q + (size_t)j * n_in);
+			t[n_out + i * r + j] = u;
+			s_u += u * u;
+		}
+		s_w += sann_sdot(n_in, wi, wi);
+	}
+	free(q);
+	t += n_out * (r + 1), p += n_out * (n_in + 1);
+	memcpy(t, p, (m->t + sann_n_par(m) - p) * sizeof(float)); // layers above $k are unchanged
+	if (rel_err) *rel_err = s_w > 0.? sqrt(s_w > s_u? (s_w - s_u) / s_w : 0.) : 0.; // Q is orthonormal, so |W-WQQ^T|^2 = |W|^2 - |WQ|^2
+	return d;
+}
@@ -42,33 +42,54 @@ float sann_reclin(float x, float *deriv)
 	return x > 0.? x : 0.;
 }
 
+float sann_linear(float x, float *deriv)
+{
+	*deriv = 1.;
+	return x;
+}
+
 sann_activate_f sann_get_af(int type)
 {
 	if (type == SANN_AF_SIGM) return sann_sigm;
 	if (type == SANN_AF_TANH) return sann_tanh;
 	if (type == SANN_AF_ReLU) return sann_reclin;
+	if (type == SANN_AF_LINEAR) return sann_linear;
 	return 0;
 }
 
+void sann_activate(int type, int n, float *x, float *tmp) // in place and without derivatives; $tmp, of size $n, is only used by softmax
+{
+	int i;
+	if (type == SANN_AF_SIGM) {
+		for (i = 0; i < n; ++i) x[i] = 1. / (1. + expf(-x[i]));
+	} else if (type == SANN_AF_TANH) {
+		for (i = 0; i < n; ++i) {
+			float t = expf(-2. * x[i]);
+			x[i] = isinf(t)? -1. : (1. - t) / (1. + t);
+		}
+	} else if (type == SANN_AF_ReLU) {
+		for (i = 0; i < n; ++i) x[i] = x[i] > 0.? x[i] : 0.;
+	} else if (type == SANN_AF_SOFTMAX) {
+		sann_softmax(n, x, x, tmp);
+	}
+}
+
 /*********************************
  * Pseudorandom Number Generator *
  *********************************/
 
 #define SANN_RNG_INIT 1181783497276652981ULL
 
-static uint64_t sann_rng[2] = { 11ULL, SANN_RNG_INIT };
-//static volatile int sann_rng_lock = 0;
+static __thread uint64_t sann_rng[2] = { 11ULL, SANN_RNG_INIT }; // one generator per thread, such that models can be trained concurrently
 
 static inline uint64_t xorshift128plus(uint64_t s[2])
 {
 	uint64_t x, y;
-//	while (__sync_lock_test_and_set(&sann_rng_lock, 1)) while (sann_rng_lock); // a spin lock
 	x = s[0], y = s[1];
 	s[0] = y;
 	x ^= x << 23;
 	s[1] = x ^ y ^ (x >> 17) ^ (y >> 26);
 	y += s[1];
-//	__sync_lock_release(&sann_rng_lock);
 	return y;
 }
 
@@ -77,6 +98,16 @@ void sann_srand(uint64_t seed)
 	sann_rng[0] = seed, sann_rng[1] = SANN_RNG_INIT;
 }
 
+void sann_rng_get(uint64_t s[2])
+{
+	s[0] = sann_rng[0], s[1] = sann_rng[1];
+}
+
+void sann_rng_set(const uint64_t s[2])
+{
+	sann_rng[0] = s[0], sann_rng[1] = s[1];
+}
+
 double sann_drand(void)
 {
 	return (xorshift128plus(sann_rng)>>11) * (1.0/9007199254740992.0);
@@ -105,6 +136,26 @@ double sann_normal(int *iset, double *gset)
  * BLAS routines *
  *****************/
 
+/*
+ * Each kernel has a scalar version, *_scalar(), which is always compiled. It
+ * processes the tail of the SIMD version and is the reference for
+ * kernel-bench.c.
+ */
+
+float sann_sdot_scalar(int n, const float *x, const float *y) // BLAS sdot
+{
+	int i;
+	float s = 0.;
+	for (i = 0; i < n; ++i) s += x[i] * y[i];
+	return s;
+}
+
+void sann_saxpy_scalar(int n, float a, const float *x, float *y) // BLAS saxpy
+{
+	int i;
+	for (i = 0; i < n; ++i) y[i] += a * x[i];
+}
+
 #ifdef __SSE__
 float sann_sdot(int n, const float *x, const float *y)
 {
@@ -122,7 +173,7 @@ float sann_sdot(int n, const float *x, const float *y)
 		vs1 = _mm_add_ps(vs1, _mm_mul_ps(vx1, vy1));
 		vs2 = _mm_add_ps(vs2, _mm_mul_ps(vx2, vy2));
 	}
-	for (s = 0.; i < n; ++i) s += x[i] * y[i];
+	s = sann_sdot_scalar(n - i, x + i, y + i);
 	_mm_storeu_ps(t, vs1);
 	s += t[0] + t[1] + t[2] + t[3];
 	_mm_storeu_ps(t, vs2);
@@ -145,69 +196,265 @@ void sann_saxpy(int n, float a, const float *x, float *y)
 		_mm_storeu_ps(&y[i], vt1);
 		_mm_storeu_ps(&y[i+4], vt2);
 	}
-	for (; i < n; ++i) y[i] += a * x[i];
+	sann_saxpy_scalar(n - i, a, x + i, y + i);
 }
 #else
-void sann_saxpy(int n, float a, const float *x, float *y) // BLAS saxpy
+float sann_sdot(int n, const float *x, const float *y) { return sann_sdot_scalar(n, x, y); }
+void sann_saxpy(int n, float a, const float *x, float *y) { sann_saxpy_scalar(n, a, x, y); }
+#endif
+
+/***********
+ * Softmax *
+ ***********/
+
+/*
+ * The softmax output layer keeps the probabilities in $p and the
+ * log-probabilities in $logp. This takes one expf() per output and a single
+ * logf(), and is stable for logits of any magnitude as the maximum is
+ * subtracted first. With categorical cross-entropy, the cost is then a dot
+ * product and the delta at the output is $p - $y0, as for sigmoid outputs.
+ * $z and $p may point to the same array.
+ */
+
+void sann_softmax_scalar(int n, const float *z, float *p, float *logp)
 {
 	int i;
-	for (i = 0; i < n; ++i) y[i] += a * x[i];
+	float max = -FLT_MAX, s = 0.0f, ls;
+	for (i = 0; i < n; ++i)
+		if (z[i] > max) max = z[i];
+	for (i = 0; i < n; ++i) {
+		logp[i] = z[i] - max;
+		s += (p[i] = expf(logp[i]));
+	}
+	ls = logf(s), s = 1.0f / s;
+	for (i = 0; i < n; ++i)
+		p[i] *= s, logp[i] -= ls;
 }
-float sann_sdot(int n, const float *x, const float *y) // BLAS sdot
+
+#ifdef __SSE__
+void sann_softmax(int n, const float *z, float *p, float *logp)
 {
-	int i;
-	float s = 0.;
-	for (i = 0; i < n; ++i) s += x[i] * y[i];
-	return s;
+	int i, n4 = n>>2<<2;
+	float max = -FLT_MAX, s = 0.0f, ls, t[4];
+	__m128 v, vs, vl;
+	v = _mm_set1_ps(-FLT_MAX);
+	for (i = 0; i < n4; i += 4)
+		v = _mm_max_ps(v, _mm_loadu_ps(&z[i]));
+	_mm_storeu_ps(t, v);
+	for (i = 0; i < 4; ++i)
+		if (t[i] > max) max = t[i];
+	for (i = n4; i < n; ++i)
+		if (z[i] > max) max = z[i];
+	for (i = 0; i < n; ++i) { // expf() is not vectorized
+		logp[i] = z[i] - max;
+		s += (p[i] = expf(logp[i]));
+	}
+	ls = logf(s), s = 1.0f / s;
+	vs = _mm_set1_ps(s), vl = _mm_set1_ps(ls);
+	for (i = 0; i < n4; i += 4) {
+		_mm_storeu_ps(&p[i], _mm_mul_ps(_mm_loadu_ps(&p[i]), vs));
+		_mm_storeu_ps(&logp[i], _mm_sub_ps(_mm_loadu_ps(&logp[i]), vl));
+	}
+	for (i = n4; i < n; ++i)
+		p[i] *= s, logp[i] -= ls;
 }
+#else
+void sann_softmax(int n, const float *z, float *p, float *logp) { sann_softmax_scalar(n, z, p, logp); }
 #endif
 
+float sann_softmax_cost(int n, const float *y0, const float *logp)
+{
+	return -sann_sdot(n, y0, logp);
+}
+
 /********************
  * SGD and variants *
  ********************/
 
-void sann_SGD(int n, float h, float *t, float *g, sann_gradient_f func, void *data)
+/*
+ * The *_update() functions take the raw gradient $g and finalize it on the
+ * fly as $a * ($g + $l2 * $t), such that finalization, L2 regularization and
+ * the update are done in one pass over the parameters.
+ */
+
+void sann_SGD_update_scalar(int n, float h, float a, float l2, float *t, const float *g)
 {
 	int i;
-	func(n, t, g, data);
 	for (i = 0; i < n; ++i)
-		t[i] -= h * g[i];
+		t[i] -= h * (a * (g[i] + l2 * t[i]));
+}
+
+void sann_RMSprop_update_scalar(int n, float h0, const float *h, float decay, float a, float l2, float *t, const float *g, float *r)
+{
+	int i;
+	for (i = 0; i < n; ++i) {
+		float lr = h? h[i] : h0, gi = a * (g[i] + l2 * t[i]);
+		r[i] = (1. - decay) * gi * gi + decay * r[i];
+		t[i] -= lr / sqrt(1e-6 + r[i]) * gi;
+	}
+}
+
+void sann_Adam_update_scalar(int n, float h0, const float *h, float beta1, float beta2, float wd, int64_t step, float a, float l2, float *t, const float *g, float *m1, float *m2)
+{
+	int i;
+	float c1, c2;
+	c1 = 1.0f / (1.0f - pow(beta1, step)), c2 = 1.0f / (1.0f - pow(beta2, step));
+	for (i = 0; i < n; ++i) {
+		float lr = h? h[i] : h0, gi = a * (g[i] + l2 * t[i]);
+		m1[i] = beta1 * m1[i] + (1.0f - beta1) * gi;
+		m2[i] = beta2 * m2[i] + (1.0f - beta2) * gi * gi;
+		t[i] -= lr * (c1 * m1[i] / (sqrtf(c2 * m2[i]) + 1e-8f) + wd * t[i]);
+	}
+}
+
+void sann_iRprop_scalar(int n, int first, float inc, float dec, float h_min, float h_max, const float *t, float *t_prev, float *g_prev, float *h)
+{
+	int i;
+	for (i = 0; i < n; ++i) {
+		float d = t[i] - t_prev[i];
+		if (!first) {
+			float tmp = g_prev[i] * d;
+			if (tmp > 0.) {
+				h[i] *= inc;
+				if (h[i] > h_max) h[i] = h_max;
+			} else if (tmp < 0.) {
+				h[i] *= dec;
+				if (h[i] < h_min) h[i] = h_min;
+				d = 0.;
+			}
+		}
+		g_prev[i] = d, t_prev[i] = t[i];
+	}
 }
 
 #ifdef __SSE__
-void sann_RMSprop(int n, float h0, const float *h, float decay, float *t, float *g, float *r, sann_gradient_f func, void *data)
+void sann_SGD_update(int n, float h, float a, float l2, float *t, const float *g)
+{
+	int i, n4 = n>>2<<2;
+	__m128 vh, va, vl2, vt, vg;
+	vh = _mm_set1_ps(h), va = _mm_set1_ps(a), vl2 = _mm_set1_ps(l2);
+	for (i = 0; i < n4; i += 4) {
+		vt = _mm_loadu_ps(&t[i]);
+		vg = _mm_mul_ps(va, _mm_add_ps(_mm_loadu_ps(&g[i]), _mm_mul_ps(vl2, vt)));
+		_mm_storeu_ps(&t[i], _mm_sub_ps(vt, _mm_mul_ps(vh, vg)));
+	}
+	sann_SGD_update_scalar(n - i, h, a, l2, t + i, g + i);
+}
+
+void sann_RMSprop_update(int n, float h0, const float *h, float decay, float a, float l2, float *t, const float *g, float *r)
 {
 	int i, n4 = n>>2<<2;
-	__m128 vh, vg, vr, vt, vd, vd1, tmp, vtiny;
+	__m128 vh, vg, vr, vt, vd, vd1, tmp, vtiny, va, vl2;
 	vh = _mm_set1_ps(h0);
 	vd = _mm_set1_ps(decay);
 	vd1 = _mm_set1_ps(1.0f - decay);
 	vtiny = _mm_set1_ps(1e-6f);
-	func(n, t, g, data);
+	va = _mm_set1_ps(a), vl2 = _mm_set1_ps(l2);
 	for (i = 0; i < n4; i += 4) {
 		vt = _mm_loadu_ps(&t[i]);
 		vr = _mm_loadu_ps(&r[i]);
-		vg = _mm_loadu_ps(&g[i]);
+		vg = _mm_mul_ps(va, _mm_add_ps(_mm_loadu_ps(&g[i]), _mm_mul_ps(vl2, vt)));
 		if (h) vh = _mm_loadu_ps(&h[i]);
 		vr = _mm_add_ps(_mm_mul_ps(vd1, _mm_mul_ps(vg, vg)), _mm_mul_ps(vd, vr));
 		_mm_storeu_ps(&r[i], vr);
 		tmp = _mm_sub_ps(vt, _mm_mul_ps(_mm_mul_ps(vh, _mm_rsqrt_ps(_mm_add_ps(vtiny, vr))), vg));
 		_mm_storeu_ps(&t[i], tmp);
 	}
-	for (; i < n; ++i) {
-		r[i] = (1. - decay) * g[i] * g[i] + decay * r[i];
-		t[i] -= (h? h[i] : h0) / sqrt(1e-6 + r[i]) * g[i];
+	sann_RMSprop_update_scalar(n - i, h0, h? h + i : 0, decay, a, l2, t + i, g + i, r + i);
+}
+
+void sann_Adam_update(int n, float h0, const float *h, float beta1, float beta2, float wd, int64_t step, float a, float l2, float *t, const float *g, float *m1, float *m2)
+{
+	int i, n4 = n>>2<<2;
+	float c1, c2;
+	__m128 vh, vg, vm, vv, vt, vb1, vb1c, vb2, vb2c, vc1, vc2, veps, vwd, va, vl2;
+	c1 = 1.0f / (1.0f - pow(beta1, step)), c2 = 1.0f / (1.0f - pow(beta2, step));
+	vh = _mm_set1_ps(h0);
+	vb1 = _mm_set1_ps(beta1), vb1c = _mm_set1_ps(1.0f - beta1);
+	vb2 = _mm_set1_ps(beta2), vb2c = _mm_set1_ps(1.0f - beta2);
+	vc1 = _mm_set1_ps(c1), vc2 = _mm_set1_ps(c2);
+	veps = _mm_set1_ps(1e-8f), vwd = _mm_set1_ps(wd);
+	va = _mm_set1_ps(a), vl2 = _mm_set1_ps(l2);
+	for (i = 0; i < n4; i += 4) { // a single pass over parameters, gradients and both moments
+		vt = _mm_loadu_ps(&t[i]);
+		vg = _mm_mul_ps(va, _mm_add_ps(_mm_loadu_ps(&g[i]), _mm_mul_ps(vl2, vt)));
+		vm = _mm_loadu_ps(&m1[i]);
+		vv = _mm_loadu_ps(&m2[i]);
+		if (h) vh = _mm_loadu_ps(&h[i]);
+		vm = _mm_add_ps(_mm_mul_ps(vb1, vm), _mm_mul_ps(vb1c, vg));
+		vv = _mm_add_ps(_mm_mul_ps(vb2, vv), _mm_mul_ps(vb2c, _mm_mul_ps(vg, vg)));
+		_mm_storeu_ps(&m1[i], vm);
+		_mm_storeu_ps(&m2[i], vv);
+		vg = _mm_div_ps(_mm_mul_ps(vc1, vm), _mm_add_ps(_mm_sqrt_ps(_mm_mul_ps(vc2, vv)), veps));
+		vt = _mm_sub_ps(vt, _mm_mul_ps(vh, _mm_add_ps(vg, _mm_mul_ps(vwd, vt))));
+		_mm_storeu_ps(&t[i], vt);
+	}
+	sann_Adam_update_scalar(n - i, h0, h? h + i : 0, beta1, beta2, wd, step, a, l2, t + i, g + i, m1 + i, m2 + i);
+}
+
+void sann_iRprop(int n, int first, float inc, float dec, float h_min, float h_max, const float *t, float *t_prev, float *g_prev, float *h)
+{
+	int i, n4 = n>>2<<2;
+	__m128 vinc, vdec, vmin, vmax, vzero;
+	vinc = _mm_set1_ps(inc), vdec = _mm_set1_ps(dec);
+	vmin = _mm_set1_ps(h_min), vmax = _mm_set1_ps(h_max);
+	vzero = _mm_setzero_ps();
+	for (i = 0; i < n4; i += 4) {
+		__m128 vt, vd, vh, vs, mpos, mneg, hp, hn;
+		vt = _mm_loadu_ps(&t[i]);
+		vd = _mm_sub_ps(vt, _mm_loadu_ps(&t_prev[i]));
+		if (!first) {
+			vh = _mm_loadu_ps(&h[i]);
+			vs = _mm_mul_ps(_mm_loadu_ps(&g_prev[i]), vd);
+			mpos = _mm_cmpgt_ps(vs, vzero);
+			mneg = _mm_cmplt_ps(vs, vzero);
+			hp = _mm_min_ps(_mm_mul_ps(vh, vinc), vmax);
+			hn = _mm_max_ps(_mm_mul_ps(vh, vdec), vmin);
+			vh = _mm_or_ps(_mm_andnot_ps(_mm_or_ps(mpos, mneg), vh), _mm_or_ps(_mm_and_ps(mpos, hp), _mm_and_ps(mneg, hn)));
+			_mm_storeu_ps(&h[i], vh);
+			vd = _mm_andnot_ps(mneg, vd);
+		}
+		_mm_storeu_ps(&g_prev[i], vd);
+		_mm_storeu_ps(&t_prev[i], vt);
 	}
+	sann_iRprop_scalar(n - i, first, inc, dec, h_min, h_max, t + i, t_prev + i, g_prev + i, h + i);
 }
 #else
+void sann_SGD_update(int n, float h, float a, float l2, float *t, const float *g)
+{
+	sann_SGD_update_scalar(n, h, a, l2, t, g);
+}
+
+void sann_RMSprop_update(int n, float h0, const float *h, float decay, float a, float l2, float *t, const float *g, float *r)
+{
+	sann_RMSprop_update_scalar(n, h0, h, decay, a, l2, t, g, r);
+}
+
+void sann_Adam_update(int n, float h0, const float *h, float beta1, float beta2, float wd, int64_t step, float a, float l2, float *t, const float *g, float *m1, float *m2)
+{
+	sann_Adam_update_scalar(n, h0, h, beta1, beta2, wd, step, a, l2, t, g, m1, m2);
+}
+
+void sann_iRprop(int n, int first, float inc, float dec, float h_min, float h_max, const float *t, float *t_prev, float *g_prev, float *h)
+{
+	sann_iRprop_scalar(n, first, inc, dec, h_min, h_max, t, t_prev, g_prev, h);
+}
+#endif
+
+void sann_SGD(int n, float h, float *t, float *g, sann_gradient_f func, void *data)
+{
+	func(n, t, g, data);
+	sann_SGD_update(n, h, 1.0f, 0.0f, t, g);
+}
+
 void sann_RMSprop(int n, float h0, const float *h, float decay, float *t, float *g, float *r, sann_gradient_f func, void *data)
 {
-	int i;
 	func(n, t, g, data);
-	for (i = 0; i < n; ++i) {
-		float lr = h? h[i] : h0;
-		r[i] = (1. - decay) * g[i] * g[i] + decay * r[i];
-		t[i] -= lr / sqrt(1e-6 + r[i]) * g[i];
-	}
+	sann_RMSprop_update(n, h0, h, decay, 1.0f, 0.0f, t, g, r);
+}
+
+void sann_Adam(int n, float h0, const float *h, float beta1, float beta2, float wd, int64_t step, float *t, float *g, float *m1, float *m2, sann_gradient_f func, void *data)
+{
+	func(n, t, g, data);
+	sann_Adam_update(n, h0, h, beta1, beta2, wd, step, 1.0f, 0.0f, t, g, m1, m2);
 }
-#endif
@@ -0,0 +1,273 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "sann.h"
+
+/*
+ * Counters are updated with atomic adds, such that helper threads can report
+ * to the same sann_prof_t. Trace events are kept in memory and written at
+ * the end in the Chrome trace-event format, which can be viewed with
+ * chrome://tracing or Perfetto.
+ */
+
+static const char *sann_prof_names[SANN_N_PH] = { "load", "shuffle", "gather", "forward", "backward", "update", "validation", "copy", "dump" };
+
+typedef struct {
+	int32_t phase, tid;
+	double ts, dur; // in seconds since sann_prof_init()
+} prof_event_t;
+
+typedef struct {
+	double t0;
+	int n, m;
+	prof_event_t *a;
+	pthread_mutex_t lock;
+} prof_trace_t;
+
+double sann_prof_time(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+const char *sann_prof_name(int phase)
+{
+	return phase >= 0 && phase < SANN_N_PH? sann_prof_names[phase] : "unknown";
+}
+
+sann_prof_t *sann_prof_init(int trace)
+{
+	sann_prof_t *p;
+	p = (sann_prof_t*)calloc(1, sizeof(sann_prof_t));
+	if (trace) {
+		prof_trace_t *t;
+		t = (prof_trace_t*)calloc(1, sizeof(prof_trace_t));
+		t->t0 = sann_prof_time();
+		pthread_mutex_init(&t->lock, 0);
+		p->trace = t;
+	}
+	return p;
+}
+
+void sann_prof_destroy(sann_prof_t *p)
+{
+	if (p == 0) return;
+	if (p->trace) {
+		prof_trace_t *t = (prof_trace_t*)p->trace;
+		pthread_mutex_destroy(&t->lock);
+		free(t->a); free(t);
+	}
+	sann_prof_hw_close(p);
+	free(p);
+}
+
+void sann_prof_add(sann_prof_t *p, int phase, int tid, double t0, double dur, int n)
+{
+	if (p == 0) return;
+	__sync_fetch_and_add(&p->ns[phase], (int64_t)(dur * 1e9 + .499));
+	__sync_fetch_and_add(&p->n[phase], n);
+	if (p->trace) {
+		prof_trace_t *t = (prof_trace_t*)p->trace;
+		prof_event_t *e;
+		pthread_mutex_lock(&t->lock);
+		if (t->n == t->m) {
+			t->m = t->m? t->m<<1 : 256;
+			t->a = (prof_event_t*)realloc(t->a, t->m * sizeof(prof_event_t));
+		}
+		e = &t->a[t->n++];
+		e->phase = phase, e->tid = tid, e->ts = t0 - t->t0, e->dur = dur;
+		pthread_mutex_unlock(&t->lock);
+	}
+}
+
+void sann_prof_print(const sann_prof_t *p, const sann_prof_t *prev)
+{
+	int i;
+	for (i = 0; i < SANN_N_PH; ++i) {
+		int64_t ns = p->ns[i] - (prev? prev->ns[i] : 0), n = p->n[i] - (prev? prev->n[i] : 0);
+		if (n > 0) fprintf(stderr, " %s:%.3f/%lld", sann_prof_names[i], ns * 1e-9, (long long)n);
+	}
+}
+
+int sann_prof_trace(const char *fn, const sann_prof_t *p)
+{
+	prof_trace_t *t = (prof_trace_t*)p->trace;
+	FILE *fp;
+	int i;
+	if (t == 0) return -1;
+	if ((fp = fopen(fn, "w")) == 0) return -1;
+	fputs("{\"traceEvents\":[\n", fp);
+	for (i = 0; i < t->n; ++i) {
+		const prof_event_t *e = &t->a[i];
+		fprintf(fp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+				sann_prof_names[e->phase], e->tid, e->ts * 1e6, e->dur * 1e6, i < t->n - 1? "," : "");
+	}
+	fputs("],\"displayTimeUnit\":\"ms\"}\n", fp);
+	return fclose(fp) == 0? 0 : -1;
+}
+
+/*********************
+ * Hardware counters *
+ *********************/
+
+/*
+ * Events are opened as one group on the calling thread, such that they are
+ * scheduled together and read with one system call. Kernel time is excluded,
+ * which also makes the counters available at perf_event_paranoid=2. Events
+ * the CPU or the hypervisor does not expose are dropped individually.
+ */
+
+typedef struct {
+	int n, fd[SANN_N_HW], avail;
+	int idx[SANN_N_HW]; // position of each event in the group read; -1 if unavailable
+} prof_hw_t;
+
+#ifdef __linux__
+static int prof_hw_open1(int k, int group_fd)
+{
+	struct perf_event_attr a;
+	memset(&a, 0, sizeof(a));
+	a.size = sizeof(a);
+	if (k == SANN_HW_CYCLES) a.type = PERF_TYPE_HARDWARE, a.config = PERF_COUNT_HW_CPU_CYCLES;
+	else if (k == SANN_HW_INSTR) a.type = PERF_TYPE_HARDWARE, a.config = PERF_COUNT_HW_INSTRUCTIONS;
+	else if (k == SANN_HW_LLC_MISS) a.type = PERF_TYPE_HARDWARE, a.config = PERF_COUNT_HW_CACHE_MISSES;
+	else a.type = PERF_TYPE_HW_CACHE, a.config = PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ<<8 | PERF_COUNT_HW_CACHE_RESULT_MISS<<16;
+	a.exclude_kernel = a.exclude_hv = 1;
+	a.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return syscall(__NR_perf_event_open, &a, 0, -1, group_fd, 0); // this thread, any CPU
+}
+#endif
+
+int sann_prof_hw_open(sann_prof_t *p)
+{
+	prof_hw_t *h;
+	int k;
+	if (p->hwc) return ((prof_hw_t*)p->hwc)->avail;
+	h = (prof_hw_t*)calloc(1, sizeof(prof_hw_t));
+	for (k = 0; k < SANN_N_HW; ++k) h->idx[k] = -1;
+#ifdef __linux__
+	for (k = 0; k < SANN_N_HW; ++k) {
+		int fd = prof_hw_open1(k, h->n? h->fd[0] : -1);
+		if (fd < 0) continue;
+		h->idx[k] = h->n, h->fd[h->n++] = fd;
+		h->avail |= 1<<k;
+	}
+#endif
+	if (h->n == 0) {
+		free(h);
+		return 0;
+	}
+	p->hwc = h;
+	return h->avail;
+}
+
+void sann_prof_hw_close(sann_prof_t *p)
+{
+#ifdef __linux__
+	prof_hw_t *h = (prof_hw_t*)p->hwc;
+	int i;
+	if (h == 0) return;
+	for (i = 0; i < h->n; ++i) close(h->fd[i]);
+	free(h);
+	p->hwc = 0;
+#endif
+}
+
+int sann_prof_hw_read(const sann_prof_t *p, int64_t v[SANN_N_HW])
+{
+#ifdef __linux__
+	prof_hw_t *h = (prof_hw_t*)p->hwc;
+	uint64_t buf[3 + SANN_N_HW];
+	double scale;
+	int k;
+	memset(v, 0, SANN_N_HW * sizeof(int64_t));
+	if (h == 0) return -1;
+	if (read(h->fd[0], buf, (3 + h->n) * sizeof(uint64_t)) < (ssize_t)((3 + h->n) * sizeof(uint64_t))) return -1;
+	scale = buf[2] > 0 && buf[2] < buf[1]? (double)buf[1] / buf[2] : 1.; // extrapolate if the PMU was shared with other users
+	for (k = 0; k < SANN_N_HW; ++k)
+		if (h->idx[k] >= 0) v[k] = (int64_t)(buf[3 + h->idx[k]] * scale + .499);
+	return 0;
+#else // counters are never opened
+	memset(v, 0, SANN_N_HW * sizeof(int64_t));
+	return -1;
+#endif
+}
+
+void sann_prof_hw_add(sann_prof_t *p, int phase, const int64_t v0[SANN_N_HW], const int64_t v1[SANN_N_HW])
+{
+	int k;
+	if (p == 0 || p->hwc == 0) return;
+	for (k = 0; k < SANN_N_HW; ++k)
+		__sync_fetch_and_add(&p->hw[phase][k], v1[k] - v0[k]);
+}
+
+void sann_prof_hw_print(const sann_prof_t *p, const sann_prof_t *prev)
+{
+	const prof_hw_t *h = (const prof_hw_t*)p->hwc;
+	int i, k;
+	int64_t n_samples;
+	if (h == 0) return;
+	n_samples = p->n[SANN_PH_FORWARD] - (prev? prev->n[SANN_PH_FORWARD] : 0);
+	for (i = 0; i < SANN_N_PH; ++i) {
+		int64_t d[SANN_N_HW];
+		for (k = 0; k < SANN_N_HW; ++k)
+			d[k] = p->hw[i][k] - (prev? prev->hw[i][k] : 0);
+		if (d[SANN_HW_CYCLES] <= 0 && d[SANN_HW_INSTR] <= 0) continue;
+		fprintf(stderr, " %s:", sann_prof_names[i]);
+		if (h->idx[SANN_HW_CYCLES] >= 0 && h->idx[SANN_HW_INSTR] >= 0 && d[SANN_HW_CYCLES] > 0)
+			fprintf(stderr, "IPC=%.2f", (double)d[SANN_HW_INSTR] / d[SANN_HW_CYCLES]);
+		else fputs("IPC=NA", stderr);
+		for (k = SANN_HW_LLC_MISS; k <= SANN_HW_DTLB_MISS; ++k) { // per sample processed in the same period
+			fprintf(stderr, ",%s/sample=", k == SANN_HW_LLC_MISS? "LLC" : "dTLB");
+			if (h->idx[k] >= 0 && n_samples > 0) fprintf(stderr, "%.2f", (double)d[k] / n_samples);
+			else fputs("NA", stderr);
+		}
+	}
+}
+
+/*********************
+ * Memory accounting *
+ *********************/
+
+static const char *sann_mem_names[SANN_N_MEM] = { "data", "param", "opt", "batch", "best" };
+static int64_t sann_mem_cur[SANN_N_MEM + 1], sann_mem_max[SANN_N_MEM + 1]; // the last element is the total
+
+static inline void mem_update_peak(int64_t *peak, int64_t x)
+{
+	int64_t p;
+	while ((p = *peak) < x && !__sync_bool_compare_and_swap(peak, p, x));
+}
+
+void sann_mem_add(int cat, int64_t size)
+{
+	int64_t c, t;
+	if (cat < 0 || cat >= SANN_N_MEM || size == 0) return;
+	c = __sync_add_and_fetch(&sann_mem_cur[cat], size);
+	t = __sync_add_and_fetch(&sann_mem_cur[SANN_N_MEM], size);
+	if (size > 0) {
+		mem_update_peak(&sann_mem_max[cat], c);
+		mem_update_peak(&sann_mem_max[SANN_N_MEM], t);
+	}
+}
+
+int64_t sann_mem_usage(int cat, int peak)
+{
+	if (cat < 0 || cat >= SANN_N_MEM) cat = SANN_N_MEM;
+	return peak? sann_mem_max[cat] : sann_mem_cur[cat];
+}
+
+void sann_mem_print(int peak)
+{
+	int i;
+	for (i = 0; i < SANN_N_MEM; ++i)
+		if (sann_mem_max[i] > 0)
+			fprintf(stderr, " %s:%.1f", sann_mem_names[i], sann_mem_usage(i, peak) / 1048576.);
+}
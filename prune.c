@@ -0,0 +1,250 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sann_priv.h"
+
+/*
+ * A pruned layer is kept twice: as dense weights in sann_t::t, where pruned
+ * weights are zero, and in the compressed sparse row (CSR) format, with one
+ * row per neuron. Training works on the dense weights and zeroes the gradient
+ * of pruned weights, such that they stay at zero with all optimizers.
+ * sann_csr_sync() copies the dense weights back to CSR after they change.
+ * Inference only reads the CSR layers.
+ */
+
+static inline float *csr_weights(const sann_t *m, int k) // dense weights of layer $k
+{
+	float *p = m->t;
+	int i;
+	for (i = 1; i < k; ++i)
+		p += m->n_neurons[i] * (m->n_neurons[i-1] + 1);
+	return p + m->n_neurons[k];
+}
+
+static inline int64_t csr_size(int n_rows, int nnz)
+{
+	return (int64_t)(n_rows + 1) * sizeof(int32_t) + (int64_t)nnz * (sizeof(int32_t) + sizeof(float)) + sizeof(sann_csr_t);
+}
+
+sann_csr_t *sann_csr_init(int n_rows, int n_cols, int nnz)
+{
+	sann_csr_t *a;
+	a = (sann_csr_t*)calloc(1, sizeof(sann_csr_t));
+	a->n_rows = n_rows, a->n_cols = n_cols, a->nnz = nnz;
+	a->row = (int32_t*)calloc(n_rows + 1, sizeof(int32_t));
+	a->col = (int32_t*)malloc(nnz * sizeof(int32_t));
+	a->val = (float*)malloc(nnz * sizeof(float));
+	sann_mem_add(SANN_MEM_PARAM, csr_size(n_rows, nnz));
+	return a;
+}
+
+static sann_csr_t *csr_from_dense(int n_rows, int n_cols, const float *w)
+{
+	sann_csr_t *a;
+	int i, j, nnz = 0;
+	for (i = 0; i < n_rows * n_cols; ++i)
+		if (w[i] != 0.0f) ++nnz;
+	a = sann_csr_init(n_rows, n_cols, nnz);
+	for (j = 0, nnz = 0; j < n_rows; ++j) {
+		const float *wj = w + (size_t)j * n_cols;
+		for (i = 0; i < n_cols; ++i)
+			if (wj[i] != 0.0f)
+				a->col[nnz] = i, a->val[nnz++] = wj[i];
+		a->row[j+1] = nnz;
+	}
+	return a;
+}
+
+void sann_csr_destroy(sann_csr_t *a)
+{
+	if (a == 0) return;
+	sann_mem_add(SANN_MEM_PARAM, -csr_size(a->n_rows, a->nnz));
+	free(a->row); free(a->col); free(a->val); free(a);
+}
+
+void sann_csr_free(sann_t *m)
+{
+	int k;
+	if (m->csr == 0) return;
+	for (k = 0; k < m->n_layers - 1; ++k)
+		sann_csr_destroy(m->csr[k]);
+	free(m->csr);
+	m->csr = 0;
+}
+
+void sann_csr_cpy(sann_t *d, const sann_t *m)
+{
+	int k;
+	sann_csr_free(d);
+	if (m->csr == 0) return;
+	d->csr = (sann_csr_t**)calloc(m->n_layers - 1, sizeof(sann_csr_t*));
+	for (k = 0; k < m->n_layers - 1; ++k) {
+		const sann_csr_t *a = m->csr[k];
+		sann_csr_t *b;
+		if (a == 0) continue;
+		b = d->csr[k] = sann_csr_init(a->n_rows, a->n_cols, a->nnz);
+		memcpy(b->row, a->row, (a->n_rows + 1) * sizeof(int32_t));
+		memcpy(b->col, a->col, a->nnz * sizeof(int32_t));
+		memcpy(b->val, a->val, a->nnz * sizeof(float));
+	}
+}
+
+void sann_csr_sync(sann_t *m)
+{
+	int i, j, k;
+	if (m->csr == 0) return;
+	for (k = 1; k < m->n_layers; ++k) {
+		sann_csr_t *a = m->csr[k-1];
+		const float *w;
+		if (a == 0) continue;
+		w = csr_weights(m, k);
+		for (j = 0; j < a->n_rows; ++j)
+			for (i = a->row[j]; i < a->row[j+1]; ++i)
+				a->val[i] = w[(size_t)j * a->n_cols + a->col[i]];
+	}
+}
+
+void sann_csr_mask(const sann_t *m, float *g)
+{
+	int i, j, k;
+	if (m->csr == 0) return;
+	for (k = 1; k < m->n_layers; ++k) {
+		const sann_csr_t *a = m->csr[k-1];
+		float *gk;
+		if (a == 0) continue;
+		gk = g + (csr_weights(m, k) - m->t);
+		for (j = 0; j < a->n_rows; ++j, gk += a->n_cols) { // zero the gaps between kept weights
+			int c = 0;
+			for (i = a->row[j]; i < a->row[j+1]; ++i) {
+				if (a->col[i] > c) memset(&gk[c], 0, (a->col[i] - c) * sizeof(float));
+				c = a->col[i] + 1;
+			}
+			if (a->n_cols > c) memset(&gk[c], 0, (a->n_cols - c) * sizeof(float));
+		}
+	}
+}
+
+/***********
+ * Pruning *
+ ***********/
+
+static float prune_ksmall(int n, float *a, int k) // k-th smallest of $a, which is reordered; Hoare's selection
+{
+	int lo = 0, hi = n - 1;
+	while (lo < hi) {
+		float pivot = a[lo + (hi - lo) / 2], t;
+		int i = lo, j = hi;
+		while (i <= j) {
+			while (a[i] < pivot) ++i;
+			while (a[j] > pivot) --j;
+			if (i <= j) t = a[i], a[i] = a[j], a[j] = t, ++i, --j;
+		}
+		if (k <= j) hi = j;
+		else if (k >= i) lo = i;
+		else break;
+	}
+	return a[k];
+}
+
+int sann_prune(sann_t *m, int k, float sparsity)
+{
+	int i, n, n_zero, n_cut = 0;
+	float *w, *a, thres;
+	if (!m->is_fnn || k < 1 || k >= m->n_layers || sparsity < 0.0f || sparsity >= 1.0f) return -1;
+	n = m->n_neurons[k] * m->n_neurons[k-1];
+	w = csr_weights(m, k);
+	n_zero = (int)(n * sparsity + .499);
+	if (n_zero > 0) {
+		a = (float*)malloc(n * sizeof(float));
+		for (i = 0; i < n; ++i) a[i] = fabsf(w[i]);
+		thres = prune_ksmall(n, a, n_zero - 1);
+		free(a);
+		for (i = 0; i < n; ++i) // weights at the threshold are cut in order until $n_zero is reached
+			if (fabsf(w[i]) < thres) w[i] = 0.0f, ++n_cut;
+		for (i = 0; i < n && n_cut < n_zero; ++i)
+			if (fabsf(w[i]) == thres && w[i] != 0.0f) w[i] = 0.0f, ++n_cut;
+	}
+	if (m->csr == 0) m->csr = (sann_csr_t**)calloc(m->n_layers - 1, sizeof(sann_csr_t*));
+	sann_csr_destroy(m->csr[k-1]);
+	m->csr[k-1] = csr_from_dense(m->n_neurons[k], m->n_neurons[k-1], w);
+	return m->csr[k-1]->nnz;
+}
+
+/********************
+ * Sparse inference *
+ ********************/
+
+const float *sfnn_sparse_infer(const sann_t *m, cfloat_p x, float *buf) // same as sfnn_core_infer() for all layers
+{
+	int i, j, k, max = sfnn_infer_buf_size(m->n_layers, m->n_neurons) / 2;
+	const float *t = m->t, *in = x;
+	float *out = buf;
+	for (k = 1; k < m->n_layers; ++k) {
+		const sann_csr_t *a = m->csr? m->csr[k-1] : 0;
+		int n_in = m->n_neurons[k-1], n_k = m->n_neurons[k];
+		const float *bk = t, *wk = t + n_k;
+		t += n_k * (n_in + 1);
+		if (a) { // sparse matrix-vector product
+			for (j = 0; j < a->n_rows; ++j) {
+				float s = 0.0f;
+				for (i = a->row[j]; i < a->row[j+1]; ++i)
+					s += a->val[i] * in[a->col[i]];
+				out[j] = s + bk[j];
+			}
+		} else {
+			for (j = 0; j < n_k; ++j)
+				out[j] = sann_sdot(n_in, wk + j * n_in, in) + bk[j];
+		}
+		sann_activate(m->af[k-1], n_k, out, out == buf? buf + max : buf);
+		in = out, out = out == buf? buf + max : buf;
+	}
+	return in;
+}
+
+int sfnn_sparse_buf_size(const sann_t *m, int n)
+{
+	int k, max = 0;
+	for (k = 0; k < m->n_layers; ++k)
+		if (m->n_neurons[k] > max) max = m->n_neurons[k];
+	return (2 * n + 1) * max;
+}
+
+/*
+ * Samples in a block are processed together, with the activations of a layer
+ * stored neuron by neuron, such that each weight is applied to all samples
+ * with one saxpy and column indices are decoded once per block.
+ */
+void sfnn_sparse_forward_block(const sann_t *m, int n, const float *const* x, float *buf, float **y, float **logp)
+{
+	int i, j, k, l = m->n_layers - 1, n_out = sann_n_out(m), max = sfnn_infer_buf_size(m->n_layers, m->n_neurons) / 2;
+	float *in = buf, *out = buf + max * n, *tmp = out + max * n;
+	const float *t = m->t;
+	for (i = 0; i < n; ++i) // transpose the input
+		for (j = 0; j < m->n_neurons[0]; ++j)
+			in[j * n + i] = x[i][j];
+	for (k = 1; k <= l; ++k) {
+		const sann_csr_t *a = m->csr? m->csr[k-1] : 0;
+		int n_in = m->n_neurons[k-1], n_k = m->n_neurons[k];
+		const float *bk = t, *wk = t + n_k;
+		float *p;
+		t += n_k * (n_in + 1);
+		for (j = 0; j < n_k; ++j) {
+			float *oj = out + j * n;
+			for (i = 0; i < n; ++i) oj[i] = bk[j];
+			if (a) {
+				for (i = a->row[j]; i < a->row[j+1]; ++i)
+					sann_saxpy(n, a->val[i], in + a->col[i] * n, oj);
+			} else {
+				for (i = 0; i < n_in; ++i)
+					sann_saxpy(n, wk[j * n_in + i], in + i * n, oj);
+			}
+		}
+		if (k < l) sann_activate(m->af[k-1], n_k * n, out, 0); // softmax is only at the output layer
+		p = in, in = out, out = p;
+	}
+	for (i = 0; i < n; ++i) {
+		for (j = 0; j < n_out; ++j)
+			y[i][j] = in[j * n + i];
+		sann_activate(m->af[l-1], n_out, y[i], logp? logp[i] : tmp);
+	}
+}
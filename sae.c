@@ -26,10 +26,53 @@ void sae_core_forward(int n_in, int n_hidden, const float *t, sann_activate_f f1
 		y[k] = f2(y[k], &tmp);
 }
 
-// buf[] is at least 3*n_in+2*n_hidden in length
-void sae_core_backprop(int n_in, int n_hidden, const float *t, sann_activate_f f1, sann_activate_f f2, float r, const float *x, float *d, float *buf, int scaled)
+// hidden layer only; same as z[] from sae_core_forward() without dropout, but derivatives are not computed
+void sae_core_encode(int n_in, int n_hidden, const float *t, int af, const float *x, float *z, int scaled)
 {
-	int i, j, k;
+	int j;
+	float a01 = 1.;
+	const float *b1, *b2, *w10;
+	if (scaled == SAE_SC_SQRT) a01 = 1. / sqrt(n_in);
+	else if (scaled == SAE_SC_FULL) a01 = 1. / n_in;
+	sae_par2ptr(n_in, n_hidden, t, &b1, &b2, &w10);
+	for (j = 0; j < n_hidden; ++j)
+		z[j] = a01 * sann_sdot(n_in, x, w10 + j * n_in) + b1[j];
+	sann_activate(af, n_hidden, z, 0);
+}
+
+// output layer only, from z[] computed by sae_core_encode(); same as y[] from sae_core_forward() without dropout
+void sae_core_decode(int n_in, int n_hidden, const float *t, const float *z, float *y, int scaled)
+{
+	int j;
+	float a12 = 1.;
+	const float *b1, *b2, *w10;
+	if (scaled == SAE_SC_SQRT) a12 = 1. / sqrt(n_hidden);
+	else if (scaled == SAE_SC_FULL) a12 = 1. / n_hidden;
+	sae_par2ptr(n_in, n_hidden, t, &b1, &b2, &w10);
+	memcpy(y, b2, n_in * sizeof(float));
+	for (j = 0; j < n_hidden; ++j)
+		sann_saxpy(n_in, a12 * z[j], w10 + j * n_in, y);
+	sann_activate(SANN_AF_SIGM, n_in, y, 0);
+}
+
+// forward pass with input noise for sae_core_backward(); buf[] is at least 3*n_in+2*n_hidden in length
+void sae_core_train_forward(int n_in, int n_hidden, const float *t, sann_activate_f f1, sann_activate_f f2, float r, const float *x, float *buf, int scaled)
+{
+	int i;
+	float *out0, *out1, *out2, *delta1;
+	out0 = buf, out1 = out0 + n_in, out2 = out1 + n_hidden;
+	delta1 = out2 + n_in;
+	// add noises to the input
+	if (r > 0. && r < 1.) {
+		for (i = 0; i < n_in; ++i)
+			out0[i] = sann_drand() < r? 0. : x[i];
+	} else memcpy(out0, x, n_in * sizeof(float));
+	sae_core_forward(n_in, n_hidden, t, f1, f2, r, out0, out1, out2, delta1, scaled); // delta1 keeps the derivatives for now
+}
+
+void sae_core_backward(int n_in, int n_hidden, const float *t, float r, const float *x, float *d, float *buf, int scaled)
+{
+	int j, k;
 	float *db1, *db2, *dw10, *out0, *out1, *out2, *delta1, *delta2, a01 = 1., a12 = 1.;
 	const float *b1, *b2, *w10;
 	if (scaled == SAE_SC_SQRT) a01 = 1. / sqrt(n_in), a12 = 1. / sqrt(n_hidden);
@@ -40,14 +83,6 @@ void sae_core_backprop(int n_in, int n_hidden, const float *t, sann_activate_f f
 	delta1 = out2 + n_in, delta2 = delta1 + n_hidden;
 	sae_par2ptr(n_in, n_hidden, t, &b1, &b2, &w10);
 	sae_par2ptr(n_in, n_hidden, d, &db1, &db2, &dw10);
-	// add noises to the input
-	if (r > 0. && r < 1.) {
-		for (i = 0; i < n_in; ++i)
-			out0[i] = sann_drand() < r? 0. : x[i];
-	} else memcpy(out0, x, n_in * sizeof(float));
-	// forward calculation
-	sae_core_forward(n_in, n_hidden, t, f1, f2, r, out0, out1, out2, delta1, scaled);
-	// backward calculation
 	for (k = 0; k < n_in; ++k) // delta at the output layer
 		delta2[k] = out2[k] - x[k]; // use x, not out0
 	for (j = 0; j < n_hidden; ++j) { // delta at the hidden layer
@@ -64,6 +99,13 @@ void sae_core_backprop(int n_in, int n_hidden, const float *t, sann_activate_f f
 	}
 }
 
+// buf[] is at least 3*n_in+2*n_hidden in length
+void sae_core_backprop(int n_in, int n_hidden, const float *t, sann_activate_f f1, sann_activate_f f2, float r, const float *x, float *d, float *buf, int scaled)
+{
+	sae_core_train_forward(n_in, n_hidden, t, f1, f2, r, x, buf, scaled);
+	sae_core_backward(n_in, n_hidden, t, r, x, d, buf, scaled);
+}
+
 void sae_core_randpar(int n_in, int n_hidden, float *t, int scaled)
 {
 	float *b1, *b2, *w10;
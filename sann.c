@@ -4,10 +4,98 @@
 #include <float.h>
 #include <stdio.h>
 #include <math.h>
+#include <pthread.h>
 #include "sann_priv.h"
+#include "kthread.h"
 
 int sann_verbose = 3;
 
+/***************
+ * Thread pool *
+ ***************/
+
+/*
+ * Loops and tasks hold a reference to the pool while they run. Resizing the
+ * pool waits until no reference is held, such that a pool is never destroyed
+ * under a running loop.
+ */
+
+static void *sann_pool = 0;
+static int sann_pool_ref = 0;
+static pthread_mutex_t sann_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sann_pool_cv = PTHREAD_COND_INITIALIZER;
+
+static void *sann_pool_get(void)
+{
+	void *p;
+	pthread_mutex_lock(&sann_pool_lock);
+	if ((p = sann_pool) != 0) ++sann_pool_ref;
+	pthread_mutex_unlock(&sann_pool_lock);
+	return p;
+}
+
+static void sann_pool_put(void)
+{
+	pthread_mutex_lock(&sann_pool_lock);
+	if (--sann_pool_ref == 0) pthread_cond_broadcast(&sann_pool_cv);
+	pthread_mutex_unlock(&sann_pool_lock);
+}
+
+void sann_set_threads(int n_threads, int pin)
+{
+	pthread_mutex_lock(&sann_pool_lock);
+	while (sann_pool_ref > 0) pthread_cond_wait(&sann_pool_cv, &sann_pool_lock);
+	kt_forpool_destroy(sann_pool);
+	sann_pool = n_threads > 1? kt_forpool_init(n_threads, pin) : 0;
+	pthread_mutex_unlock(&sann_pool_lock);
+}
+
+int sann_get_threads(void)
+{
+	int n;
+	pthread_mutex_lock(&sann_pool_lock);
+	n = kt_forpool_size(sann_pool);
+	pthread_mutex_unlock(&sann_pool_lock);
+	return n;
+}
+
+void sann_pool_reserve(int n_threads) // create the pool on first use; its size is not changed afterwards
+{
+	if (n_threads > 1) {
+		pthread_mutex_lock(&sann_pool_lock);
+		if (sann_pool == 0) sann_pool = kt_forpool_init(n_threads, 0);
+		pthread_mutex_unlock(&sann_pool_lock);
+	}
+}
+
+void sann_for(int n_threads, void (*func)(void*,long,int), void *data, long n)
+{
+	void *p;
+	if (n_threads <= 1 || n <= 1) {
+		kt_forpool(0, 1, func, data, n);
+		return;
+	}
+	sann_pool_reserve(n_threads);
+	p = sann_pool_get();
+	kt_forpool(p, n_threads, func, data, n);
+	if (p) sann_pool_put();
+}
+
+void *sann_spawn(void (*func)(void*), void *data)
+{
+	void *p, *task;
+	if ((p = sann_pool_get()) == 0) return 0;
+	if ((task = kt_forpool_spawn(p, func, data)) == 0) sann_pool_put();
+	return task;
+}
+
+void sann_join(void *task)
+{
+	if (task == 0) return;
+	kt_forpool_join(task);
+	sann_pool_put();
+}
+
 sann_t *sann_init_ae(int n_in, int n_hidden, int scaled)
 {
 	sann_t *m;
@@ -22,6 +110,7 @@ sann_t *sann_init_ae(int n_in, int n_hidden, int scaled)
 	m->af = (int32_t*)calloc(2, 4);
 	m->af[0] = m->af[1] = SANN_AF_SIGM;
 	m->t = (float*)calloc(sae_n_par(n_in, n_hidden), sizeof(float));
+	sann_mem_add(SANN_MEM_PARAM, (int64_t)sae_n_par(n_in, n_hidden) * sizeof(float));
 	sae_core_randpar(n_in, n_hidden, m->t, scaled);
 	return m;
 }
@@ -39,6 +128,7 @@ sann_t *sann_init_fnn(int n_layers, const int *n_neurons)
 	for (i = 0; i < n_layers - 2; ++i) m->af[i] = SANN_AF_ReLU;
 	m->af[i] = SANN_AF_SIGM;
 	m->t = (float*)calloc(sfnn_n_par(m->n_layers, m->n_neurons), sizeof(float));
+	sann_mem_add(SANN_MEM_PARAM, (int64_t)sann_n_par(m) * sizeof(float));
 	sfnn_core_randpar(m->n_layers, m->n_neurons, m->t);
 	return m;
 }
@@ -50,6 +140,7 @@ int sann_n_par(const sann_t *m)
 
 void sann_cpy(sann_t *d, const sann_t *m)
 {
+	sann_mem_add(SANN_MEM_PARAM, ((int64_t)sann_n_par(m) - (d->t? sann_n_par(d) : 0)) * sizeof(float));
 	d->is_fnn = m->is_fnn, d->scaled = m->scaled, d->n_layers = m->n_layers;
 	d->n_neurons = (int32_t*)realloc(d->n_neurons, m->n_layers * 4);
 	memcpy(d->n_neurons, m->n_neurons, m->n_layers * 4);
@@ -57,6 +148,7 @@ void sann_cpy(sann_t *d, const sann_t *m)
 	memcpy(d->af, m->af, (m->n_layers - 1) * 4);
 	d->t = (float*)realloc(d->t, sann_n_par(m) * sizeof(float));
 	memcpy(d->t, m->t, sann_n_par(m) * sizeof(float));
+	sann_csr_cpy(d, m);
 }
 
 sann_t *sann_dup(const sann_t *m)
@@ -70,24 +162,27 @@ sann_t *sann_dup(const sann_t *m)
 void sann_destroy(sann_t *m)
 {
 	if (m == 0) return;
+	if (m->t) sann_mem_add(SANN_MEM_PARAM, -(int64_t)sann_n_par(m) * sizeof(float));
+	sann_csr_free(m);
 	free(m->n_neurons); free(m->af); free(m->t); free(m);
 }
 
 void sann_apply(const sann_t *m, const float *x, float *y, float *_z)
 {
 	if (m->is_fnn) {
-		sfnn_buf_t *b;
-		b = sfnn_buf_init(m->n_layers, m->n_neurons, m->t);
-		sfnn_core_forward(m->n_layers, m->n_neurons, m->af, 0.0f, 0.0f, m->t, x, b);
-		memcpy(y, b->out[m->n_layers-1], m->n_neurons[m->n_layers-1] * sizeof(float));
-		sfnn_buf_destroy(b);
-	} else {
-		float *deriv1, *z;
-		deriv1 = (float*)calloc(m->n_neurons[1], sizeof(float));
-		z = _z? _z : (float*)calloc(sae_n_hidden(m), sizeof(float));
-		sae_core_forward(sae_n_in(m), sae_n_hidden(m), m->t, sann_get_af(m->af[0]), sann_sigm, 0.0f, x, z, y, deriv1, m->scaled);
+		float *buf;
+		const float *out;
+		buf = (float*)malloc(sfnn_infer_buf_size(m->n_layers, m->n_neurons) * sizeof(float));
+		if (m->csr) out = sfnn_sparse_infer(m, x, buf);
+		else out = sfnn_core_infer(m->n_layers, m->n_neurons, m->af, m->t, x, m->n_layers - 1, buf, 0);
+		memcpy(y, out, sann_n_out(m) * sizeof(float));
+		free(buf);
+	} else { // the decoder is skipped if $y is NULL
+		float *z;
+		z = _z? _z : (float*)malloc(sae_n_hidden(m) * sizeof(float));
+		sae_core_encode(sae_n_in(m), sae_n_hidden(m), m->t, m->af[0], x, z, m->scaled);
+		if (y) sae_core_decode(sae_n_in(m), sae_n_hidden(m), m->t, z, y, m->scaled);
 		if (_z == 0) free(z);
-		free(deriv1);
 	}
 }
 
@@ -101,6 +196,71 @@ float sann_cost(int n, const float *y0, const float *y)
 	return (float)cost / n;
 }
 
+/***********************
+ * Minibatch gathering *
+ ***********************/
+
+#define SANN_ALIGN 64
+
+typedef struct {
+	int n, mini_batch, n_batches;
+	const sann_data_t *dx, *dy;
+	void **sx, **sy;   // shuffled rows
+	int ldx, ldy;      // row strides in the packed blocks, multiples of SANN_ALIGN bytes
+	float *bx[2], *by[2];
+	int filled[2];
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	sann_prof_t *prof;
+} mb_gather_t;
+
+static inline int mb_stride(int n_col)
+{
+	const int a = SANN_ALIGN / sizeof(float);
+	return (n_col + a - 1) / a * a;
+}
+
+static void mb_fill(const sann_data_t *d, int n, void *const* rows, int ld, float *blk)
+{
+	int i, l, row_size;
+	row_size = d->n_col * (d->type == SANN_DT_F32? 4 : d->type == SANN_DT_F16? 2 : 1);
+	for (i = 0; i < n; ++i) {
+		const float *r;
+		float *q = blk + (size_t)i * ld;
+		if (i + 2 < n) // prefetch two rows ahead; the hardware prefetcher picks up the rest of a row
+			for (l = 0; l < row_size && l < 4 * SANN_ALIGN; l += SANN_ALIGN)
+				__builtin_prefetch((const uint8_t*)rows[i+2] + l, 0, 0);
+		r = sann_data_decode(d, rows[i], q);
+		if (r != q) memcpy(q, r, d->n_col * sizeof(float));
+	}
+}
+
+static void mb_gather(mb_gather_t *g, int k, int slot, int tid) // gather the k-th minibatch
+{
+	int st = k * g->mini_batch, n = st + g->mini_batch < g->n? g->mini_batch : g->n - st;
+	double t0 = g->prof? sann_prof_time() : 0.;
+	mb_fill(g->dx, n, &g->sx[st], g->ldx, g->bx[slot]);
+	if (g->dy) mb_fill(g->dy, n, &g->sy[st], g->ldy, g->by[slot]);
+	if (g->prof) sann_prof_add(g->prof, SANN_PH_GATHER, tid, t0, sann_prof_time() - t0, 1);
+}
+
+static void mb_gather_worker(void *data) // a task on the thread pool
+{
+	mb_gather_t *g = (mb_gather_t*)data;
+	int k;
+	for (k = 0; k < g->n_batches; ++k) {
+		int slot = k & 1;
+		pthread_mutex_lock(&g->lock);
+		while (g->filled[slot]) pthread_cond_wait(&g->cv, &g->lock);
+		pthread_mutex_unlock(&g->lock);
+		mb_gather(g, k, slot, 1);
+		pthread_mutex_lock(&g->lock);
+		g->filled[slot] = 1;
+		pthread_cond_broadcast(&g->cv);
+		pthread_mutex_unlock(&g->lock);
+	}
+}
+
 /************
  * Training *
  ************/
@@ -119,6 +279,9 @@ void sann_tconf_init(sann_tconf_t *tc, int malgo, int balgo)
 	tc->h_min = 0.0f, tc->h_max = .1f;
 	tc->rprop_dec = .5f, tc->rprop_inc = 1.2f;
 	tc->max_inc = 10;
+	tc->n_threads = 1;
+	tc->ckpt_intv = 1;
+	tc->sync_intv = 10;
 
 	if (tc->malgo == SANN_MIN_MINI_SGD) {
 		tc->mini_batch = 10;
@@ -127,6 +290,11 @@ void sann_tconf_init(sann_tconf_t *tc, int malgo, int balgo)
 		tc->mini_batch = 50;
 		tc->h = .001f;
 		tc->decay = .9f;
+	} else if (tc->malgo == SANN_MIN_MINI_ADAM) {
+		tc->mini_batch = 50;
+		tc->h = .001f;
+		tc->beta1 = .9f, tc->beta2 = .999f;
+		tc->L2_par = 0.0f, tc->wd = .01f; // decoupled weight decay in place of L2
 	}
 }
 
@@ -135,165 +303,1044 @@ typedef struct {
 	const sann_tconf_t *tc;
 	double running_cost;
 	int n;
-	cfloat_p *x, *y;
+	const float *x, *y; // packed minibatch
+	int ldx, ldy;
 	float *buf_ae;
 	sfnn_buf_t *buf_fnn;
+	sann_prof_t *prof;
 } minibatch_t;
 
-static void mb_gradient(int n, const float *p, float *g, void *data)
+static void mb_gradient(int n, const float *p, float *g, void *data) // add the gradient of the minibatch to $g
 {
 	minibatch_t *mb = (minibatch_t*)data;
 	sann_t *m = mb->m;
 	const sann_tconf_t *tc = mb->tc;
-	int i, k;
-	float t = 1. / mb->n;
-	memset(g, 0, n * sizeof(float));
+	int i, k, hw = mb->prof && mb->prof->hwc;
+	double t0 = 0., t1, t_fwd = 0., t_bwd = 0.;
+	int64_t h[3][SANN_N_HW], h_fwd[SANN_N_HW], h_bwd[SANN_N_HW], h_zero[SANN_N_HW];
+	if (hw) {
+		memset(h_fwd, 0, sizeof(h_fwd)); memset(h_bwd, 0, sizeof(h_bwd)); memset(h_zero, 0, sizeof(h_zero));
+	}
+	if (mb->prof) t0 = sann_prof_time();
 	for (i = 0; i < mb->n; ++i) {
+		const float *x = mb->x + (size_t)i * mb->ldx;
+		if (mb->prof) { // time forward and backward passes separately
+			double t;
+			if (hw) sann_prof_hw_read(mb->prof, h[0]);
+			t = sann_prof_time();
+			if (!m->is_fnn) sae_core_train_forward(sae_n_in(m), sae_n_hidden(m), p, sann_get_af(m->af[0]), sann_sigm, tc->r_in, x, mb->buf_ae, m->scaled);
+			else sfnn_core_forward(m->n_layers, m->n_neurons, m->af, tc->r_in, tc->r_hidden, p, x, mb->buf_fnn);
+			t1 = sann_prof_time(), t_fwd += t1 - t;
+			if (hw) sann_prof_hw_read(mb->prof, h[1]);
+			if (!m->is_fnn) sae_core_backward(sae_n_in(m), sae_n_hidden(m), p, tc->r_in, x, g, mb->buf_ae, m->scaled);
+			else sfnn_core_backward(m->n_layers, m->n_neurons, tc->r_in, tc->r_hidden, mb->y + (size_t)i * mb->ldy, g, mb->buf_fnn);
+			t_bwd += sann_prof_time() - t1;
+			if (hw) {
+				sann_prof_hw_read(mb->prof, h[2]);
+				for (k = 0; k < SANN_N_HW; ++k)
+					h_fwd[k] += h[1][k] - h[0][k], h_bwd[k] += h[2][k] - h[1][k];
+			}
+		} else if (!m->is_fnn) {
+			sae_core_backprop(m->n_neurons[0], m->n_neurons[1], p, sann_get_af(m->af[0]), sann_sigm, tc->r_in, x, g, mb->buf_ae, m->scaled);
+		} else {
+			sfnn_core_backprop(m->n_layers, m->n_neurons, m->af, tc->r_in, tc->r_hidden, p, x, mb->y + (size_t)i * mb->ldy, g, mb->buf_fnn);
+		}
 		if (!m->is_fnn) {
-			sae_core_backprop(m->n_neurons[0], m->n_neurons[1], p, sann_get_af(m->af[0]), sann_sigm, tc->r_in, mb->x[i], g, mb->buf_ae, m->scaled);
 			for (k = 0; k < m->n_neurons[0]; ++k)
-				mb->running_cost += sann_sigm_cost(mb->x[i][k], mb->buf_ae[sae_n_in(m) + sae_n_hidden(m) + k]);
+				mb->running_cost += sann_sigm_cost(x[k], mb->buf_ae[sae_n_in(m) + sae_n_hidden(m) + k]);
 		} else {
-			sfnn_core_backprop(m->n_layers, m->n_neurons, m->af, tc->r_in, tc->r_hidden, p, mb->x[i], mb->y[i], g, mb->buf_fnn);
-			for (k = 0; k < m->n_neurons[m->n_layers-1]; ++k)
-				mb->running_cost += sann_sigm_cost(mb->y[i][k], mb->buf_fnn->out[m->n_layers-1][k]);
+			const float *y = mb->y + (size_t)i * mb->ldy;
+			if (m->af[m->n_layers-2] == SANN_AF_SOFTMAX)
+				mb->running_cost += sann_softmax_cost(m->n_neurons[m->n_layers-1], y, mb->buf_fnn->deriv[m->n_layers-1]);
+			else for (k = 0; k < m->n_neurons[m->n_layers-1]; ++k)
+				mb->running_cost += sann_sigm_cost(y[k], mb->buf_fnn->out[m->n_layers-1][k]);
+		}
+	}
+	if (mb->prof) { // passes are interleaved per sample; the trace shows them as two consecutive intervals
+		sann_prof_add(mb->prof, SANN_PH_FORWARD, 0, t0, t_fwd, mb->n);
+		sann_prof_add(mb->prof, SANN_PH_BACKWARD, 0, t0 + t_fwd, t_bwd, mb->n);
+		if (hw) {
+			sann_prof_hw_add(mb->prof, SANN_PH_FORWARD, h_zero, h_fwd);
+			sann_prof_hw_add(mb->prof, SANN_PH_BACKWARD, h_zero, h_bwd);
 		}
 	}
-	if (m->is_fnn) {
-		for (i = 0; i < n; ++i)
-			g[i] = (g[i] + mb->tc->L2_par * p[i]) * t;
-	} else for (i = 0; i < n; ++i) g[i] *= t;
 }
 
-float sann_train_epoch(sann_t *m, const sann_tconf_t *tc, const float *h, int n, float *const* x, float *const* y, float **_buf)
+/*
+ * Parameter updates are bandwidth bound. For large models, they are split
+ * into ranges of SANN_PAR_CHUNK parameters and run on multiple threads.
+ */
+
+#define SANN_PAR_CHUNK 0x10000
+#define SANN_PAR_MIN   0x100000
+
+typedef struct {
+	const sann_tconf_t *tc;
+	int n, first;
+	int64_t step;
+	float a, l2;
+	float *t, *g, *r, *h;
+	float *t_prev, *g_prev;
+} par_update_t;
+
+static void update_worker(void *data, long j, int tid)
 {
+	par_update_t *u = (par_update_t*)data;
+	const sann_tconf_t *tc = u->tc;
+	int st = j * SANN_PAR_CHUNK, n = st + SANN_PAR_CHUNK < u->n? SANN_PAR_CHUNK : u->n - st;
+	const float *h = u->h? u->h + st : 0;
+	if (tc->malgo == SANN_MIN_MINI_SGD) {
+		sann_SGD_update(n, tc->h, u->a, u->l2, u->t + st, u->g + st);
+	} else if (tc->malgo == SANN_MIN_MINI_RMSPROP) {
+		sann_RMSprop_update(n, tc->h, h, tc->decay, u->a, u->l2, u->t + st, u->g + st, u->r + st);
+	} else if (tc->malgo == SANN_MIN_MINI_ADAM) {
+		sann_Adam_update(n, tc->h, h, tc->beta1, tc->beta2, tc->wd, u->step, u->a, u->l2, u->t + st, u->g + st, u->r + st, u->r + u->n + st);
+	}
+}
+
+static void irprop_worker(void *data, long j, int tid)
+{
+	par_update_t *u = (par_update_t*)data;
+	const sann_tconf_t *tc = u->tc;
+	int st = j * SANN_PAR_CHUNK, n = st + SANN_PAR_CHUNK < u->n? SANN_PAR_CHUNK : u->n - st;
+	sann_iRprop(n, u->first, tc->rprop_inc, tc->rprop_dec, tc->h_min, tc->h_max, u->t + st, u->t_prev + st, u->g_prev + st, u->h + st);
+}
+
+static void sann_par_update(par_update_t *u, void (*func)(void*,long,int))
+{
+	int n_chunks = (u->n + SANN_PAR_CHUNK - 1) / SANN_PAR_CHUNK;
+	sann_for(u->tc->n_threads > 1 && u->n >= SANN_PAR_MIN? u->tc->n_threads : 1, func, u, n_chunks);
+}
+
+/***********
+ * Trainer *
+ ***********/
+
+/*
+ * A trainer keeps all working space of minibatch training in one arena,
+ * allocated once: the gradient, the optimizer states, the iRprop- arrays,
+ * the shuffled row pointers and two packed minibatches. Epochs only create
+ * the minibatch helper thread when more than one thread is used.
+ *
+ * With SANN_MIN_BATCH_LBFGS, the arena also holds the L-BFGS history and one
+ * gradient and packed minibatch per thread. The training samples are split
+ * into one contiguous part per thread and the part gradients are summed in a
+ * fixed order, such that the result does not depend on thread scheduling.
+ */
+
+#define SANN_LBFGS_LS 20   // max number of backtracking steps in a line search
+#define SANN_LBFGS_C1 1e-4 // sufficient decrease in the Armijo condition
+
+typedef struct {
 	minibatch_t mb;
-	float *buf, *g, *r;
-	cfloat_p *sx = 0, *sy = 0;
-	int mn = 0, n_par, n_out, buf_size;
+	float *g, *bx, *by;
+} lbfgs_part_t;
 
-	sx = (cfloat_p*)malloc(n * sizeof(cfloat_p));
-	memcpy(sx, x, n * sizeof(cfloat_p));
-	if (m->is_fnn) {
-		sy = (cfloat_p*)malloc(n * sizeof(cfloat_p));
-		memcpy(sy, y, n * sizeof(cfloat_p));
+struct sann_trainer_s {
+	sann_t *m;
+	sann_tconf_t tc;
+	int max_n, n_par, n_adjust;
+	int64_t n_steps;
+	int64_t mem_opt, mem_batch; // bytes accounted as SANN_MEM_OPT and SANN_MEM_BATCH
+	void *arena;
+	float *g, *r;               // gradient; RMSprop accumulator, or the two Adam moments
+	float *t_prev, *g_prev, *h; // iRprop-; h is NULL with SANN_MIN_BATCH_FIXED
+	mb_gather_t ga;
+	minibatch_t mb;
+	par_update_t u;
+	// L-BFGS: t_prev and g_prev are the parameters and the gradient at the start of an iteration
+	int n_parts, n_pairs, head, ready, converged; // $converged: no descent along the gradient; later epochs are no-ops
+	lbfgs_part_t *part;
+	float *d, *ds, *dg;         // search direction; parameter and gradient changes of the last SANN_LBFGS_M iterations
+	double rho[SANN_LBFGS_M], gamma, f, rc; // 1/(ds*dg) of each pair; initial Hessian scale; objective and cost at m->t
+};
+
+static inline size_t tr_align(size_t size) { return (size + SANN_ALIGN - 1) / SANN_ALIGN * SANN_ALIGN; }
+
+static inline int tr_n_parts(const sann_tconf_t *tc) { return tc->balgo == SANN_MIN_BATCH_LBFGS && tc->n_threads > 1? tc->n_threads : 1; }
+
+static size_t tr_n_batch(const sann_tconf_t *tc, size_t n_par) // number of floats of the batch algorithm
+{
+	if (tc->balgo == SANN_MIN_BATCH_LBFGS) // t_prev, g_prev, d, ds, dg and the gradients of threads other than the first
+		return (3 + 2 * SANN_LBFGS_M + tr_n_parts(tc) - 1) * n_par;
+	return (tc->balgo == SANN_MIN_BATCH_RPROP? 3 : 2) * n_par;
+}
+
+sann_trainer_t *sann_trainer_init(sann_t *m, const sann_tconf_t *tc, int max_n)
+{
+	sann_trainer_t *tr;
+	size_t n_par, n_opt, n_batch, s_mb, s_x, s_y, s_ptr, s_ae;
+	uint8_t *p;
+	int i;
+
+	tr = (sann_trainer_t*)calloc(1, sizeof(sann_trainer_t));
+	tr->m = m, tr->tc = *tc, tr->max_n = max_n;
+	tr->n_par = sann_n_par(m);
+	n_par = tr->n_par;
+	n_opt = (tc->malgo == SANN_MIN_MINI_ADAM? 3 : 2) * n_par;
+	n_batch = tr_n_batch(tc, n_par);
+	tr->ga.mini_batch = tc->mini_batch;
+	tr->ga.ldx = mb_stride(sann_n_in(m)), tr->ga.ldy = mb_stride(sann_n_out(m));
+	s_x = tr_align((size_t)tc->mini_batch * tr->ga.ldx * sizeof(float));
+	s_y = m->is_fnn? tr_align((size_t)tc->mini_batch * tr->ga.ldy * sizeof(float)) : 0;
+	s_ptr = tr_align((size_t)max_n * sizeof(void*));
+	s_ae = !m->is_fnn? tr_align(sae_buf_size(sae_n_in(m), sae_n_hidden(m)) * sizeof(float)) : 0;
+	s_mb = 2 * (s_x + s_y) + (m->is_fnn? 2 : 1) * s_ptr + s_ae;
+	if (tc->balgo == SANN_MIN_BATCH_LBFGS) s_mb += tr_n_parts(tc) * (s_x + s_y + s_ae);
+	if (posix_memalign(&tr->arena, SANN_ALIGN, tr_align((n_opt + n_batch) * sizeof(float)) + s_mb) != 0) {
+		free(tr);
+		return 0;
+	}
+	memset(tr->arena, 0, (n_opt + n_batch) * sizeof(float));
+	tr->g = (float*)tr->arena, tr->r = tr->g + n_par;
+	tr->t_prev = tr->g + n_opt, tr->g_prev = tr->t_prev + n_par;
+	if (tc->balgo == SANN_MIN_BATCH_RPROP) {
+		tr->h = tr->g_prev + n_par;
+		for (i = 0; i < n_par; ++i) tr->h[i] = tc->h;
 	}
-	sann_data_shuffle(n, (float**)sx, (float**)sy, 0);
+	p = (uint8_t*)tr->arena + tr_align((n_opt + n_batch) * sizeof(float));
+	for (i = 0; i < 2; ++i) {
+		tr->ga.bx[i] = (float*)p, p += s_x;
+		if (m->is_fnn) tr->ga.by[i] = (float*)p, p += s_y;
+	}
+	tr->ga.sx = (void**)p, p += s_ptr;
+	if (m->is_fnn) tr->ga.sy = (void**)p, p += s_ptr;
+	tr->ga.prof = tc->prof;
+	tr->mem_opt = n_opt * sizeof(float), tr->mem_batch = n_batch * sizeof(float);
+	sann_mem_add(SANN_MEM_OPT, tr->mem_opt);
+	sann_mem_add(SANN_MEM_BATCH, tr->mem_batch);
 
-	n_out = sann_n_out(m);
-	n_par = sann_n_par(m);
-	buf_size = 2 * n_par;
-
-	buf = _buf? *_buf : 0;
-	if (buf == 0) buf = (float*)calloc(buf_size, sizeof(float));
-	if (_buf) *_buf = buf;
-	g = buf, r = g + n_par;
-
-	mb.m = m, mb.tc = tc, mb.running_cost = 0.;
-	mb.buf_fnn = m->is_fnn? sfnn_buf_init(m->n_layers, m->n_neurons, m->t) : 0;
-	mb.buf_ae = !m->is_fnn? (float*)malloc(sae_buf_size(sae_n_in(m), sae_n_hidden(m)) * sizeof(float)) : 0;
-	while (mn < n) {
-		mb.n = tc->mini_batch < n - mn? tc->mini_batch : n - mn;
-		mb.x = &sx[mn];
-		mb.y = sy? &sy[mn] : 0;
-		if (tc->malgo == SANN_MIN_MINI_SGD) {
-			sann_SGD(n_par, tc->h, m->t, g, mb_gradient, &mb);
-		} else if (tc->malgo == SANN_MIN_MINI_RMSPROP) {
-			sann_RMSprop(n_par, tc->h, h, tc->decay, m->t, g, r, mb_gradient, &mb);
+	tr->mb.m = m, tr->mb.tc = &tr->tc, tr->mb.prof = tc->prof;
+	tr->mb.ldx = tr->ga.ldx, tr->mb.ldy = tr->ga.ldy;
+	tr->mb.buf_fnn = m->is_fnn? sfnn_buf_init(m->n_layers, m->n_neurons, m->t) : 0;
+	if (!m->is_fnn) tr->mb.buf_ae = (float*)p, p += s_ae;
+	if (tc->balgo == SANN_MIN_BATCH_LBFGS) {
+		if (tc->r_in > 0.0f || tc->r_hidden > 0.0f) { // the line search needs a deterministic objective
+			if (sann_verbose >= 2) fprintf(stderr, "[W::%s] dropout is disabled with L-BFGS\n", __func__);
+			tr->tc.r_in = tr->tc.r_hidden = 0.0f;
+		}
+		tr->d = tr->g_prev + n_par, tr->ds = tr->d + n_par, tr->dg = tr->ds + SANN_LBFGS_M * n_par;
+		tr->n_parts = tr_n_parts(tc);
+		tr->part = (lbfgs_part_t*)calloc(tr->n_parts, sizeof(lbfgs_part_t));
+		for (i = 0; i < tr->n_parts; ++i) {
+			lbfgs_part_t *q = &tr->part[i];
+			q->mb = tr->mb, q->mb.prof = 0; // the whole pass is timed instead
+			q->g = i == 0? tr->g : tr->dg + (size_t)(SANN_LBFGS_M + i - 1) * n_par;
+			q->bx = (float*)p, p += s_x;
+			if (m->is_fnn) q->by = (float*)p, p += s_y;
+			if (m->is_fnn) q->mb.buf_fnn = sfnn_buf_init(m->n_layers, m->n_neurons, m->t);
+			else q->mb.buf_ae = (float*)p, p += s_ae;
 		}
-		mn += mb.n;
 	}
-	if (mb.buf_ae) free(mb.buf_ae);
-	if (mb.buf_fnn) sfnn_buf_destroy(mb.buf_fnn);
+	tr->u.tc = &tr->tc, tr->u.n = n_par, tr->u.t = m->t, tr->u.g = tr->g, tr->u.r = tr->r, tr->u.h = tr->h;
+	tr->u.l2 = m->is_fnn? tc->L2_par : 0.0f;
+	memcpy(tr->t_prev, m->t, n_par * sizeof(float));
+	return tr;
+}
 
-	if (_buf == 0) free(buf);
-	free(sx); free(sy);
-	return mb.running_cost / n_out / n;
+void sann_trainer_destroy(sann_trainer_t *tr)
+{
+	int i;
+	if (tr == 0) return;
+	sann_mem_add(SANN_MEM_OPT, -tr->mem_opt);
+	sann_mem_add(SANN_MEM_BATCH, -tr->mem_batch);
+	if (tr->mb.buf_fnn) sfnn_buf_destroy(tr->mb.buf_fnn);
+	for (i = 0; i < tr->n_parts; ++i)
+		if (tr->part[i].mb.buf_fnn) sfnn_buf_destroy(tr->part[i].mb.buf_fnn);
+	free(tr->part); free(tr->arena); free(tr);
 }
 
-float sann_evaluate(const sann_t *m, int n, float *const* x, float *const* y0)
+static void trainer_update(sann_trainer_t *tr, int slot, int n, int sync) // gradient and update on a packed minibatch
+{
+	const sann_tconf_t *tc = &tr->tc;
+	sann_t *m = tr->m;
+	int64_t h0[SANN_N_HW], h1[SANN_N_HW];
+	int hw = tc->prof && tc->prof->hwc;
+	double t0 = 0.;
+	tr->mb.n = n, tr->mb.x = tr->ga.bx[slot], tr->mb.y = tr->ga.by[slot];
+	memset(tr->g, 0, tr->n_par * sizeof(float));
+	mb_gradient(tr->n_par, m->t, tr->g, &tr->mb);
+	if (m->csr) sann_csr_mask(m, tr->g); // pruned weights stay at zero
+	tr->u.a = 1.0f / n; // gradient averaging and L2 are applied on the fly by the update
+	if (tc->malgo == SANN_MIN_MINI_ADAM) tr->u.step = ++tr->n_steps;
+	if (tc->prof) t0 = sann_prof_time();
+	if (hw) sann_prof_hw_read(tc->prof, h0);
+	sann_par_update(&tr->u, update_worker);
+	if (hw) sann_prof_hw_read(tc->prof, h1), sann_prof_hw_add(tc->prof, SANN_PH_UPDATE, h0, h1); // the dist average is mostly waiting; not counted
+	if (sync) sann_dist_average(tc->dist, tr->n_par, m->t);
+	if (tc->prof) sann_prof_add(tc->prof, SANN_PH_UPDATE, 0, t0, sann_prof_time() - t0, 1);
+}
+
+float sann_trainer_step(sann_trainer_t *tr, const sann_data_t *x, const sann_data_t *y, int st, int n)
+{
+	mb_gather_t *ga = &tr->ga;
+	double rc0 = tr->mb.running_cost;
+	if (n > tr->tc.mini_batch) n = tr->tc.mini_batch;
+	if (st + n > x->n) n = x->n - st;
+	if (n <= 0) return 0.0f;
+	ga->dx = x, ga->dy = tr->m->is_fnn? y : 0;
+	mb_fill(ga->dx, n, &x->row[st], ga->ldx, ga->bx[0]);
+	if (ga->dy) mb_fill(ga->dy, n, &y->row[st], ga->ldy, ga->by[0]);
+	trainer_update(tr, 0, n, 0);
+	sann_csr_sync(tr->m);
+	return (tr->mb.running_cost - rc0) / sann_n_out(tr->m) / n;
+}
+
+/*
+ * L-BFGS minimizes (C + L2/2*|t|^2) / n, where C is the summed cost of all
+ * training samples, which is the objective of a minibatch update with $n as
+ * the batch size. Each epoch is one iteration: the direction comes from the
+ * two-loop recursion over the last SANN_LBFGS_M curvature pairs and the step
+ * from backtracking until the Armijo condition holds. The objective and the
+ * gradient at the accepted step are kept for the next iteration.
+ */
+
+typedef struct {
+	sann_trainer_t *tr;
+	int n;
+	const sann_data_t *x, *y;
+} lbfgs_job_t;
+
+static void lbfgs_worker(void *data, long i, int tid) // gradient and cost of the i-th part of the samples
+{
+	lbfgs_job_t *j = (lbfgs_job_t*)data;
+	sann_trainer_t *tr = j->tr;
+	lbfgs_part_t *q = &tr->part[i];
+	int st = (int64_t)j->n * i / tr->n_parts, en = (int64_t)j->n * (i + 1) / tr->n_parts, b = tr->tc.mini_batch;
+	memset(q->g, 0, tr->n_par * sizeof(float));
+	q->mb.running_cost = 0.;
+	for (; st < en; st += b) {
+		int n = st + b < en? b : en - st;
+		mb_fill(j->x, n, &j->x->row[st], tr->ga.ldx, q->bx);
+		if (tr->m->is_fnn) mb_fill(j->y, n, &j->y->row[st], tr->ga.ldy, q->by);
+		q->mb.n = n, q->mb.x = q->bx, q->mb.y = q->by;
+		mb_gradient(tr->n_par, tr->m->t, q->g, &q->mb);
+	}
+}
+
+static double lbfgs_eval(sann_trainer_t *tr, int n, const sann_data_t *x, const sann_data_t *y, double *rc) // objective at m->t; its gradient goes to tr->g
+{
+	const sann_tconf_t *tc = &tr->tc;
+	sann_t *m = tr->m;
+	lbfgs_job_t j;
+	double t0, cost, s2 = 0.;
+	float l2 = m->is_fnn? tc->L2_par : 0.0f;
+	int i;
+	t0 = tc->prof? sann_prof_time() : 0.;
+	j.tr = tr, j.n = n, j.x = x, j.y = y;
+	sann_for(tr->n_parts, lbfgs_worker, &j, tr->n_parts);
+	cost = tr->part[0].mb.running_cost;
+	for (i = 1; i < tr->n_parts; ++i) {
+		sann_saxpy(tr->n_par, 1.0f, tr->part[i].g, tr->g);
+		cost += tr->part[i].mb.running_cost;
+	}
+	if (tc->prof) sann_prof_add(tc->prof, SANN_PH_BACKWARD, 0, t0, sann_prof_time() - t0, n); // forward passes are included
+	if (tc->dist) { // the full batch spans all processes
+		float c[2];
+		c[0] = cost, c[1] = n;
+		sann_dist_allreduce(tc->dist, tr->n_par, tr->g);
+		sann_dist_allreduce(tc->dist, 2, c);
+		cost = c[0], n = (int)c[1];
+	}
+	if (m->csr) sann_csr_mask(m, tr->g);
+	for (i = 0; i < tr->n_par; ++i) {
+		tr->g[i] = (tr->g[i] + l2 * m->t[i]) / n;
+		s2 += m->t[i] * m->t[i];
+	}
+	*rc = cost / sann_n_out(m) / n;
+	return (cost + .5 * l2 * s2) / n;
+}
+
+static inline double lbfgs_dot(int n, const float *x, const float *y)
+{
+	double s = 0.;
+	int i;
+	for (i = 0; i < n; ++i) s += (double)x[i] * y[i];
+	return s;
+}
+
+static void lbfgs_direction(sann_trainer_t *tr) // d = -H*g_prev, where H approximates the inverse Hessian
+{
+	double a[SANN_LBFGS_M];
+	int i, k, n = tr->n_par;
+	for (i = 0; i < n; ++i) tr->d[i] = -tr->g_prev[i];
+	for (k = 0; k < tr->n_pairs; ++k) { // from the newest pair to the oldest
+		int l = (tr->head + SANN_LBFGS_M - 1 - k) % SANN_LBFGS_M;
+		a[k] = tr->rho[l] * lbfgs_dot(n, tr->ds + (size_t)l * n, tr->d);
+		sann_saxpy(n, -a[k], tr->dg + (size_t)l * n, tr->d);
+	}
+	if (tr->n_pairs > 0)
+		for (i = 0; i < n; ++i) tr->d[i] *= tr->gamma;
+	for (k = tr->n_pairs - 1; k >= 0; --k) {
+		int l = (tr->head + SANN_LBFGS_M - 1 - k) % SANN_LBFGS_M;
+		double b = tr->rho[l] * lbfgs_dot(n, tr->dg + (size_t)l * n, tr->d);
+		sann_saxpy(n, a[k] - b, tr->ds + (size_t)l * n, tr->d);
+	}
+}
+
+static float lbfgs_epoch(sann_trainer_t *tr, int n, const sann_data_t *x, const sann_data_t *y)
+{
+	sann_t *m = tr->m;
+	float *t = m->t;
+	double gd, a, f = 0., rc = 0., sy, yy;
+	int i, k, n_par = tr->n_par;
+
+	if (!tr->ready) { // objective and gradient at the starting point
+		tr->f = lbfgs_eval(tr, n, x, y, &tr->rc);
+		memcpy(tr->g_prev, tr->g, n_par * sizeof(float));
+		tr->ready = 1, tr->n_pairs = 0;
+	}
+	lbfgs_direction(tr);
+	gd = lbfgs_dot(n_par, tr->g_prev, tr->d);
+	if (tr->n_pairs > 0 && gd >= 0.) { // not a descent direction; restart with steepest descent
+		tr->n_pairs = 0;
+		lbfgs_direction(tr);
+		gd = lbfgs_dot(n_par, tr->g_prev, tr->d);
+	}
+	if (gd >= 0.) { // zero gradient
+		tr->converged = 1;
+		return tr->rc;
+	}
+	a = tr->n_pairs > 0? 1. : 1. / sqrt(-gd); // the first step has unit length
+	memcpy(tr->t_prev, t, n_par * sizeof(float));
+	for (k = 0; k < SANN_LBFGS_LS; ++k, a *= .5) {
+		for (i = 0; i < n_par; ++i)
+			t[i] = tr->t_prev[i] + a * tr->d[i];
+		f = lbfgs_eval(tr, n, x, y, &rc);
+		if (f <= tr->f + SANN_LBFGS_C1 * a * gd) break;
+	}
+	if (k == SANN_LBFGS_LS) { // no sufficient decrease; roll back and drop the history
+		memcpy(t, tr->t_prev, n_par * sizeof(float));
+		if (tr->n_pairs == 0) tr->converged = 1; // steepest descent failed, too; retrying would give the same result
+		else if (sann_verbose >= 2)
+			fprintf(stderr, "[W::%s] line search failed; restarting L-BFGS\n", __func__);
+		tr->n_pairs = 0;
+		return tr->rc;
+	}
+	for (i = 0; i < n_par; ++i) // the changes; $d and $t_prev are no longer needed
+		tr->d[i] = t[i] - tr->t_prev[i], tr->t_prev[i] = tr->g[i] - tr->g_prev[i];
+	sy = lbfgs_dot(n_par, tr->d, tr->t_prev), yy = lbfgs_dot(n_par, tr->t_prev, tr->t_prev);
+	if (sy > 1e-10 * yy && yy > 0.) { // skip the pair if the curvature condition fails
+		memcpy(tr->ds + (size_t)tr->head * n_par, tr->d, n_par * sizeof(float));
+		memcpy(tr->dg + (size_t)tr->head * n_par, tr->t_prev, n_par * sizeof(float));
+		tr->rho[tr->head] = 1. / sy, tr->gamma = sy / yy;
+		tr->head = (tr->head + 1) % SANN_LBFGS_M;
+		if (tr->n_pairs < SANN_LBFGS_M) ++tr->n_pairs;
+	}
+	memcpy(tr->g_prev, tr->g, n_par * sizeof(float));
+	tr->f = f, tr->rc = rc;
+	sann_csr_sync(m);
+	return rc;
+}
+
+float sann_trainer_epoch(sann_trainer_t *tr, int n, const sann_data_t *x, const sann_data_t *y)
+{
+	const sann_tconf_t *tc = &tr->tc;
+	sann_t *m = tr->m;
+	mb_gather_t *ga = &tr->ga;
+	void *task = 0;
+	int k, use_thread, n_used = 0;
+	double t0;
+
+	assert(n <= tr->max_n);
+	if (tc->balgo == SANN_MIN_BATCH_LBFGS) return lbfgs_epoch(tr, n, x, y);
+	ga->n = n, ga->dx = x, ga->dy = m->is_fnn? y : 0;
+	ga->n_batches = (n + tc->mini_batch - 1) / tc->mini_batch;
+	if (tc->dist) // all processes take the same number of steps
+		ga->n_batches = sann_dist_min(tc->dist, ga->n_batches);
+	memcpy(ga->sx, x->row, n * sizeof(void*));
+	if (ga->dy) memcpy(ga->sy, y->row, n * sizeof(void*));
+	t0 = tc->prof? sann_prof_time() : 0.;
+	sann_data_shuffle(n, (float**)ga->sx, ga->dy? (float**)ga->sy : 0, 0);
+	if (tc->prof) sann_prof_add(tc->prof, SANN_PH_SHUFFLE, 0, t0, sann_prof_time() - t0, 1);
+	if (tc->malgo != SANN_MIN_MINI_ADAM) // the RMSprop accumulator is reset in each epoch; Adam moments are kept
+		memset(tr->r, 0, tr->n_par * sizeof(float));
+
+	if (tc->n_threads > 1 && ga->n_batches > 1) { // gather on an idle pool thread if there is one
+		ga->filled[0] = ga->filled[1] = 0;
+		pthread_mutex_init(&ga->lock, 0);
+		pthread_cond_init(&ga->cv, 0);
+		if ((task = sann_spawn(mb_gather_worker, ga)) == 0) {
+			pthread_mutex_destroy(&ga->lock);
+			pthread_cond_destroy(&ga->cv);
+		}
+	}
+	use_thread = (task != 0);
+	tr->mb.running_cost = 0.;
+	for (k = 0; k < ga->n_batches; ++k) {
+		int slot = use_thread? k & 1 : 0, n_k;
+		if (use_thread) { // wait for the helper thread
+			pthread_mutex_lock(&ga->lock);
+			while (!ga->filled[slot]) pthread_cond_wait(&ga->cv, &ga->lock);
+			pthread_mutex_unlock(&ga->lock);
+		} else mb_gather(ga, k, slot, 0);
+		n_k = (k + 1) * tc->mini_batch < n? tc->mini_batch : n - k * tc->mini_batch;
+		n_used += n_k;
+		trainer_update(tr, slot, n_k, tc->dist && ((tc->sync_intv > 0 && (k + 1) % tc->sync_intv == 0) || k == ga->n_batches - 1));
+		if (use_thread) { // release the slot
+			pthread_mutex_lock(&ga->lock);
+			ga->filled[slot] = 0;
+			pthread_cond_broadcast(&ga->cv);
+			pthread_mutex_unlock(&ga->lock);
+		}
+	}
+	if (use_thread) {
+		sann_join(task);
+		pthread_mutex_destroy(&ga->lock);
+		pthread_cond_destroy(&ga->cv);
+	}
+	sann_csr_sync(m);
+	if (tc->dist) { // running cost over all processes
+		float rc[2];
+		rc[0] = tr->mb.running_cost, rc[1] = n_used;
+		sann_dist_allreduce(tc->dist, 2, rc);
+		tr->mb.running_cost = rc[0], n_used = (int)rc[1];
+	}
+	return tr->mb.running_cost / sann_n_out(m) / n_used;
+}
+
+void sann_trainer_adjust(sann_trainer_t *tr)
 {
-	int i, j;
-	float *y;
+	const sann_tconf_t *tc = &tr->tc;
+	par_update_t u;
+	double t0;
+	int64_t h0[SANN_N_HW], h1[SANN_N_HW];
+	if (tr->h == 0) return;
+	t0 = tc->prof? sann_prof_time() : 0.;
+	memset(&u, 0, sizeof(par_update_t));
+	u.tc = tc, u.n = tr->n_par, u.first = (tr->n_adjust++ == 0);
+	u.t = tr->m->t, u.t_prev = tr->t_prev, u.g_prev = tr->g_prev, u.h = tr->h;
+	if (tc->prof && tc->prof->hwc) sann_prof_hw_read(tc->prof, h0);
+	sann_par_update(&u, irprop_worker); // iRprop-, fused into one pass
+	if (tc->prof && tc->prof->hwc) sann_prof_hw_read(tc->prof, h1), sann_prof_hw_add(tc->prof, SANN_PH_UPDATE, h0, h1);
+	if (tc->prof) sann_prof_add(tc->prof, SANN_PH_UPDATE, 0, t0, sann_prof_time() - t0, 1);
+}
+
+/**************
+ * Evaluation *
+ **************/
+
+#define SANN_EVAL_BLOCK 64
+
+typedef struct {
+	const sann_t *m;
+	int st, en;
+	const sann_data_t *x, *y;
+	double *cost;      // cost of each block
+	float **buf;       // per-thread working space
+	float **sbuf;      // per-thread working space for pruned FNNs
+} eval_shared_t;
+
+static double eval_sparse_block(eval_shared_t *s, int st, int en, int tid) // samples in the block are evaluated together
+{
+	const sann_t *m = s->m;
+	int i, j, n_in = sann_n_in(m), n_out = sann_n_out(m);
+	float *xb = s->sbuf[tid], *yb = xb + SANN_EVAL_BLOCK * n_in, *lb = yb + SANN_EVAL_BLOCK * n_out, *ybuf = s->buf[tid];
+	const float *x[SANN_EVAL_BLOCK] = { 0 };
+	float *y[SANN_EVAL_BLOCK], *logp[SANN_EVAL_BLOCK];
+	double cost = 0.;
+	for (i = st; i < en; ++i) {
+		x[i-st] = sann_data_row(s->x, i, xb + (i - st) * n_in);
+		y[i-st] = yb + (i - st) * n_out, logp[i-st] = lb + (i - st) * n_out;
+	}
+	sfnn_sparse_forward_block(m, en - st, x, lb + SANN_EVAL_BLOCK * n_out, y, logp);
+	for (i = st; i < en; ++i) {
+		const float *yi = sann_data_row(s->y, i, ybuf);
+		if (m->af[m->n_layers-2] == SANN_AF_SOFTMAX)
+			cost += sann_softmax_cost(n_out, yi, logp[i-st]);
+		else for (j = 0; j < n_out; ++j)
+			cost += sann_sigm_cost(yi[j], y[i-st][j]);
+	}
+	return cost;
+}
+
+static void eval_worker(void *data, long blk, int tid)
+{
+	eval_shared_t *s = (eval_shared_t*)data;
+	const sann_t *m = s->m;
+	int i, j, n_in = sann_n_in(m), n_out = sann_n_out(m), st, en;
+	float *xbuf = s->buf[tid], *ybuf = xbuf + n_in, *logp = ybuf + n_out, *fbuf = logp + n_out;
+	double cost = 0.;
+	st = s->st + blk * SANN_EVAL_BLOCK;
+	en = st + SANN_EVAL_BLOCK < s->en? st + SANN_EVAL_BLOCK : s->en;
+	if (m->csr) {
+		s->cost[blk] = eval_sparse_block(s, st, en, tid);
+		return;
+	}
+	for (i = st; i < en; ++i) {
+		const float *xi, *yi, *yo;
+		xi = sann_data_row(s->x, i, xbuf);
+		if (m->is_fnn) {
+			yi = sann_data_row(s->y, i, ybuf);
+			yo = sfnn_core_infer(m->n_layers, m->n_neurons, m->af, m->t, xi, m->n_layers - 1, fbuf, logp);
+		} else {
+			float *z = fbuf, *out = z + sae_n_hidden(m);
+			yi = xi;
+			sae_core_encode(sae_n_in(m), sae_n_hidden(m), m->t, m->af[0], xi, z, m->scaled);
+			sae_core_decode(sae_n_in(m), sae_n_hidden(m), m->t, z, out, m->scaled);
+			yo = out;
+		}
+		if (m->af[m->n_layers-2] == SANN_AF_SOFTMAX)
+			cost += sann_softmax_cost(n_out, yi, logp);
+		else for (j = 0; j < n_out; ++j)
+			cost += sann_sigm_cost(yi[j], yo[j]);
+	}
+	s->cost[blk] = cost;
+}
+
+float sann_evaluate_range(const sann_t *m, int st, int en, const sann_data_t *x, const sann_data_t *y, int n_threads)
+{
+	eval_shared_t s;
+	int i, n_blk;
 	double sum = 0.;
-	y = (float*)malloc(sann_n_out(m) * sizeof(float));
-	for (i = 0; i < n; ++i) {
-		double cost = 0.;
-		sann_apply(m, x[i], y, 0);
-		for (j = 0; j < sann_n_out(m); ++j)
-			cost += sann_sigm_cost(m->is_fnn? y0[i][j] : x[i][j], y[j]);
-		sum += cost;
+	if (en <= st) return 0.0f;
+	n_blk = (en - st + SANN_EVAL_BLOCK - 1) / SANN_EVAL_BLOCK;
+	if (n_threads > n_blk) n_threads = n_blk;
+	if (n_threads < 1) n_threads = 1;
+	s.m = m, s.st = st, s.en = en, s.x = x, s.y = y;
+	s.cost = (double*)calloc(n_blk, sizeof(double));
+	s.buf = (float**)calloc(n_threads, sizeof(float*));
+	s.sbuf = (float**)calloc(n_threads, sizeof(float*));
+	for (i = 0; i < n_threads; ++i) {
+		int n_fwd = m->is_fnn? sfnn_infer_buf_size(m->n_layers, m->n_neurons) : sae_n_hidden(m) + sae_n_in(m);
+		s.buf[i] = (float*)malloc((sann_n_in(m) + sann_n_out(m) * 2 + n_fwd) * sizeof(float));
+		if (m->csr) s.sbuf[i] = (float*)malloc(((sann_n_in(m) + sann_n_out(m) * 2) * SANN_EVAL_BLOCK + sfnn_sparse_buf_size(m, SANN_EVAL_BLOCK)) * sizeof(float));
 	}
-	free(y);
-	return (float)(sum / n / sann_n_out(m));
+	sann_for(n_threads, eval_worker, &s, n_blk);
+	for (i = 0; i < n_blk; ++i) sum += s.cost[i]; // sum up in order such that the result is independent of n_threads
+	for (i = 0; i < n_threads; ++i) {
+		free(s.buf[i]); free(s.sbuf[i]);
+	}
+	free(s.buf); free(s.sbuf); free(s.cost);
+	return (float)(sum / (en - st) / sann_n_out(m));
+}
+
+float sann_evaluate_data(const sann_t *m, int n, const sann_data_t *x, const sann_data_t *y)
+{
+	return sann_evaluate_range(m, 0, n, x, y, 1);
+}
+
+float sann_evaluate(const sann_t *m, int n, float *const* x, float *const* y0)
+{
+	sann_data_t *dx, *dy;
+	float cost;
+	dx = sann_data_view(n, sann_n_in(m), x);
+	dy = m->is_fnn? sann_data_view(n, sann_n_out(m), y0) : 0;
+	cost = sann_evaluate_data(m, n, dx, dy);
+	sann_data_destroy(dx); sann_data_destroy(dy);
+	return cost;
+}
+
+typedef struct {
+	const sann_t *m;
+	const sann_data_t *x;
+	sann_data_t *y;
+	float **buf;       // per-thread working space
+} predict_shared_t;
+
+static void predict_worker(void *data, long blk, int tid)
+{
+	predict_shared_t *s = (predict_shared_t*)data;
+	const sann_t *m = s->m;
+	int i, n_in = sann_n_in(m), n_out = sann_n_out(m), st, en;
+	float *xbuf = s->buf[tid];
+	st = blk * SANN_EVAL_BLOCK;
+	en = st + SANN_EVAL_BLOCK < s->x->n? st + SANN_EVAL_BLOCK : s->x->n;
+	if (m->csr) { // pruned FNN; samples in the block are applied together
+		const float *x[SANN_EVAL_BLOCK] = { 0 };
+		float *y[SANN_EVAL_BLOCK], *yb = xbuf + SANN_EVAL_BLOCK * n_in;
+		for (i = st; i < en; ++i) {
+			x[i-st] = sann_data_row(s->x, i, xbuf + (i - st) * n_in);
+			y[i-st] = yb + (i - st) * n_out;
+		}
+		sfnn_sparse_forward_block(m, en - st, x, yb + SANN_EVAL_BLOCK * n_out, y, 0);
+		for (i = st; i < en; ++i)
+			sann_data_set(s->y, i, y[i-st]);
+		return;
+	}
+	for (i = st; i < en; ++i) {
+		const float *xi = sann_data_row(s->x, i, xbuf);
+		if (m->is_fnn) {
+			sann_data_set(s->y, i, sfnn_core_infer(m->n_layers, m->n_neurons, m->af, m->t, xi, m->n_layers - 1, xbuf + n_in, 0));
+		} else {
+			float *z = xbuf + n_in, *out = z + sae_n_hidden(m);
+			sae_core_encode(sae_n_in(m), sae_n_hidden(m), m->t, m->af[0], xi, z, m->scaled);
+			sae_core_decode(sae_n_in(m), sae_n_hidden(m), m->t, z, out, m->scaled);
+			sann_data_set(s->y, i, out);
+		}
+	}
+}
+
+sann_data_t *sann_predict(const sann_t *m, const sann_data_t *x, int type, int n_threads)
+{
+	predict_shared_t s;
+	int i, n_blk, n_out = sann_n_out(m), out_af = m->af[m->n_layers-2];
+	assert(x->n_col == sann_n_in(m));
+	if (type == SANN_DT_U8 && out_af != SANN_AF_SIGM && out_af != SANN_AF_SOFTMAX && out_af != SANN_AF_TANH) {
+		if (sann_verbose >= 1)
+			fprintf(stderr, "[E::%s] uint8 storage needs a bounded output activation\n", __func__);
+		return 0;
+	}
+	if ((s.y = sann_data_init(x->n, n_out, type)) == 0) return 0;
+	if (type == SANN_DT_U8) { // the range of the output activation is mapped to [0,255]: [0,1] for sigmoid and softmax; [-1,1] for tanh
+		float lo = out_af == SANN_AF_TANH? -1.0f : 0.0f;
+		for (i = 0; i < n_out; ++i)
+			s.y->offset[i] = lo, s.y->scale[i] = (1.0f - lo) / 255.0f;
+	}
+	n_blk = (x->n + SANN_EVAL_BLOCK - 1) / SANN_EVAL_BLOCK;
+	if (n_threads > n_blk) n_threads = n_blk;
+	if (n_threads < 1) n_threads = 1;
+	s.m = m, s.x = x;
+	s.buf = (float**)calloc(n_threads, sizeof(float*));
+	for (i = 0; i < n_threads; ++i) {
+		if (m->csr) s.buf[i] = (float*)malloc(((sann_n_in(m) + n_out) * SANN_EVAL_BLOCK + sfnn_sparse_buf_size(m, SANN_EVAL_BLOCK)) * sizeof(float));
+		else if (m->is_fnn) s.buf[i] = (float*)malloc((sann_n_in(m) + sfnn_infer_buf_size(m->n_layers, m->n_neurons)) * sizeof(float));
+		else s.buf[i] = (float*)malloc((sann_n_in(m) + sae_n_hidden(m) + n_out) * sizeof(float));
+	}
+	sann_for(n_threads, predict_worker, &s, n_blk);
+	for (i = 0; i < n_threads; ++i) free(s.buf[i]);
+	free(s.buf);
+	return s.y;
 }
 
 /*************************
  * Train for many epochs *
  *************************/
 
-int sann_train(sann_t *m, const sann_tconf_t *tc0, int N, float *const* x, float *const* y)
+typedef struct {
+	const sann_t *m;
+	int st, en, n_threads;
+	const sann_data_t *x, *y;
+	float cost;
+	sann_prof_t *prof;
+	void *task;
+} valid_job_t;
+
+static void valid_worker(void *data)
 {
-	int i, k, n_par, n_cost_inc = 0, best_epoch = 0, n_train, n_test;
-	float *g_prev, *g_curr, *t_prev, *h = 0, cost_best = FLT_MAX;
-	sann_t *best;
+	valid_job_t *j = (valid_job_t*)data;
+	double t0 = j->prof? sann_prof_time() : 0.;
+	j->cost = sann_evaluate_range(j->m, j->st, j->en, j->x, j->y, j->n_threads);
+	if (j->prof) sann_prof_add(j->prof, SANN_PH_VALID, 2, t0, sann_prof_time() - t0, 1);
+}
 
-	assert(m->af[m->n_layers - 2] == SANN_AF_SIGM); // for now, the output activation function has to be sigmoid
+typedef struct {
+	const char *fn;
+	sann_ckpt_t *c;
+	void *task;
+} ckpt_job_t;
+
+static void ckpt_worker(void *data)
+{
+	ckpt_job_t *j = (ckpt_job_t*)data;
+	if (sann_ckpt_dump(j->fn, j->c) != 0 && sann_verbose >= 2)
+		fprintf(stderr, "[W::%s] failed to write checkpoint '%s'\n", __func__, j->fn);
+	sann_ckpt_destroy(j->c);
+	j->c = 0;
+}
+
+static inline void sann_mem_move(int from, int to, int n_par)
+{
+	sann_mem_add(from, -(int64_t)n_par * sizeof(float));
+	sann_mem_add(to, (int64_t)n_par * sizeof(float));
+}
+
+static void train_free(int n_par, sann_trainer_t *tr, sann_t *best)
+{
+	sann_trainer_destroy(tr);
+	sann_mem_move(SANN_MEM_BEST, SANN_MEM_PARAM, n_par); // sann_destroy() releases it as parameters
+	sann_destroy(best);
+}
+
+int64_t sann_mem_train(const sann_tconf_t *tc, int n_par, int n)
+{
+	int64_t s = (int64_t)n_par * sizeof(float), l;
+	l = s; // best model
+	if (tc->vfrac > 0.0f && tc->n_threads > 1) l += s; // snapshot under background validation
+	l += s * (int64_t)tr_n_batch(tc, 1);
+	l += s * (tc->malgo == SANN_MIN_MINI_ADAM? 3 : 2);
+	l += (int64_t)n * 2 * sizeof(void*); // shuffled row pointers in the trainer
+	return l;
+}
+
+static float *sann_fdup(int n, const float *p)
+{
+	float *q;
+	if (p == 0) return 0;
+	q = (float*)malloc(n * sizeof(float));
+	memcpy(q, p, n * sizeof(float));
+	return q;
+}
+
+int sann_train_core(sann_t *m, const sann_tconf_t *tc0, const sann_data_t *x, const sann_data_t *y, sann_epoch_f func, void *data)
+{
+	int k, k0 = 0, N, n_par, n_cost_inc = 0, best_epoch = 0, n_train, n_test, has_valid, stop = -1, pending = 0, writing = 0, halted = 0, converged = 0;
+	const char *fn_ckpt = tc0->dist? 0 : tc0->fn_ckpt;
+	float cost_best = FLT_MAX, rc_kv = 0.0f;
+	sann_t *best, *snap = 0;
+	sann_trainer_t *tr;
+	sann_ckpt_t *c = 0;
+	valid_job_t job;
+	ckpt_job_t cj;
+	sann_prof_t prof_last;
+
+	assert(m->af[m->n_layers - 2] == SANN_AF_SIGM || (m->is_fnn && m->af[m->n_layers - 2] == SANN_AF_SOFTMAX)); // cross-entropy needs a sigmoid or softmax output
+	assert(x->n_col == sann_n_in(m) && (!m->is_fnn || (y && y->n == x->n && y->n_col == sann_n_out(m))));
+	sann_pool_reserve(tc0->n_threads); // before background validation, which uses fewer threads
+	N = x->n;
 	n_test = (int)(N * tc0->vfrac);
+	if (tc0->dist && tc0->dist->rank != 0) n_test = 0; // only process 0 validates
 	n_train = N - n_test;
+	has_valid = (n_test > 0);
+	if (tc0->dist) { // start from the parameters of process 0
+		float v = n_test;
+		sann_dist_bcast(tc0->dist, 1, &v);
+		has_valid = (v > 0.0f);
+		sann_dist_bcast(tc0->dist, sann_n_par(m), m->t);
+		sann_csr_sync(m);
+	}
 
 	best = sann_dup(m);
 	n_par = sann_n_par(m);
-	t_prev = (float*)calloc(n_par * 3, sizeof(float));
-	g_prev = t_prev + n_par;
-	g_curr = g_prev + n_par;
-	if (tc0->balgo == SANN_MIN_BATCH_RPROP) {
-		h = (float*)calloc(n_par, sizeof(float));
-		for (i = 0; i < n_par; ++i) h[i] = tc0->h;
-	}
-	for (k = 0; k < tc0->n_epochs; ++k) {
-		float rc, cost;
-
-		if (h) memcpy(t_prev, m->t, n_par * sizeof(float));
-		rc = sann_train_epoch(m, tc0, h, n_train, x, y, 0);
-		cost = n_test? sann_evaluate(m, n_test, x + n_train, y? y + n_train : 0) : 0.;
-		if (sann_verbose >= 3) {
-			if (n_test) fprintf(stderr, "[M::%s] epoch:%d running_cost:%g validation_cost:%g\n", __func__, k+1, rc, cost);
-			else fprintf(stderr, "[M::%s] epoch:%d running_cost:%g\n", __func__, k+1, rc);
+	sann_mem_move(SANN_MEM_PARAM, SANN_MEM_BEST, n_par);
+	if ((tr = sann_trainer_init(m, tc0, n_train)) == 0) {
+		sann_mem_move(SANN_MEM_BEST, SANN_MEM_PARAM, n_par);
+		sann_destroy(best);
+		return -1;
+	}
+	if (fn_ckpt && tc0->resume && (c = sann_ckpt_restore(fn_ckpt)) != 0) {
+		if (c->N != N || c->n_par != n_par || (c->h == 0) != (tr->h == 0) || (c->moments == 0) != (tc0->malgo != SANN_MIN_MINI_ADAM)
+			|| (c->lbfgs == 0) != (tc0->balgo != SANN_MIN_BATCH_LBFGS)) {
+			if (sann_verbose >= 1)
+				fprintf(stderr, "[E::%s] checkpoint '%s' does not match the model, the data or the training algorithm\n", __func__, fn_ckpt);
+			sann_ckpt_destroy(c);
+			train_free(n_par, tr, best);
+			return -1;
 		}
+		memcpy(m->t, c->m->t, n_par * sizeof(float));
+		memcpy(best->t, c->best, n_par * sizeof(float));
+		memcpy(tr->g_prev, c->g_prev, n_par * sizeof(float));
+		if (tr->h) memcpy(tr->h, c->h, n_par * sizeof(float));
+		if (c->moments) memcpy(tr->r, c->moments, n_par * 2 * sizeof(float));
+		if (c->lbfgs) { // ds and dg are adjacent in the arena
+			memcpy(tr->ds, c->lbfgs, (size_t)SANN_LBFGS_M * 2 * n_par * sizeof(float));
+			memcpy(tr->rho, c->rho, SANN_LBFGS_M * sizeof(double));
+			tr->n_pairs = c->n_pairs, tr->head = c->head;
+			tr->gamma = c->gamma, tr->f = c->f, tr->rc = c->rc, tr->ready = 1;
+		}
+		tr->n_steps = c->n_steps, tr->n_adjust = c->epoch;
+		k0 = c->epoch, n_cost_inc = c->n_cost_inc, best_epoch = c->best_epoch;
+		cost_best = c->cost_best, rc_kv = c->rc_pending;
+		sann_rng_set(c->rng);
+		sann_csr_sync(m); sann_csr_sync(best);
+		if (sann_verbose >= 3)
+			fprintf(stderr, "[M::%s] resumed from checkpoint '%s' after epoch %d\n", __func__, fn_ckpt, k0);
+	}
+	if (n_test && !tc0->dist && (tc0->n_threads > 1 || (c && c->snap))) { // validate on a snapshot in the background while the next epoch trains
+		snap = sann_dup(m);
+		sann_mem_move(SANN_MEM_PARAM, SANN_MEM_BEST, n_par);
+		job.m = snap, job.st = n_train, job.en = N, job.x = x, job.y = y;
+		job.n_threads = tc0->n_threads - 1 > 1? tc0->n_threads - 1 : 1;
+		job.prof = tc0->prof;
+		if (c && c->snap) { // restart the validation interrupted by the checkpoint
+			memcpy(snap->t, c->snap, n_par * sizeof(float));
+			if ((job.task = sann_spawn(valid_worker, &job)) == 0) valid_worker(&job); // no idle pool thread
+			pending = 1;
+		}
+	}
+	sann_ckpt_destroy(c);
+	memcpy(tr->t_prev, m->t, n_par * sizeof(float));
+	if (tc0->prof) prof_last = *tc0->prof;
+	for (k = k0; k <= tc0->n_epochs; ++k) {
+		float rc = 0.0f, cost = 0.0f;
+		int kv = -1, last = (k == tc0->n_epochs); // kv: the epoch whose validation cost is available
 
-		if (k < tc0->max_inc || (k >= tc0->max_inc && cost < cost_best)) {
-			cost_best = cost;
-			sann_cpy(best, m);
-			n_cost_inc = 0, best_epoch = k;
-		} else if (cost > cost_best) {
-			if (++n_cost_inc > tc0->max_inc)
-				break;
+		if (!last) {
+			rc = sann_trainer_epoch(tr, n_train, x, y);
+			if (tr->converged) last = converged = 1; // the model is unchanged; only the pending validation is left
+		}
+		if (snap) {
+			if (pending) {
+				sann_join(job.task);
+				pending = 0, kv = k - 1, cost = job.cost;
+			}
+		} else if (!last) {
+			double t0 = tc0->prof? sann_prof_time() : 0.;
+			kv = k, rc_kv = rc;
+			cost = n_test? sann_evaluate_range(m, n_train, N, x, y, tc0->n_threads) : 0.;
+			if (tc0->prof && n_test) sann_prof_add(tc0->prof, SANN_PH_VALID, 0, t0, sann_prof_time() - t0, 1);
+			if (tc0->dist) sann_dist_bcast(tc0->dist, 1, &cost); // all processes take the same decisions
+		}
+		if (tc0->dist && tc0->dist->err) {
+			stop = -2;
+			break;
 		}
 
-		if (h) { // iRprop-
-			for (i = 0; i < n_par; ++i)
-				g_curr[i] = m->t[i] - t_prev[i];
-			if (k >= 1) { // iRprop-
-				for (i = 0; i < n_par; ++i) {
-					float tmp = g_prev[i] * g_curr[i];
-					if (tmp > 0.) {
-						h[i] *= tc0->rprop_inc;
-						if (h[i] > tc0->h_max) h[i] = tc0->h_max;
-					} else if (tmp < 0.) {
-						h[i] *= tc0->rprop_dec;
-						if (h[i] < tc0->h_min) h[i] = tc0->h_min;
-						g_curr[i] = 0.;
-					}
+		if (kv >= 0) {
+			if (sann_verbose >= 3) {
+				if (has_valid) fprintf(stderr, "[M::%s] epoch:%d running_cost:%g validation_cost:%g\n", __func__, kv+1, rc_kv, cost);
+				else fprintf(stderr, "[M::%s] epoch:%d running_cost:%g\n", __func__, kv+1, rc_kv);
+			}
+			if (kv < tc0->max_inc || (kv >= tc0->max_inc && cost < cost_best)) {
+				double t0 = tc0->prof? sann_prof_time() : 0.;
+				cost_best = cost;
+				sann_cpy(best, snap? snap : m);
+				n_cost_inc = 0, best_epoch = kv;
+				if (tc0->prof) sann_prof_add(tc0->prof, SANN_PH_COPY, 0, t0, sann_prof_time() - t0, 1);
+			} else if (cost > cost_best) {
+				if (++n_cost_inc > tc0->max_inc) {
+					stop = kv; // with background validation, epoch kv+1 has been trained; it is discarded
+					break;
 				}
 			}
-			memcpy(g_prev, g_curr, n_par * sizeof(float));
+			if (func && func(kv, cost, data)) {
+				stop = kv, halted = 1;
+				break;
+			}
+		}
+		if (last) break;
+		if (snap) {
+			sann_cpy(snap, m);
+			rc_kv = rc;
+			if ((job.task = sann_spawn(valid_worker, &job)) == 0) valid_worker(&job); // no idle pool thread
+			pending = 1;
+		}
+
+		sann_trainer_adjust(tr);
+		if (tc0->prof && sann_verbose >= 3) { // time (s) and calls of each phase in this epoch
+			fprintf(stderr, "[M::%s] epoch:%d time", __func__, k+1);
+			sann_prof_print(tc0->prof, &prof_last);
+			if (tc0->prof->hwc) {
+				fprintf(stderr, "\n[M::%s] epoch:%d hw", __func__, k+1);
+				sann_prof_hw_print(tc0->prof, &prof_last);
+			}
+			fputc('\n', stderr);
+			prof_last = *tc0->prof;
+		}
+
+		if (fn_ckpt && tc0->ckpt_intv > 0 && (k + 1) % tc0->ckpt_intv == 0) { // write the checkpoint in the background
+			if (writing) sann_join(cj.task);
+			c = (sann_ckpt_t*)calloc(1, sizeof(sann_ckpt_t));
+			c->epoch = k + 1, c->N = N, c->n_par = n_par;
+			c->n_cost_inc = n_cost_inc, c->best_epoch = best_epoch;
+			c->cost_best = cost_best, c->rc_pending = rc_kv;
+			sann_rng_get(c->rng);
+			c->m = sann_dup(m);
+			c->best = sann_fdup(n_par, best->t);
+			c->g_prev = sann_fdup(n_par, tr->g_prev);
+			c->h = sann_fdup(n_par, tr->h);
+			c->snap = pending? sann_fdup(n_par, snap->t) : 0;
+			c->n_steps = tr->n_steps;
+			c->moments = tc0->malgo == SANN_MIN_MINI_ADAM? sann_fdup(n_par * 2, tr->r) : 0;
+			if (tc0->balgo == SANN_MIN_BATCH_LBFGS) {
+				c->lbfgs = sann_fdup(SANN_LBFGS_M * 2 * n_par, tr->ds);
+				memcpy(c->rho, tr->rho, SANN_LBFGS_M * sizeof(double));
+				c->n_pairs = tr->n_pairs, c->head = tr->head;
+				c->gamma = tr->gamma, c->f = tr->f, c->rc = tr->rc;
+			}
+			cj.fn = fn_ckpt, cj.c = c;
+			if ((cj.task = sann_spawn(ckpt_worker, &cj)) == 0) ckpt_worker(&cj);
+			writing = 1;
 		}
 	}
-	if (k < tc0->n_epochs && sann_verbose >= 3)
-		fprintf(stderr, "[M::%s] stopped at epoch %d as validation cost hasn't been improved since epoch %d\n", __func__, k+1, best_epoch+1);
-	free(t_prev); free(h);
-	sann_cpy(m, best);
-	sann_destroy(best);
-	return k;
+	if (writing) sann_join(cj.task);
+	if (stop >= 0 && !halted && sann_verbose >= 3)
+		fprintf(stderr, "[M::%s] stopped at epoch %d as validation cost hasn't been improved since epoch %d\n", __func__, stop+1, best_epoch+1);
+	else if (stop == -1 && converged && sann_verbose >= 3)
+		fprintf(stderr, "[M::%s] L-BFGS converged after epoch %d\n", __func__, k);
+	sann_cpy(m, best); // roll back to the best snapshot
+	train_free(n_par, tr, best);
+	if (snap) sann_mem_move(SANN_MEM_BEST, SANN_MEM_PARAM, n_par);
+	sann_destroy(snap);
+	return stop != -1? stop : converged? k : tc0->n_epochs;
+}
+
+int sann_train_data(sann_t *m, const sann_tconf_t *tc, const sann_data_t *x, const sann_data_t *y)
+{
+	return sann_train_core(m, tc, x, y, 0, 0);
+}
+
+int sann_train(sann_t *m, const sann_tconf_t *tc, int N, float *const* x, float *const* y)
+{
+	sann_data_t *dx, *dy;
+	int ret;
+	dx = sann_data_view(N, sann_n_in(m), x);
+	dy = m->is_fnn? sann_data_view(N, sann_n_out(m), y) : 0;
+	ret = sann_train_data(m, tc, dx, dy);
+	sann_data_destroy(dx); sann_data_destroy(dy);
+	return ret;
+}
+
+/*************************
+ * Stacked autoencoders *
+ *************************/
+
+typedef struct {
+	const sann_t *m;
+	const sann_data_t *x;
+	sann_data_t *z;
+	float **buf; // per-thread working space
+} encode_shared_t;
+
+static void encode_worker(void *data, long blk, int tid)
+{
+	encode_shared_t *s = (encode_shared_t*)data;
+	const sann_t *m = s->m;
+	int i, st = blk * SANN_EVAL_BLOCK, en = st + SANN_EVAL_BLOCK < s->x->n? st + SANN_EVAL_BLOCK : s->x->n;
+	float *xbuf = s->buf[tid], *z = xbuf + sae_n_in(m);
+	for (i = st; i < en; ++i) {
+		sae_core_encode(sae_n_in(m), sae_n_hidden(m), m->t, m->af[0], sann_data_row(s->x, i, xbuf), z, m->scaled);
+		sann_data_set(s->z, i, z);
+	}
+}
+
+sann_data_t *sann_ae_encode(const sann_t *m, const sann_data_t *x, int type, int n_threads)
+{
+	encode_shared_t s;
+	int i, n_blk;
+	assert(!m->is_fnn && x->n_col == sae_n_in(m));
+	if (type == SANN_DT_U8 && m->af[0] != SANN_AF_SIGM) type = SANN_DT_F16; // the range is only known for the sigmoid
+	if ((s.z = sann_data_init(x->n, sae_n_hidden(m), type)) == 0) return 0;
+	if (type == SANN_DT_U8)
+		for (i = 0; i < sae_n_hidden(m); ++i)
+			s.z->offset[i] = 0.0f, s.z->scale[i] = 1.0f / 255.0f;
+	n_blk = (x->n + SANN_EVAL_BLOCK - 1) / SANN_EVAL_BLOCK;
+	if (n_threads > n_blk) n_threads = n_blk;
+	if (n_threads < 1) n_threads = 1;
+	s.m = m, s.x = x;
+	s.buf = (float**)calloc(n_threads, sizeof(float*));
+	for (i = 0; i < n_threads; ++i)
+		s.buf[i] = (float*)malloc((sae_n_in(m) + sae_n_hidden(m)) * sizeof(float));
+	sann_for(n_threads, encode_worker, &s, n_blk);
+	for (i = 0; i < n_threads; ++i) free(s.buf[i]);
+	free(s.buf);
+	return s.z;
+}
+
+sann_t *sann_stack_fnn(int n_ae, sann_t *const* ae, int n_out)
+{
+	int32_t *n_neurons;
+	int i, k;
+	float *q;
+	sann_t *m;
+	n_neurons = (int32_t*)alloca((n_ae + 2) * 4);
+	n_neurons[0] = sae_n_in(ae[0]), n_neurons[n_ae+1] = n_out;
+	for (k = 0; k < n_ae; ++k) {
+		if (ae[k]->is_fnn || (k > 0 && sae_n_in(ae[k]) != sae_n_hidden(ae[k-1]))) return 0;
+		n_neurons[k+1] = sae_n_hidden(ae[k]);
+	}
+	m = sann_init_fnn(n_ae + 2, n_neurons); // the output layer keeps random weights
+	for (k = 0, q = m->t; k < n_ae; ++k) { // each layer has n_neurons[k+1] biases followed by the weights
+		int n_in = sae_n_in(ae[k]), n_hidden = sae_n_hidden(ae[k]);
+		float a01 = ae[k]->scaled == SAE_SC_SQRT? 1. / sqrt(n_in) : ae[k]->scaled == SAE_SC_FULL? 1. / n_in : 1.;
+		const float *b1, *b2, *w10;
+		sae_par2ptr(n_in, n_hidden, ae[k]->t, &b1, &b2, &w10);
+		memcpy(q, b1, n_hidden * sizeof(float));
+		q += n_hidden;
+		for (i = 0; i < n_in * n_hidden; ++i) // FNN weights are not scaled
+			q[i] = a01 * w10[i];
+		q += n_in * n_hidden;
+		m->af[k] = ae[k]->af[0];
+	}
+	return m;
 }
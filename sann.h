@@ -8,15 +8,51 @@
 //! mini-batch minimization algorithm
 #define SANN_MIN_MINI_SGD     1
 #define SANN_MIN_MINI_RMSPROP 2
+#define SANN_MIN_MINI_ADAM    3  //! Adam with decoupled weight decay, aka. AdamW
 
 //! how to adjust learning rate after an entire batch
 #define SANN_MIN_BATCH_FIXED  1  //! fixed learning rate
 #define SANN_MIN_BATCH_RPROP  2  //! iRprop- (Igel and Husken, 2000)
+#define SANN_MIN_BATCH_LBFGS  3  //! full-batch L-BFGS with backtracking line search, in place of minibatches
 
 //! activation functions
 #define SANN_AF_SIGM     1  //! sigmoid
 #define SANN_AF_TANH     2  //! tanh
 #define SANN_AF_ReLU     3  //! rectified linear, aka. ReLU
+#define SANN_AF_SOFTMAX  4  //! softmax with categorical cross-entropy; FNN output layer only
+#define SANN_AF_LINEAR   5  //! identity, for low-rank bottlenecks
+
+//! storage types of in-memory samples
+#define SANN_DT_F32      0  //! 32-bit float
+#define SANN_DT_U8       1  //! 8-bit unsigned integer with a per-column scale and offset
+#define SANN_DT_F16      2  //! IEEE 754 half-precision float
+
+//! phases timed by sann_prof_t
+#define SANN_PH_LOAD     0  //! reading data and models
+#define SANN_PH_SHUFFLE  1  //! shuffling samples
+#define SANN_PH_GATHER   2  //! packing samples into minibatches
+#define SANN_PH_FORWARD  3  //! forward pass
+#define SANN_PH_BACKWARD 4  //! backward pass
+#define SANN_PH_UPDATE   5  //! optimizer updates
+#define SANN_PH_VALID    6  //! validation
+#define SANN_PH_COPY     7  //! copying the best model
+#define SANN_PH_DUMP     8  //! writing models and outputs
+#define SANN_N_PH        9
+
+//! hardware events counted by sann_prof_hw_open()
+#define SANN_HW_CYCLES    0  //! CPU cycles
+#define SANN_HW_INSTR     1  //! retired instructions
+#define SANN_HW_LLC_MISS  2  //! last-level cache misses
+#define SANN_HW_DTLB_MISS 3  //! data TLB load misses
+#define SANN_N_HW         4
+
+//! categories of memory tracked by sann_mem_add()
+#define SANN_MEM_DATA    0  //! samples and their names
+#define SANN_MEM_PARAM   1  //! model parameters
+#define SANN_MEM_OPT     2  //! gradients and minibatch optimizer states
+#define SANN_MEM_BATCH   3  //! previous parameters, gradients and step sizes for the batch algorithm
+#define SANN_MEM_BEST    4  //! copies of the model at the best epoch and under background validation
+#define SANN_N_MEM       5
 
 //! autoencoder scaling
 #define SAE_SC_NONE     0   //! no scaling (standard autoencoder)
@@ -38,14 +74,33 @@
 //! verbose level. 0: no stderr output; 1: error only; 2: error+warning; 3: error+warning+message (default)
 extern int sann_verbose;
 
+//! time spent in each phase; see sann_prof_init()
+typedef struct {
+	int64_t ns[SANN_N_PH]; //! accumulated wall-clock time in nanoseconds
+	int64_t n[SANN_N_PH];  //! number of calls, or of samples for forward and backward passes
+	void *trace;           //! recorded events; NULL if not tracing
+	int64_t hw[SANN_N_PH][SANN_N_HW]; //! hardware event counts in the thread that opened them
+	void *hwc;             //! open hardware counters; NULL if not counting
+} sann_prof_t;
+
+//! connections to other processes for data-parallel training
+typedef struct sann_dist_s sann_dist_t;
+
+//! weights of a pruned layer in the compressed sparse row format
+typedef struct sann_csr_s sann_csr_t;
+
+//! working space and optimizer states for training a model step by step
+typedef struct sann_trainer_s sann_trainer_t;
+
 //! SANN model
 typedef struct {
 	int32_t is_fnn;     //! whether the model is FNN or AE 
 	int32_t scaled;     //! how to scale the weight; valid values defined by SAE_SC_* macros (AE only)
 	int32_t n_layers;   //! number of layers; always 3 for autoencoder
 	int32_t *n_neurons; //! n_neurons[k] is the number of neurons at layer k; of size $n_layers
-	int32_t *af;        //! af[k] is the activation function at layer k+1; values defined by SANN_AF_*; output MUST BE sigmoid
+	int32_t *af;        //! af[k] is the activation function at layer k+1; values defined by SANN_AF_*; output MUST BE sigmoid or softmax
 	float *t;           //! array of all parameters; size computed by function sann_n_par()
+	sann_csr_t **csr;   //! csr[k] is the sparse copy of the weights at layer k+1 if pruned; NULL if no layer is pruned
 } sann_t;
 
 //! training parameters
@@ -63,13 +118,37 @@ typedef struct {
 	int malgo;          //! mini-batch minimization algorithm; values defined by SANN_MIN_MINI_* macros
 	int mini_batch;     //! mini-batch size
 	float decay;        //! for RMSprop
+	float beta1, beta2; //! exponential decay rates of the first and second moments for Adam
+	float wd;           //! decoupled weight decay for Adam
 
 	// optimizer for complete batches
 	int balgo;          //! complete-batch minimization algorithm; values defined by SANN_MIN_BATCH_* macros
 	float h_min, h_max; //! min and max learning rate for iRprop-
 	float rprop_dec, rprop_inc; //! learning rate adjusting factors for iRprop-
+
+	int n_threads;      //! number of threads; with >1, the next minibatch is gathered on a pool thread, or L-BFGS splits the samples across threads
+
+	// checkpointing
+	const char *fn_ckpt; //! checkpoint file; NULL to disable checkpointing
+	int ckpt_intv;      //! write a checkpoint every $ckpt_intv epochs
+	int resume;         //! continue from $fn_ckpt if it exists
+
+	sann_prof_t *prof;  //! if not NULL, accumulate time spent in each phase and print it after each epoch
+
+	// data-parallel training across processes
+	sann_dist_t *dist;  //! created by sann_dist_init(); NULL for single-process training
+	int sync_intv;      //! average parameters across processes every $sync_intv minibatches and at the end of each epoch
 } sann_tconf_t;
 
+//! samples in compact storage
+typedef struct {
+	int32_t n, n_col;   //! number of samples and number of values per sample
+	int32_t type;       //! storage type; values defined by SANN_DT_*
+	float *scale, *offset; //! value = offset[j] + scale[j] * row[i][j]; of size $n_col; SANN_DT_U8 only
+	void **row;         //! row[i] points to $n_col values of $type
+	void *mem;          //! contiguous storage of all rows; NULL if rows are not owned
+} sann_data_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -116,7 +195,7 @@ int sann_n_par(const sann_t *m);
  *
  * @param m          the model
  * @param x          input, an array of size sann_n_in(m)
- * @param y          output, an array of size sann_n_out(m)
+ * @param y          output, an array of size sann_n_out(m); may be NULL for an autoencoder if only z is needed
  * @param z          hidden activation, an array of size sae_n_hidden(m) - autoencoder only; use NULL for FNN
  */
 void sann_apply(const sann_t *m, const float *x, float *y, float *z);
@@ -151,16 +230,365 @@ void sann_tconf_init(sann_tconf_t *t, int balgo, int malgo);
  * validation samples. To avoid batch effect, it is highly recommended to
  * shuffle the input with sann_data_shuffle() before calling this function.
  *
+ * If $tc->fn_ckpt is set, the model, the optimizer states and the state of
+ * the random number generator are written to $tc->fn_ckpt in the background
+ * every $tc->ckpt_intv epochs. With $tc->resume, training continues exactly
+ * where the checkpoint was written, provided the same data are used.
+ *
  * @param m          the model
  * @param tc         traning parameters
  * @param N          number of samples
  * @param x          input data; x[i] is a vector of size sann_n_in(m)
  * @param y          truth output data; NULL for autoencoder; for FNN, y[i] is a vector of size sann_n_out(m)
  *
- * @return number of epochs
+ * @return number of epochs; -1 if the checkpoint to resume from does not match; -2 if a process is lost
  */
 int sann_train(sann_t *m, const sann_tconf_t *tc, int N, float *const* x, float *const* y);
 
+/**
+ * Train for multiple epochs on samples in compact storage
+ *
+ * This function is the same as sann_train() except that samples may be
+ * stored as 8-bit integers or half-precision floats (see sann_data_pack()).
+ * Samples are converted to 32-bit floats on the fly.
+ *
+ * @param m          the model
+ * @param tc         traning parameters
+ * @param x          input data; x->n_col must equal sann_n_in(m)
+ * @param y          truth output data; NULL for autoencoder
+ *
+ * @return number of epochs
+ */
+int sann_train_data(sann_t *m, const sann_tconf_t *tc, const sann_data_t *x, const sann_data_t *y);
+
+/**
+ * Initialize a trainer for callers that drive their own training loop
+ *
+ * All working space is allocated here, such that sann_trainer_step() and
+ * sann_trainer_epoch() don't allocate memory. Unlike sann_train(), the
+ * trainer does not validate, stop early or roll back to the best epoch.
+ *
+ * @param m          the model, updated in place; it must outlive the trainer
+ * @param tc         training parameters; copied
+ * @param max_n      max number of samples in an epoch
+ *
+ * @return pointer to the trainer; NULL if out of memory
+ */
+sann_trainer_t *sann_trainer_init(sann_t *m, const sann_tconf_t *tc, int max_n);
+
+/**
+ * Deallocate a trainer
+ *
+ * @param tr         the trainer
+ */
+void sann_trainer_destroy(sann_trainer_t *tr);
+
+/**
+ * Take one minibatch step on samples [st,st+n) in order
+ *
+ * @param tr         the trainer
+ * @param x          input data
+ * @param y          truth output data; NULL for autoencoder
+ * @param st         index of the first sample
+ * @param n          number of samples; at most tc->mini_batch are used
+ *
+ * @return averaged cost of the minibatch before the update
+ */
+float sann_trainer_step(sann_trainer_t *tr, const sann_data_t *x, const sann_data_t *y, int st, int n);
+
+/**
+ * Train for one epoch on the first $n samples, in a random order
+ *
+ * The order of $x and $y is not changed. With SANN_MIN_BATCH_LBFGS, an epoch
+ * is one L-BFGS iteration on the exact gradient of all $n samples, which
+ * takes one pass over the samples per line search step. Once no step along
+ * the gradient decreases the cost, L-BFGS has converged and later epochs
+ * leave the model unchanged; sann_train() stops there.
+ *
+ * @param tr         the trainer
+ * @param n          number of samples; at most $max_n given to sann_trainer_init()
+ * @param x          input data
+ * @param y          truth output data; NULL for autoencoder
+ *
+ * @return running cost of the epoch; with SANN_MIN_BATCH_LBFGS, the cost
+ *                   after the iteration
+ */
+float sann_trainer_epoch(sann_trainer_t *tr, int n, const sann_data_t *x, const sann_data_t *y);
+
+/**
+ * Adjust per-parameter learning rates with iRprop- after an epoch
+ *
+ * No-op unless tc->balgo is SANN_MIN_BATCH_RPROP.
+ *
+ * @param tr         the trainer
+ */
+void sann_trainer_adjust(sann_trainer_t *tr);
+
+/**
+ * Compute the hidden layer of an autoencoder for all samples
+ *
+ * The result can be used to train the next autoencoder in a stack, such that
+ * lower layers are evaluated once rather than in every epoch.
+ *
+ * @param m          the autoencoder
+ * @param x          samples
+ * @param type       storage type of the result; SANN_DT_U8 is only used with
+ *                   the sigmoid hidden activation and falls back to SANN_DT_F16
+ * @param n_threads  number of threads
+ *
+ * @return hidden activations, of dimension sae_n_hidden(m)
+ */
+sann_data_t *sann_ae_encode(const sann_t *m, const sann_data_t *x, int type, int n_threads);
+
+/**
+ * Initialize an FNN with the encoders of stacked autoencoders
+ *
+ * Hidden layer k of the FNN takes the weights, biases and activation of the
+ * hidden layer of $ae[k]; the output layer is randomly initialized.
+ *
+ * @param n_ae       number of autoencoders
+ * @param ae         autoencoders; the input of $ae[k] is the hidden layer of $ae[k-1]
+ * @param n_out      number of output neurons
+ *
+ * @return the FNN, with $n_ae+2 layers; NULL if the autoencoders can't be stacked
+ */
+sann_t *sann_stack_fnn(int n_ae, sann_t *const* ae, int n_out);
+
+/**
+ * Prune the weights of smallest magnitude at one FNN layer
+ *
+ * Pruned weights are set to zero and the remaining weights are kept in the
+ * compressed sparse row format. This is used by sann_apply() and written by
+ * sann_dump(). Later training keeps pruned weights at zero. Biases are not
+ * pruned.
+ *
+ * @param m          the FNN
+ * @param k          layer, from 1 to $m->n_layers-1
+ * @param sparsity   fraction of weights set to zero, in [0,1)
+ *
+ * @return number of weights kept; -1 if $m is not an FNN or $k or $sparsity is out of range
+ */
+int sann_prune(sann_t *m, int k, float sparsity);
+
+/**
+ * Replace the weights of one FNN layer with a low-rank approximation
+ *
+ * The weight matrix W of layer $k is approximated by U*V with a truncated SVD
+ * computed by subspace iteration. V becomes a new hidden layer of $r neurons
+ * with the linear activation and no biases, followed by U with the biases and
+ * the activation of the original layer. This reduces multiply-adds at layer
+ * $k from n*m to r*(n+m). Pruned layers are not kept sparse in the result.
+ *
+ * @param m          the FNN
+ * @param k          layer, from 1 to $m->n_layers-1
+ * @param r          rank
+ * @param n_iter     number of subspace iterations; 0 for the default
+ * @param rel_err    if not NULL, set to the relative Frobenius error of U*V
+ *
+ * @return a new FNN with $m->n_layers+1 layers; NULL if $m is not an FNN or
+ *         $k or $r is out of range
+ */
+sann_t *sann_factorize(const sann_t *m, int k, int r, int n_iter, float *rel_err);
+
+/**
+ * Connect to other processes for data-parallel training
+ *
+ * Process $rank listens on $addr[$rank] and connects to process $rank+1,
+ * forming a ring. This function blocks until both neighbors are connected.
+ * To train across processes, set sann_tconf_t::dist to the returned value.
+ * Each process then trains on its own samples; the parameters are averaged
+ * every sann_tconf_t::sync_intv minibatches. Only process 0 holds validation
+ * samples and all processes stop at the same epoch. Checkpointing is disabled.
+ *
+ * @param rank       index of this process, in [0,$n)
+ * @param n          number of processes
+ * @param addr       "host:port" of each process; of size $n
+ *
+ * @return connections, or NULL on failure
+ */
+sann_dist_t *sann_dist_init(int rank, int n, char *const* addr);
+
+/**
+ * Close connections to other processes
+ *
+ * @param d          connections created by sann_dist_init()
+ */
+void sann_dist_destroy(sann_dist_t *d);
+
+/**
+ * Initialize profiling counters
+ *
+ * Set sann_tconf_t::prof to the returned value to time the phases of
+ * sann_train(). Other phases can be timed with sann_prof_add().
+ *
+ * @param trace      record each timed interval for sann_prof_trace()
+ *
+ * @return counters, all zero
+ */
+sann_prof_t *sann_prof_init(int trace);
+
+/**
+ * Deallocate profiling counters
+ *
+ * @param p          counters
+ */
+void sann_prof_destroy(sann_prof_t *p);
+
+/**
+ * Monotonic wall-clock time in seconds, for use with sann_prof_add()
+ */
+double sann_prof_time(void);
+
+/**
+ * Add a timed interval to a phase; thread-safe
+ *
+ * @param p          counters; no-op if NULL
+ * @param phase      phase; values defined by SANN_PH_*
+ * @param tid        thread shown in the trace
+ * @param t0         start time from sann_prof_time()
+ * @param dur        duration in seconds
+ * @param n          number of calls or samples
+ */
+void sann_prof_add(sann_prof_t *p, int phase, int tid, double t0, double dur, int n);
+
+/**
+ * Name of a phase
+ */
+const char *sann_prof_name(int phase);
+
+/**
+ * Print time and calls of each phase to stderr, on the same line
+ *
+ * @param p          counters
+ * @param prev       earlier copy of the counters, to print the difference; NULL to print totals
+ */
+void sann_prof_print(const sann_prof_t *p, const sann_prof_t *prev);
+
+/**
+ * Write recorded intervals in the Chrome trace-event JSON format
+ *
+ * @param fn         output file name
+ * @param p          counters created with $trace set
+ *
+ * @return 0 on success; -1 on failure
+ */
+int sann_prof_trace(const char *fn, const sann_prof_t *p);
+
+/**
+ * Count hardware events in the calling thread with Linux perf_event_open()
+ *
+ * Once opened, sann_train() attributes the events of forward and backward
+ * passes and optimizer updates to their phases. Only the calling thread is
+ * counted; work done by helper threads is not. Counting slows down training
+ * with small models as counters are read for each sample.
+ *
+ * @param p          counters
+ *
+ * @return bit k set if event k is available; 0 if hardware counters are unavailable
+ */
+int sann_prof_hw_open(sann_prof_t *p);
+
+/**
+ * Stop counting hardware events; called by sann_prof_destroy()
+ */
+void sann_prof_hw_close(sann_prof_t *p);
+
+/**
+ * Read the current hardware event counts of the thread that opened them
+ *
+ * @param p          counters
+ * @param v          (out) count of each event; 0 for unavailable events
+ *
+ * @return 0 on success; -1 if not counting
+ */
+int sann_prof_hw_read(const sann_prof_t *p, int64_t v[SANN_N_HW]);
+
+/**
+ * Add hardware events between two reads to a phase; thread-safe
+ *
+ * @param p          counters; no-op if NULL or not counting
+ * @param phase      phase; values defined by SANN_PH_*
+ * @param v0         counts read at the start
+ * @param v1         counts read at the end
+ */
+void sann_prof_hw_add(sann_prof_t *p, int phase, const int64_t v0[SANN_N_HW], const int64_t v1[SANN_N_HW]);
+
+/**
+ * Print instructions per cycle and cache and TLB misses per sample of each phase to stderr
+ *
+ * Misses are divided by the number of samples in the forward phase over the
+ * same period. Unavailable events are printed as NA.
+ *
+ * @param p          counters
+ * @param prev       earlier copy of the counters, to print the difference; NULL to print totals
+ */
+void sann_prof_hw_print(const sann_prof_t *p, const sann_prof_t *prev);
+
+/**
+ * Account for memory allocated or freed; thread-safe
+ *
+ * libsann calls this for the allocations listed by SANN_MEM_*. Vectors from
+ * sann_data_read() are released by sann_free_vectors(); rows or names freed
+ * individually are not, unless the caller accounts for them.
+ *
+ * @param cat        category; values defined by SANN_MEM_*
+ * @param size       bytes allocated; negative for freed
+ */
+void sann_mem_add(int cat, int64_t size);
+
+/**
+ * Memory in use or at the peak
+ *
+ * @param cat        category; negative for the total
+ * @param peak       return the peak instead of the current usage
+ *
+ * @return bytes
+ */
+int64_t sann_mem_usage(int cat, int peak);
+
+/**
+ * Print memory usage of each category, in MB, to stderr on the same line
+ *
+ * @param peak       print the peak of each category instead of the current usage
+ */
+void sann_mem_print(int peak);
+
+/**
+ * Estimate memory allocated by sann_train_data() on top of the model and the samples
+ *
+ * @param tc         training parameters
+ * @param n_par      number of model parameters
+ * @param n          number of samples
+ *
+ * @return bytes
+ */
+int64_t sann_mem_train(const sann_tconf_t *tc, int n_par, int n);
+
+/**
+ * Set the size of the thread pool shared by all parallel work in libsann
+ *
+ * The number of threads given to a function or in sann_tconf_t is capped by
+ * the pool size. Without this call, the pool is created on the first parallel
+ * loop with the number of threads requested there. A loop started inside
+ * another loop, or while the pool is busy with a loop from another thread,
+ * runs in its calling thread. Training helpers (minibatch gathering,
+ * background validation and checkpoint writing) run on idle pool threads, or
+ * in the calling thread if none is idle. This function may be called from any
+ * thread; it waits until the running loops and helpers are finished, so it
+ * must not be called from inside a loop.
+ *
+ * @param n_threads  number of threads, including the calling thread; 1 or 0 to stop the pool
+ * @param pin        pin the i-th pool thread to the i-th CPU (Linux only)
+ */
+void sann_set_threads(int n_threads, int pin);
+
+/**
+ * Size of the shared thread pool
+ *
+ * @return number of threads; 1 if no pool is running
+ */
+int sann_get_threads(void);
+
 /**
  * Compute the per-neuron cost given truth
  *
@@ -173,6 +601,34 @@ int sann_train(sann_t *m, const sann_tconf_t *tc, int N, float *const* x, float
  */
 float sann_evaluate(const sann_t *m, int n, float *const* x, float *const* y);
 
+/**
+ * Compute the per-neuron cost of the first $n samples in compact storage
+ *
+ * @param m          the model
+ * @param n          number of samples
+ * @param x          input data
+ * @param y          truth output; NULL for autoencoder
+ *
+ * @return averaged sigmoid cost per sample per output neuron
+ */
+float sann_evaluate_data(const sann_t *m, int n, const sann_data_t *x, const sann_data_t *y);
+
+/**
+ * Apply the model to all samples in compact storage
+ *
+ * Samples are processed in blocks on multiple threads. With the result as
+ * the target, a smaller FNN can be trained to mimic $m (see sann distill).
+ *
+ * @param m          the model
+ * @param x          input data; x->n_col must equal sann_n_in(m)
+ * @param type       storage type of the result; values defined by SANN_DT_*;
+ *                   SANN_DT_U8 needs a sigmoid, softmax or tanh output
+ * @param n_threads  number of threads
+ *
+ * @return output of $m, of dimension sann_n_out(m); NULL if $type can't hold the output
+ */
+sann_data_t *sann_predict(const sann_t *m, const sann_data_t *x, int type, int n_threads);
+
 /**
  * Save the model
  *
@@ -199,6 +655,10 @@ sann_t *sann_restore(const char *fn, char ***cnames_in, char ***cnames_out);
 /**
  * Read data from file in the SANN data format (SND)
  *
+ * IDX files of unsigned bytes, such as the MNIST images and labels, are also
+ * accepted. Images are scaled to [0,1] and labels become one-hot vectors with
+ * as many columns as the largest label plus one.
+ *
  * @param fn         file name
  * @param n_rows     number of samples
  * @param n_cols     number of data columns
@@ -219,6 +679,121 @@ float **sann_data_read(const char *fn, int *n_rows, int *n_cols, char ***row_nam
  */
 void sann_data_shuffle(int n, float **x, float **y, char **names);
 
+/**
+ * Convert 32-bit float vectors to compact storage
+ *
+ * With SANN_DT_U8, each column is linearly mapped to [0,255] between its
+ * minimum and maximum. Values of pixels/255 or 0/1 labels are kept exactly.
+ *
+ * @param n          number of vectors
+ * @param n_col      dimension of each vector
+ * @param x          input vectors; not modified
+ * @param type       storage type; values defined by SANN_DT_*
+ *
+ * @return samples in compact storage
+ */
+sann_data_t *sann_data_pack(int n, int n_col, float *const* x, int type);
+
+/**
+ * Read an SND file directly into compact storage
+ *
+ * Unlike sann_data_read() followed by sann_data_pack(), samples are never
+ * held as 32-bit floats. The file is read twice, so it can't be stdin. IDX
+ * pixels are copied to SANN_DT_U8 storage without conversion.
+ *
+ * @param fn         file name
+ * @param type       storage type; values defined by SANN_DT_*
+ * @param row_names  (out) row names; can be NULL
+ * @param col_names  (out) column names if present; can be NULL
+ *
+ * @return samples in compact storage; NULL on failure
+ */
+sann_data_t *sann_data_read_packed(const char *fn, int type, char ***row_names, char ***col_names);
+
+/**
+ * Count the samples in an SND file without keeping them
+ *
+ * @param fn         file name; can't be stdin
+ * @param n          (out) number of samples
+ * @param n_col      (out) dimension of each vector
+ * @param name_size  (out) bytes needed to keep the row names
+ *
+ * @return 0 on success; -1 if $fn is stdin
+ */
+int sann_data_scan(const char *fn, int *n, int *n_col, int64_t *name_size);
+
+/**
+ * Memory used by samples in a storage type, as allocated by sann_data_pack()
+ *
+ * For SANN_DT_F32, this also equals the memory of vectors from sann_data_read().
+ *
+ * @param n          number of samples
+ * @param n_col      dimension of each vector
+ * @param type       storage type; values defined by SANN_DT_*
+ *
+ * @return bytes
+ */
+int64_t sann_data_mem(int n, int n_col, int type);
+
+/**
+ * Allocate compact storage
+ *
+ * With SANN_DT_U8, set d->scale and d->offset before sann_data_set().
+ *
+ * @param n          number of samples
+ * @param n_col      dimension of each vector
+ * @param type       storage type; values defined by SANN_DT_*
+ *
+ * @return samples, uninitialized; NULL if $type is unknown
+ */
+sann_data_t *sann_data_init(int n, int n_col, int type);
+
+/**
+ * Set a sample in compact storage
+ *
+ * @param d          samples
+ * @param i          index of the sample
+ * @param x          vector of size d->n_col
+ */
+void sann_data_set(sann_data_t *d, int i, const float *x);
+
+/**
+ * Save samples in compact storage to a binary file
+ *
+ * @param fn         file name; NULL or "-" for stdout
+ * @param d          samples
+ *
+ * @return 0 on success; -1 on failure
+ */
+int sann_data_dump(const char *fn, const sann_data_t *d);
+
+/**
+ * Read samples saved by sann_data_dump()
+ *
+ * @param fn         file name; NULL or "-" for stdin
+ *
+ * @return samples; NULL on failure
+ */
+sann_data_t *sann_data_restore(const char *fn);
+
+/**
+ * Get a sample as a 32-bit float vector
+ *
+ * @param d          samples
+ * @param i          index of the sample
+ * @param buf        buffer of size d->n_col, used if conversion is needed
+ *
+ * @return pointer to the vector; either d->row[i] or $buf
+ */
+const float *sann_data_row(const sann_data_t *d, int i, float *buf);
+
+/**
+ * Deallocate samples in compact storage
+ *
+ * @param d          samples
+ */
+void sann_data_destroy(sann_data_t *d);
+
 /**
  * Free a list of names
  *
@@ -14,6 +14,8 @@ typedef const char *ccstr_p;
 
 typedef float (*sann_activate_f)(float t, float *deriv);
 typedef void (*sann_gradient_f)(int n, const float *x, float *gradient, void *data);
+typedef int (*sann_epoch_f)(int epoch, float cost, void *data); // called after each validated epoch; return non-zero to stop
+typedef struct sann_reader_s sann_reader_t; // streaming SND reader in data.c
 
 typedef struct sfnn_buf_t {
 	cfloat_p *w, *b;
@@ -22,6 +24,41 @@ typedef struct sfnn_buf_t {
 	float **out, **deriv, **delta;
 } sfnn_buf_t;
 
+#define SANN_LBFGS_M  10   // number of curvature pairs kept by L-BFGS
+
+typedef struct {
+	int32_t epoch;        // number of finished epochs
+	int32_t N, n_par;     // number of samples and parameters, for sanity checks
+	int32_t n_cost_inc, best_epoch;
+	float cost_best, rc_pending;
+	uint64_t rng[2];      // state of the random number generator
+	sann_t *m;            // model after $epoch epochs
+	float *best, *g_prev; // parameters of the best model; last update for iRprop-
+	float *h;             // per-parameter learning rates for iRprop-; NULL if not used
+	float *snap;          // snapshot under validation; NULL if not pending
+	int64_t n_steps;      // number of minibatch steps taken by Adam
+	float *moments;       // first and second moments for Adam, of size 2*n_par; NULL if not used
+	float *lbfgs;         // L-BFGS parameter and gradient changes, of size 2*SANN_LBFGS_M*n_par; NULL if not used
+	int32_t n_pairs, head; // number of L-BFGS pairs and the slot of the next one
+	double rho[SANN_LBFGS_M], gamma, f, rc; // the rest of the L-BFGS state, as in the trainer
+} sann_ckpt_t;
+
+struct sann_dist_s {
+	int rank, n;          // index of this process and number of processes
+	int fd_next, fd_prev; // sockets to the next and the previous process in the ring
+	int err;              // set once a connection is lost
+	int m_buf;
+	float *buf;
+};
+
+struct sann_csr_s {
+	int32_t n_rows, n_cols; // number of neurons at this layer and at the layer below
+	int32_t nnz;            // number of weights kept
+	int32_t *row;           // weights of neuron j are at [row[j],row[j+1]); of size n_rows+1
+	int32_t *col;           // input of each weight
+	float *val;             // weights; the same as in sann_t::t after sann_csr_sync()
+};
+
 #define sae_n_par(n_in, n_hidden) ((n_in) * (n_hidden) + (n_in) + (n_hidden))
 #define sae_par2ptr(n_in, n_hidden, p, b1, b2, w) (*(b1) = (p), *(b2) = (p) + (n_hidden), *(w) = (p) + (n_hidden) + (n_in))
 #define sae_buf_size(n_in, n_hidden) (3 * (n_in) + 2 * (n_hidden))
@@ -33,26 +70,99 @@ extern "C" {
 float sann_sigm(float x, float *deriv);
 float sann_tanh(float x, float *deriv);
 float sann_reclin(float x, float *deriv);
+float sann_linear(float x, float *deriv);
 
 sann_activate_f sann_get_af(int type);
 float sann_sigm_cost(float y0, float y);
+void sann_softmax(int n, const float *z, float *p, float *logp);
+void sann_activate(int type, int n, float *x, float *tmp);
+void sann_softmax_scalar(int n, const float *z, float *p, float *logp);
+float sann_softmax_cost(int n, const float *y0, const float *logp);
 
 double sann_normal(int *iset, double *gset);
+void sann_rng_get(uint64_t s[2]);
+void sann_rng_set(const uint64_t s[2]);
 
 float sann_sdot(int n, const float *x, const float *y);
 void sann_saxpy(int n, float a, const float *x, float *y);
+float sann_sdot_scalar(int n, const float *x, const float *y);
+void sann_saxpy_scalar(int n, float a, const float *x, float *y);
+
+void sann_SGD_update(int n, float h, float a, float l2, float *t, const float *g);
+void sann_RMSprop_update(int n, float h0, const float *h, float decay, float a, float l2, float *t, const float *g, float *r);
+void sann_Adam_update(int n, float h0, const float *h, float beta1, float beta2, float wd, int64_t step, float a, float l2, float *t, const float *g, float *m1, float *m2);
+void sann_iRprop(int n, int first, float inc, float dec, float h_min, float h_max, const float *t, float *t_prev, float *g_prev, float *h);
+
+void sann_SGD_update_scalar(int n, float h, float a, float l2, float *t, const float *g);
+void sann_RMSprop_update_scalar(int n, float h0, const float *h, float decay, float a, float l2, float *t, const float *g, float *r);
+void sann_Adam_update_scalar(int n, float h0, const float *h, float beta1, float beta2, float wd, int64_t step, float a, float l2, float *t, const float *g, float *m1, float *m2);
+void sann_iRprop_scalar(int n, int first, float inc, float dec, float h_min, float h_max, const float *t, float *t_prev, float *g_prev, float *h);
 
 void sann_SGD(int n, float h, float *t, float *g, sann_gradient_f func, void *data);
 void sann_RMSprop(int n, float h0, const float *h, float decay, float *t, float *g, float *r, sann_gradient_f func, void *data);
+void sann_Adam(int n, float h0, const float *h, float beta1, float beta2, float wd, int64_t step, float *t, float *g, float *m1, float *m2, sann_gradient_f func, void *data);
+
+int sann_train_core(sann_t *m, const sann_tconf_t *tc, const sann_data_t *x, const sann_data_t *y, sann_epoch_f func, void *data);
+float sann_evaluate_range(const sann_t *m, int st, int en, const sann_data_t *x, const sann_data_t *y, int n_threads);
+void sann_cpy(sann_t *d, const sann_t *m);
+sann_t *sann_dup(const sann_t *m);
+
+int sann_ckpt_dump(const char *fn, const sann_ckpt_t *c);
+sann_ckpt_t *sann_ckpt_restore(const char *fn);
+void sann_ckpt_destroy(sann_ckpt_t *c);
+
+int sann_dist_allreduce(sann_dist_t *d, int n, float *x);
+int sann_dist_average(sann_dist_t *d, int n, float *x);
+int sann_dist_bcast(sann_dist_t *d, int n, float *x);
+int sann_dist_min(sann_dist_t *d, int x);
+
+void sann_pool_reserve(int n_threads);
+void sann_for(int n_threads, void (*func)(void*,long,int), void *data, long n);
+void *sann_spawn(void (*func)(void*), void *data); // run $func on an idle pool thread; NULL if there is none
+void sann_join(void *task);
+
+sann_data_t *sann_data_view(int n, int n_col, float *const* x);
+const float *sann_data_decode(const sann_data_t *d, const void *r, float *buf);
+int sann_data_idx_dim(const char *fn);
+int sann_data_header(const char *fn, int *n_col, char ***col_names); // from the first row only; -1 if there is none
+
+// as the readers without _nl, but IDX labels get $n_label one-hot columns (0 for the largest label plus one); a label that doesn't fit is an error
+float **sann_data_read_nl(const char *fn, int n_label, int *n_rows, int *n_cols, char ***row_names, char ***col_names);
+sann_data_t *sann_data_read_packed_nl(const char *fn, int type, int n_label, char ***row_names, char ***col_names);
+int sann_data_scan_nl(const char *fn, int n_label, int *n, int *n_col, int64_t *name_size);
+
+sann_reader_t *sann_reader_open(const char *fn);
+void sann_reader_close(sann_reader_t *r);
+int sann_reader_is_bin(const sann_reader_t *r);
+const char *sann_reader_next_text(sann_reader_t *r, int *n_col, int *len);
+const float *sann_reader_next(sann_reader_t *r, int *n_col, const char **name);
+char *const* sann_reader_col_names(const sann_reader_t *r);
+
+sann_csr_t *sann_csr_init(int n_rows, int n_cols, int nnz);
+void sann_csr_destroy(sann_csr_t *a);
+void sann_csr_free(sann_t *m);
+void sann_csr_cpy(sann_t *d, const sann_t *m);
+void sann_csr_sync(sann_t *m);
+void sann_csr_mask(const sann_t *m, float *g);
+const float *sfnn_sparse_infer(const sann_t *m, cfloat_p x, float *buf);
+int sfnn_sparse_buf_size(const sann_t *m, int n);
+void sfnn_sparse_forward_block(const sann_t *m, int n, const float *const* x, float *buf, float **y, float **logp);
 
 void sae_core_randpar(int n_in, int n_hidden, float *t, int scaled);
 void sae_core_forward(int n_in, int n_hidden, const float *t, sann_activate_f f1, sann_activate_f f2, float r, const float *x, float *z, float *y, float *deriv1, int scaled);
 void sae_core_backprop(int n_in, int n_hidden, const float *t, sann_activate_f f1, sann_activate_f f2, float r, const float *x, float *d, float *buf, int scaled);
+void sae_core_encode(int n_in, int n_hidden, const float *t, int af, const float *x, float *z, int scaled);
+void sae_core_decode(int n_in, int n_hidden, const float *t, const float *z, float *y, int scaled);
+void sae_core_train_forward(int n_in, int n_hidden, const float *t, sann_activate_f f1, sann_activate_f f2, float r, const float *x, float *buf, int scaled);
+void sae_core_backward(int n_in, int n_hidden, const float *t, float r, const float *x, float *d, float *buf, int scaled);
 
 void sfnn_core_randpar(int n_layers, const int32_t *n_neurons, float *t);
 void sfnn_core_forward(int n_layers, const int32_t *n_neurons, const int32_t *af, float r_in, float r_hidden, cfloat_p t, cfloat_p x, sfnn_buf_t *b);
+void sfnn_core_backward(int n_layers, const int32_t *n_neurons, float r_in, float r_hidden, cfloat_p y, float *g, sfnn_buf_t *b);
 void sfnn_core_backprop(int n_layers, const int32_t *n_neurons, const int32_t *af, float r_in, float r_hidden, cfloat_p t, cfloat_p x, cfloat_p y, float *g, sfnn_buf_t *b);
 void sfnn_core_jacobian(int n_layers, const int32_t *n_neurons, const int32_t *af, cfloat_p t, cfloat_p x, int w, float *d, sfnn_buf_t *b);
+int sfnn_infer_buf_size(int n_layers, const int32_t *n_neurons);
+const float *sfnn_core_infer(int n_layers, const int32_t *n_neurons, const int32_t *af, cfloat_p t, cfloat_p x, int k_out, float *buf, float *logp);
 
 int sfnn_n_par(int n_layers, const int32_t *n_neurons);
 sfnn_buf_t *sfnn_buf_init(int n_layers, const int32_t *n_neurons, cfloat_p t);
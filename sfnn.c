@@ -62,9 +62,15 @@ void sfnn_core_forward(int n_layers, const int32_t *n_neurons, const int32_t *af
 	if (r_in > 0.0f && r_in < 1.0f) {
 		for (i = 0; i < n_neurons[0]; ++i)
 			b->out[0][i] = sann_drand() < r_in? 0.0f : x[i];
-	} else memcpy(b->out[0], x, n_neurons[0] * sizeof(float));
+	} else if (x != b->out[0]) memcpy(b->out[0], x, n_neurons[0] * sizeof(float));
 	for (k = 1; k < n_layers; ++k) {
 		sann_activate_f func = sann_get_af(af[k-1]);
+		if (af[k-1] == SANN_AF_SOFTMAX) { // output layer; deriv[] keeps the log-probabilities, which are used for the cost
+			for (j = 0; j < n_neurons[k]; ++j)
+				b->out[k][j] = q[k>1] * sann_sdot(n_neurons[k-1], b->w[k] + j * n_neurons[k-1], b->out[k-1]) + b->b[k][j];
+			sann_softmax(n_neurons[k], b->out[k], b->out[k], b->deriv[k]);
+			continue;
+		}
 		for (j = 0; j < n_neurons[k]; ++j)
 			if (k < n_layers - 1 && r_hidden > 0.0f && sann_drand() < r_hidden)
 				b->out[k][j] = b->deriv[k][j] = 0.0f;
@@ -72,11 +78,44 @@ void sfnn_core_forward(int n_layers, const int32_t *n_neurons, const int32_t *af
 	}
 }
 
+int sfnn_infer_buf_size(int n_layers, const int32_t *n_neurons)
+{
+	int k, max = 0;
+	for (k = 0; k < n_layers; ++k)
+		if (n_neurons[k] > max) max = n_neurons[k];
+	return 2 * max;
+}
+
+/*
+ * Forward pass for inference. Unlike sfnn_core_forward(), there is no dropout,
+ * derivatives are not computed, and layers above $k_out are skipped. Two
+ * layers are kept in $buf at a time. The output of layer $k_out is returned.
+ * If the output layer is softmax, $logp keeps the log-probabilities if not
+ * NULL.
+ */
+const float *sfnn_core_infer(int n_layers, const int32_t *n_neurons, const int32_t *af, cfloat_p t, cfloat_p x, int k_out, float *buf, float *logp)
+{
+	int j, k, max = sfnn_infer_buf_size(n_layers, n_neurons) / 2;
+	const float *in = x;
+	float *out = buf;
+	for (k = 1; k <= k_out; ++k) {
+		int n_in = n_neurons[k-1], n_k = n_neurons[k];
+		const float *bk = t, *wk = t + n_k;
+		t += n_k * (n_in + 1);
+		for (j = 0; j < n_k; ++j)
+			out[j] = sann_sdot(n_in, wk + j * n_in, in) + bk[j];
+		if (af[k-1] == SANN_AF_SOFTMAX && logp) sann_activate(af[k-1], n_k, out, logp);
+		else sann_activate(af[k-1], n_k, out, out == buf? buf + max : buf); // the input is not needed any more
+		in = out, out = out == buf? buf + max : buf;
+	}
+	return in;
+}
+
 void sfnn_core_backward(int n_layers, const int32_t *n_neurons, float r_in, float r_hidden, cfloat_p y, float *g, sfnn_buf_t *b)
 {
 	int i, j, k;
 	float q[2] = { 1.0f / (1.0f - r_in), 1.0f / (1.0f - r_hidden) };
-	for (j = 0, k = n_layers - 1; j < n_neurons[k]; ++j) // calculate delta[] at the output layer
+	for (j = 0, k = n_layers - 1; j < n_neurons[k]; ++j) // calculate delta[] at the output layer; the same for sigmoid and softmax
 		b->delta[k][j] = b->out[k][j] - y[j];
 	for (k = n_layers - 1; k > 1; --k) { // calculate delta[k-1]
 		memset(b->delta[k-1], 0, n_neurons[k-1] * sizeof(float));
@@ -95,7 +134,7 @@ void sfnn_core_backward(int n_layers, const int32_t *n_neurons, float r_in, floa
 
 void sfnn_core_backprop(int n_layers, const int32_t *n_neurons, const int32_t *af, float r_in, float r_hidden, cfloat_p t, cfloat_p x, cfloat_p y, float *g, sfnn_buf_t *b)
 {
-	assert(af[n_layers-2] == SANN_AF_SIGM);
+	assert(af[n_layers-2] == SANN_AF_SIGM || af[n_layers-2] == SANN_AF_SOFTMAX);
 	sfnn_core_forward(n_layers, n_neurons, af, r_in, r_hidden, t, x, b);
 	sfnn_core_backward(n_layers, n_neurons, r_in, r_hidden, y, g, b);
 }